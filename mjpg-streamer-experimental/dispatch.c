@@ -0,0 +1,384 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "mjpg_streamer.h"
+
+/* how often the threads check for the stop flag while no frames arrive */
+#define DISPATCH_POLL_MS 500
+
+/* frames on their way to one output */
+typedef struct _delivery delivery;
+struct _delivery {
+    pthread_mutex_t lock;
+    pthread_cond_t update;      /* a frame was queued or taken, or stop */
+    frame **ring;
+    int size;                   /* 1 for DELIVERY_LATEST */
+    int head, count;
+    int closed;                 /* the output unsubscribed */
+    pthread_t thread;
+    int running;
+};
+
+static struct _globals *pglobal;
+static pthread_t threads[MAX_INPUT_PLUGINS];
+static int running[MAX_INPUT_PLUGINS];
+
+/******************************************************************************
+Description.: returns the name of a delivery class
+Input Value.: delivery is DELIVERY_LATEST or DELIVERY_LOSSLESS
+Return Value: name as used for the metrics and JSON
+******************************************************************************/
+const char *delivery_name(int delivery)
+{
+    return (delivery == DELIVERY_LOSSLESS) ? "lossless" : "latest";
+}
+
+/******************************************************************************
+Description.: counts frames an output received
+Input Value.: out is the output, n the number of frames
+Return Value: -
+******************************************************************************/
+void output_delivered(struct _output *out, unsigned long n)
+{
+    metric_add(out->delivered, n);
+}
+
+/******************************************************************************
+Description.: counts frames an output did not receive
+Input Value.: out is the output, n the number of frames
+Return Value: -
+******************************************************************************/
+void output_dropped(struct _output *out, unsigned long n)
+{
+    metric_add(out->dropped, n);
+}
+
+/******************************************************************************
+Description.: computes the deadline of a wait for the stop flag
+Input Value.: deadline receives the time, CLOCK_REALTIME
+Return Value: -
+******************************************************************************/
+static void poll_deadline(struct timespec *deadline)
+{
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_nsec += DISPATCH_POLL_MS * 1000000L;
+    if(deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/******************************************************************************
+Description.: registers the counters of an output and prepares its queue,
+              called after output_init() chose the delivery class. Outputs
+              that read the frames themselves and do not call input_attach()
+              count as consumers of all inputs from now on.
+Input Value.: out is the output, id its number
+Return Value: -
+******************************************************************************/
+void dispatch_init_output(struct _output *out, int id)
+{
+    const char *name = delivery_name(out->delivery);
+    delivery *d;
+    int i;
+
+    out->delivered = metric_counter("mjpg_output_frames_delivered_total",
+                                    "Frames received by the output",
+                                    "output=\"%d\",class=\"%s\"", id, name);
+    out->dropped = metric_counter("mjpg_output_frames_dropped_total",
+                                  "Frames the output did not receive",
+                                  "output=\"%d\",class=\"%s\"", id, name);
+    out->backpressure = metric_counter("mjpg_output_backpressure_total",
+                                       "Frames the dispatcher had to wait for a full queue with",
+                                       "output=\"%d\",class=\"%s\"", id, name);
+
+    /* outputs reading frames themselves without telling us want all of them */
+    if(out->on_frame == NULL) {
+        if(!out->attaches) {
+            for(i = 0; i < out->param.global->incnt; i++)
+                input_attach(&out->param.global->in[i]);
+        }
+        return;
+    }
+
+    if(out->delivery != DELIVERY_LOSSLESS)
+        out->queue_size = 1;
+    else if(out->queue_size < 1)
+        out->queue_size = DELIVERY_QUEUE_SIZE;
+
+    d = calloc(1, sizeof(delivery));
+    if(d == NULL || (d->ring = calloc(out->queue_size, sizeof(frame *))) == NULL) {
+        LOG("not enough memory for the queue of output %d\n", id);
+        exit(EXIT_FAILURE);
+    }
+    d->size = out->queue_size;
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->update, NULL);
+    out->queue = d;
+}
+
+/******************************************************************************
+Description.: hands a frame to the queue of an output. Lossless outputs wait
+              for room, latest outputs lose the frame they did not take yet.
+Input Value.: out is the output, f the frame
+Return Value: 0 if queued, -1 if the output unsubscribed
+******************************************************************************/
+static int enqueue(output *out, frame *f)
+{
+    delivery *d = out->queue;
+    struct timespec deadline;
+    int waited = 0, rc;
+
+    pthread_mutex_lock(&d->lock);
+
+    if(out->delivery == DELIVERY_LOSSLESS) {
+        while(d->count == d->size && !d->closed && !pglobal->stop) {
+            if(!waited++)
+                metric_add(out->backpressure, 1);
+            poll_deadline(&deadline);
+            pthread_cond_timedwait(&d->update, &d->lock, &deadline);
+        }
+    } else if(d->count == d->size) {
+        frame_unref(d->ring[d->head]);
+        d->head = (d->head + 1) % d->size;
+        d->count--;
+        metric_add(out->dropped, 1);
+    }
+
+    if(d->closed || d->count == d->size) {
+        rc = d->closed ? -1 : 0;
+        pthread_mutex_unlock(&d->lock);
+        return rc;
+    }
+
+    d->ring[(d->head + d->count) % d->size] = frame_ref(f);
+    d->count++;
+    pthread_cond_broadcast(&d->update);
+    pthread_mutex_unlock(&d->lock);
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: passes the queued frames to an output. When stopping, queued
+              frames of lossless outputs are still delivered.
+Input Value.: arg is the number of the output
+Return Value: NULL
+******************************************************************************/
+static void *delivery_thread(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    output *out = &pglobal->out[id];
+    delivery *d = out->queue;
+    struct timespec deadline;
+    frame *f;
+    int rc;
+
+    pthread_mutex_lock(&d->lock);
+    while(1) {
+        if(d->count == 0) {
+            if(pglobal->stop)
+                break;
+            poll_deadline(&deadline);
+            pthread_cond_timedwait(&d->update, &d->lock, &deadline);
+            continue;
+        }
+
+        f = d->ring[d->head];
+        d->head = (d->head + 1) % d->size;
+        d->count--;
+        pthread_cond_broadcast(&d->update);
+        pthread_mutex_unlock(&d->lock);
+
+        rc = out->on_frame(out->param.id, f);
+        frame_unref(f);
+
+        pthread_mutex_lock(&d->lock);
+        if(rc < 0) {
+            DBG("output %d unsubscribed\n", id);
+            d->closed = 1;
+            break;
+        }
+        metric_add(out->delivered, 1);
+    }
+
+    /* frames left over after unsubscribing */
+    while(d->count > 0) {
+        frame_unref(d->ring[d->head]);
+        d->head = (d->head + 1) % d->size;
+        d->count--;
+    }
+    pthread_cond_broadcast(&d->update);
+    pthread_mutex_unlock(&d->lock);
+
+    DBG("leaving delivery thread of output %d\n", id);
+    return NULL;
+}
+
+/******************************************************************************
+Description.: collects the outputs subscribed to an input, lossless outputs
+              first, then the ones of higher priority, outputs that are equal
+              in both in the order of the command line
+Input Value.: input is the number of the input
+              ids receives the numbers of the outputs
+Return Value: number of outputs stored in ids
+******************************************************************************/
+static int subscribers(int input, int *ids)
+{
+    int i, j, n = 0;
+    output *a, *b;
+
+    for(i = 0; i < pglobal->outcnt; i++) {
+        b = &pglobal->out[i];
+        if(b->on_frame == NULL || b->input != input)
+            continue;
+
+        /* insertion sort, the list is tiny */
+        for(j = n; j > 0; j--) {
+            a = &pglobal->out[ids[j - 1]];
+            if(a->delivery > b->delivery ||
+               (a->delivery == b->delivery && a->priority >= b->priority))
+                break;
+            ids[j] = ids[j - 1];
+        }
+        ids[j] = i;
+        n++;
+    }
+
+    return n;
+}
+
+/******************************************************************************
+Description.: waits for every frame of an input and queues it for the
+              subscribed outputs
+Input Value.: arg is the number of the input
+Return Value: NULL
+******************************************************************************/
+static void *dispatch_thread(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    input *in = &pglobal->in[id];
+    int ids[MAX_OUTPUT_PLUGINS];
+    int i, n, kept;
+    unsigned long last_seq = 0, skipped;
+    frame *f;
+
+    n = subscribers(id, ids);
+    input_attach(in);
+
+    while(!pglobal->stop && n > 0) {
+        f = input_wait_newer(in, last_seq, DISPATCH_POLL_MS, &skipped);
+        if(f == NULL)
+            continue;
+        last_seq = f->sequence;
+
+        for(i = 0, kept = 0; i < n; i++) {
+            /* the dispatcher fell behind the history of the input */
+            if(skipped > 0)
+                metric_add(pglobal->out[ids[i]].dropped, skipped);
+
+            if(enqueue(&pglobal->out[ids[i]], f) < 0)
+                continue;
+            ids[kept++] = ids[i];
+        }
+        n = kept;
+
+        frame_unref(f);
+    }
+
+    input_detach(in);
+    DBG("leaving dispatcher of input %d\n", id);
+    return NULL;
+}
+
+/******************************************************************************
+Description.: starts the delivery threads of the push outputs and one
+              dispatcher for every input that has some
+Input Value.: global is the configuration with the loaded plugins
+Return Value: 0 if all threads were started, -1 otherwise
+******************************************************************************/
+int dispatch_start(struct _globals *global)
+{
+    int i, ids[MAX_OUTPUT_PLUGINS];
+
+    pglobal = global;
+
+    for(i = 0; i < pglobal->outcnt; i++) {
+        if(pglobal->out[i].on_frame == NULL)
+            continue;
+        if(pglobal->out[i].input < 0 || pglobal->out[i].input >= pglobal->incnt) {
+            LOG("output %d subscribes to input %d, which does not exist\n", i, pglobal->out[i].input);
+            return -1;
+        }
+
+        if(pthread_create(&pglobal->out[i].queue->thread, NULL, delivery_thread, (void *)(intptr_t)i) != 0) {
+            LOG("could not start the delivery thread of output %d\n", i);
+            return -1;
+        }
+        pglobal->out[i].queue->running = 1;
+    }
+
+    for(i = 0; i < pglobal->incnt; i++) {
+        if(subscribers(i, ids) == 0)
+            continue;
+
+        if(pthread_create(&threads[i], NULL, dispatch_thread, (void *)(intptr_t)i) != 0) {
+            LOG("could not start the dispatcher of input %d\n", i);
+            return -1;
+        }
+        running[i] = 1;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: waits until the dispatcher and delivery threads noticed
+              pglobal->stop, after this no output_on_frame() is called anymore
+Input Value.: global is the configuration
+Return Value: -
+******************************************************************************/
+void dispatch_stop(struct _globals *global)
+{
+    int i;
+
+    for(i = 0; i < global->incnt; i++) {
+        if(!running[i])
+            continue;
+        pthread_join(threads[i], NULL);
+        running[i] = 0;
+    }
+
+    for(i = 0; i < global->outcnt; i++) {
+        if(global->out[i].queue == NULL || !global->out[i].queue->running)
+            continue;
+        pthread_join(global->out[i].queue->thread, NULL);
+        global->out[i].queue->running = 0;
+    }
+}
@@ -0,0 +1,78 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+/*
+ * Output plugins either read the frames themselves with one of the
+ * input_wait_*() functions in a thread of their own, or export
+ *
+ *     int output_on_frame(int id, frame *f);
+ *
+ * and let the core push the frames to them. For every input that has such
+ * outputs the core runs one dispatcher thread, which waits for each new
+ * frame and hands it to the outputs subscribed to the input (out[id].input,
+ * 0 unless output_init() changed it). Every output has a delivery thread of
+ * its own that calls output_on_frame(), so a slow output does not hold up
+ * the others. The frame is only borrowed for the duration of the call, a
+ * plugin that keeps it longer takes its own reference with frame_ref().
+ * Returning a negative value ends the subscription.
+ *
+ * How frames reach an output depends on its delivery class, chosen in
+ * output_init():
+ *
+ * DELIVERY_LOSSLESS  frames are queued, up to out[id].queue_size of them.
+ *                    If the queue is full the dispatcher waits for the
+ *                    output (counted as backpressure). For recordings.
+ * DELIVERY_LATEST    only the newest frame is kept, a frame the output
+ *                    did not pick up in time is replaced and dropped.
+ *                    For viewers, this is the default.
+ *
+ * The dispatcher serves lossless outputs first, then the ones of higher
+ * out[id].priority. Frames can still be lost by every class if the
+ * dispatcher falls behind the history of the input, for example because a
+ * lossless output stays blocked.
+ *
+ * The frames delivered to and dropped for each output are counted in the
+ * metrics registry, labelled with the output and its class. Outputs that
+ * read the frames themselves report theirs with output_delivered() and
+ * output_dropped().
+ */
+
+#define DELIVERY_LATEST     0
+#define DELIVERY_LOSSLESS   1
+
+/* default length of the queue of lossless outputs */
+#define DELIVERY_QUEUE_SIZE 32
+
+struct _globals;
+struct _output;
+
+void dispatch_init_output(struct _output *out, int id);
+int dispatch_start(struct _globals *pglobal);
+void dispatch_stop(struct _globals *pglobal);
+const char *delivery_name(int delivery);
+void output_delivered(struct _output *out, unsigned long n);
+void output_dropped(struct _output *out, unsigned long n);
+
+#endif
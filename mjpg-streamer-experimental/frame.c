@@ -0,0 +1,480 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "mjpg_streamer.h"
+
+/******************************************************************************
+Description.: allocates a frame with room for capacity bytes of JPEG data
+              the caller owns the only reference
+Input Value.: capacity is the size of the data buffer in bytes
+Return Value: the new frame or NULL if there is not enough memory
+******************************************************************************/
+frame *frame_new(int capacity)
+{
+    frame *f;
+
+    if(capacity < 0)
+        return NULL;
+
+    /* header and data share a single allocation */
+    f = malloc(sizeof(frame) + capacity);
+    if(f == NULL)
+        return NULL;
+
+    f->data = (unsigned char *)(f + 1);
+    f->size = 0;
+    f->capacity = capacity;
+    f->timestamp.tv_sec = 0;
+    f->timestamp.tv_usec = 0;
+    f->sequence = 0;
+    f->published.tv_sec = 0;
+    f->published.tv_nsec = 0;
+    f->dequeued = f->published;
+    f->encode_start = f->published;
+    f->encode_end = f->published;
+    f->iovcnt = 0;
+    f->release = NULL;
+    f->opaque = NULL;
+    f->refcount = 1;
+
+    return f;
+}
+
+/******************************************************************************
+Description.: makes a frame of memory the caller owns, without copying it.
+              The picture is the concatenation of the pieces, for example a
+              driver buffer with a table inserted in between.
+Input Value.: iov and iovcnt describe the pieces, at most FRAME_IOV_MAX
+              release is called with opaque when the last reference is gone,
+              the memory must stay valid until then
+Return Value: the new frame or NULL if there is not enough memory
+******************************************************************************/
+frame *frame_wrap(const struct iovec *iov, int iovcnt, void (*release)(void *opaque), void *opaque)
+{
+    frame *f;
+    int i;
+
+    if(iovcnt < 1 || iovcnt > FRAME_IOV_MAX)
+        return NULL;
+
+    f = frame_new(0);
+    if(f == NULL)
+        return NULL;
+
+    f->data = NULL;
+    for(i = 0; i < iovcnt; i++) {
+        f->iov[i] = iov[i];
+        f->size += iov[i].iov_len;
+    }
+    f->capacity = f->size;
+    f->iovcnt = iovcnt;
+    f->release = release;
+    f->opaque = opaque;
+
+    return f;
+}
+
+/******************************************************************************
+Description.: describes the picture of a frame for writev() or sendmsg()
+Input Value.: f is the frame, iov must have room for FRAME_IOV_MAX entries
+Return Value: number of entries used
+******************************************************************************/
+int frame_iov(frame *f, struct iovec *iov)
+{
+    int i;
+
+    if(f->iovcnt == 0) {
+        iov[0].iov_base = f->data;
+        iov[0].iov_len = f->size;
+        return 1;
+    }
+
+    for(i = 0; i < f->iovcnt; i++)
+        iov[i] = f->iov[i];
+
+    return f->iovcnt;
+}
+
+/******************************************************************************
+Description.: returns the picture as one piece of memory. Frames of
+              frame_wrap() are copied once on the first call, for consumers
+              such as decoders that cannot work on pieces.
+Input Value.: f is the frame
+Return Value: the data or NULL if there is not enough memory
+******************************************************************************/
+unsigned char *frame_data(frame *f)
+{
+    unsigned char *flat;
+    int i, pos = 0;
+
+    if(f->data != NULL)
+        return f->data;
+
+    flat = malloc(f->size);
+    if(flat == NULL)
+        return NULL;
+
+    for(i = 0; i < f->iovcnt; i++) {
+        memcpy(flat + pos, f->iov[i].iov_base, f->iov[i].iov_len);
+        pos += f->iov[i].iov_len;
+    }
+
+    /* another consumer may have been faster */
+    if(!__sync_bool_compare_and_swap(&f->data, NULL, flat))
+        free(flat);
+
+    return f->data;
+}
+
+/******************************************************************************
+Description.: takes an additional reference to a frame
+Input Value.: f may be NULL
+Return Value: f
+******************************************************************************/
+frame *frame_ref(frame *f)
+{
+    if(f != NULL)
+        __sync_add_and_fetch(&f->refcount, 1);
+
+    return f;
+}
+
+/******************************************************************************
+Description.: drops a reference, the last one frees the frame
+Input Value.: f may be NULL
+Return Value: -
+******************************************************************************/
+void frame_unref(frame *f)
+{
+    if(f == NULL)
+        return;
+
+    if(__sync_sub_and_fetch(&f->refcount, 1) != 0)
+        return;
+
+    /* wrapped memory goes back to its owner, the copy of frame_data() is ours */
+    if(f->release != NULL) {
+        f->release(f->opaque);
+        free(f->data);
+    }
+    free(f);
+}
+
+/******************************************************************************
+Description.: calculates how long ago a frame was published
+Input Value.: f is a published frame
+Return Value: age in milliseconds
+******************************************************************************/
+int frame_age_ms(frame *f)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - f->published.tv_sec) * 1000 +
+           (now.tv_nsec - f->published.tv_nsec) / 1000000;
+}
+
+/******************************************************************************
+Description.: makes f the current frame of an input and wakes up all waiting
+              consumers. The reference of the caller is handed over to the
+              input, so the caller must not touch f afterwards.
+              The frame is kept in the history ring of the input until
+              INPUT_FRAME_HISTORY newer frames were published.
+              in->buf, in->size and in->timestamp keep pointing at the current
+              frame for plugins that still read them while holding in->db,
+              in->buf is NULL for frames of frame_wrap().
+Input Value.: in is the publishing input, f the filled frame
+Return Value: -
+******************************************************************************/
+void input_publish(input *in, frame *f)
+{
+    frame **slot, *old;
+    long interval;
+
+    input_lock(in);
+
+    clock_gettime(CLOCK_MONOTONIC, &f->published);
+
+    /* the rate follows the interval between the frames, smoothed over a few of them */
+    if(in->frame != NULL) {
+        interval = (f->published.tv_sec - in->frame->published.tv_sec) * 1000000L +
+                   (f->published.tv_nsec - in->frame->published.tv_nsec) / 1000;
+        if(interval > 0 && in->fps != NULL)
+            metric_set(in->fps, in->fps->value + (1000000000L / interval - in->fps->value) / 8);
+    }
+    metric_add(in->published, 1);
+    f->sequence = ++in->sequence;
+    slot = &in->history[f->sequence % INPUT_FRAME_HISTORY];
+    old = *slot;
+    *slot = f;
+    in->frame = f;
+
+    in->buf = f->data;
+    in->size = f->size;
+    in->timestamp = f->timestamp;
+
+    TRACE_PROBE3(frame_publish, in->param.id, f->sequence, f->size);
+
+    /* keep the frame for the trace, the lock must not wait for its file */
+    if(tracing)
+        frame_ref(f);
+
+    pthread_cond_broadcast(&in->db_update);
+    input_unlock(in);
+
+    if(tracing) {
+        trace_frame(in->param.id, f);
+        frame_unref(f);
+    }
+
+    /* the old frame lives on as long as consumers hold references */
+    frame_unref(old);
+}
+
+/******************************************************************************
+Description.: drops all frames of an input, used when it shuts down
+Input Value.: in is the input
+Return Value: -
+******************************************************************************/
+void input_release_frame(input *in)
+{
+    frame *old[INPUT_FRAME_HISTORY];
+    int i;
+
+    input_lock(in);
+    for(i = 0; i < INPUT_FRAME_HISTORY; i++) {
+        old[i] = in->history[i];
+        in->history[i] = NULL;
+    }
+    in->frame = NULL;
+    in->buf = NULL;
+    in->size = 0;
+    input_unlock(in);
+
+    for(i = 0; i < INPUT_FRAME_HISTORY; i++)
+        frame_unref(old[i]);
+}
+
+/******************************************************************************
+Description.: registers a consumer of the frames of an input. Inputs that
+              know how may skip the work for frames nobody waits for, so
+              streams, snapshots and outputs attach before they wait.
+Input Value.: in is the input
+Return Value: -
+******************************************************************************/
+void input_attach(input *in)
+{
+    int n = __sync_add_and_fetch(&in->consumers, 1);
+
+    metric_set(in->attached, n);
+
+    /* wake an input waiting in input_wait_consumers() */
+    if(n == 1) {
+        input_lock(in);
+        pthread_cond_broadcast(&in->db_update);
+        input_unlock(in);
+    }
+}
+
+/******************************************************************************
+Description.: unregisters a consumer added with input_attach()
+Input Value.: in is the input
+Return Value: -
+******************************************************************************/
+void input_detach(input *in)
+{
+    metric_set(in->attached, __sync_sub_and_fetch(&in->consumers, 1));
+}
+
+/******************************************************************************
+Description.: returns the number of attached consumers, inputs check it for
+              every frame and do not need a lock for that
+Input Value.: in is the input
+Return Value: number of consumers
+******************************************************************************/
+int input_consumers(input *in)
+{
+    return __sync_add_and_fetch(&in->consumers, 0);
+}
+
+/******************************************************************************
+Description.: lets an input that suspended its device wait for the first
+              consumer to attach
+Input Value.: in is the input
+              timeout_ms is the maximum time to wait
+Return Value: number of consumers, 0 if the timeout expired
+******************************************************************************/
+int input_wait_consumers(input *in, int timeout_ms)
+{
+    struct timespec deadline;
+    int rc = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    input_lock(in);
+    while(input_consumers(in) == 0 && rc != ETIMEDOUT)
+        rc = input_cond_timedwait(in, &deadline);
+    input_unlock(in);
+
+    return input_consumers(in);
+}
+
+/******************************************************************************
+Description.: returns the sequence number of the most recently published frame
+              passing it to input_wait_newer() waits for the next frame
+Input Value.: in is the input
+Return Value: sequence number, 0 if nothing was published yet
+******************************************************************************/
+unsigned long input_sequence(input *in)
+{
+    unsigned long seq;
+
+    input_lock(in);
+    seq = in->sequence;
+    input_unlock(in);
+
+    return seq;
+}
+
+/******************************************************************************
+Description.: returns the most recently published frame without waiting,
+              as long as it is not older than max_age_ms
+Input Value.: in is the input to read from
+              max_age_ms is the accepted age of the frame in milliseconds
+Return Value: a new reference, the caller must frame_unref() it,
+              NULL if there is no frame or it is too old
+******************************************************************************/
+frame *input_latest(input *in, int max_age_ms)
+{
+    frame *f = NULL;
+
+    input_lock(in);
+    if(in->frame != NULL && frame_age_ms(in->frame) <= max_age_ms)
+        f = frame_ref(in->frame);
+    input_unlock(in);
+
+    return f;
+}
+
+/******************************************************************************
+Description.: waits until a frame newer than last_seq was published and picks
+              either the one following last_seq or the newest one
+Input Value.: in is the input to read from
+              last_seq is the sequence number of the last frame received
+              timeout_ms is the maximum time to wait, negative waits forever
+              skipped receives the number of frames that were lost, may be NULL
+              latest selects the newest frame instead of the following one
+Return Value: a new reference, NULL if the timeout expired
+******************************************************************************/
+static frame *wait_frame(input *in, unsigned long last_seq, int timeout_ms, unsigned long *skipped, int latest)
+{
+    struct timespec deadline;
+    unsigned long next, oldest;
+    frame *f = NULL;
+    int rc = 0;
+
+    if(timeout_ms > 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    input_lock(in);
+
+    /* the loop also protects against spurious wakeups */
+    while(in->sequence <= last_seq || in->frame == NULL) {
+        if(timeout_ms == 0 || rc == ETIMEDOUT)
+            goto out;
+
+        if(timeout_ms < 0)
+            input_cond_wait(in);
+        else
+            rc = input_cond_timedwait(in, &deadline);
+    }
+
+    oldest = (in->sequence > INPUT_FRAME_HISTORY) ? in->sequence - INPUT_FRAME_HISTORY + 1 : 1;
+    next = (last_seq == 0 || latest) ? in->sequence : last_seq + 1;
+    if(next < oldest)
+        next = oldest;
+
+    if(skipped != NULL)
+        *skipped = (last_seq == 0) ? 0 : next - last_seq - 1;
+
+    f = frame_ref(in->history[next % INPUT_FRAME_HISTORY]);
+
+out:
+    input_unlock(in);
+    return f;
+}
+
+/******************************************************************************
+Description.: returns the frame following last_seq, waiting for it if it was
+              not published yet. Each frame is returned exactly once to a
+              consumer that passes the sequence of the previous result. If
+              the consumer fell behind further than the history reaches it
+              continues with the oldest frame still available.
+              A last_seq of 0 returns the newest frame.
+Input Value.: in is the input to read from
+              last_seq is the sequence number of the last frame received
+              timeout_ms is the maximum time to wait, negative waits forever
+              skipped receives the number of frames that were lost, may be NULL
+Return Value: a new reference, the caller must frame_unref() it,
+              NULL if the timeout expired
+******************************************************************************/
+frame *input_wait_newer(input *in, unsigned long last_seq, int timeout_ms, unsigned long *skipped)
+{
+    return wait_frame(in, last_seq, timeout_ms, skipped, 0);
+}
+
+/******************************************************************************
+Description.: returns the newest frame if it is newer than last_seq, waiting
+              for one otherwise. Frames published while the consumer was busy
+              with the previous one are dropped, so slow consumers always get
+              the current picture at a lower rate instead of falling behind.
+Input Value.: in is the input to read from
+              last_seq is the sequence number of the last frame received
+              timeout_ms is the maximum time to wait, negative waits forever
+              skipped receives the number of frames that were dropped, may be NULL
+Return Value: a new reference, the caller must frame_unref() it,
+              NULL if the timeout expired
+******************************************************************************/
+frame *input_wait_latest(input *in, unsigned long last_seq, int timeout_ms, unsigned long *skipped)
+{
+    return wait_frame(in, last_seq, timeout_ms, skipped, 1);
+}
@@ -0,0 +1,81 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
+
+/* number of recently published frames every input keeps around */
+#define INPUT_FRAME_HISTORY 4
+
+/* pieces a frame made with frame_wrap() may consist of */
+#define FRAME_IOV_MAX 3
+
+/*
+ * A frame is an immutable, reference counted JPEG picture. Input plugins
+ * fill a fresh frame and hand it over with input_publish(), output plugins
+ * take their own reference while holding in[n].db and drop it again once
+ * the data was written. The data must not be changed after publishing.
+ * Inputs may also publish memory they own with frame_wrap(), they get it
+ * back through the release callback once the last reference is dropped.
+ */
+typedef struct _frame frame;
+struct _frame {
+    unsigned char *data;
+    int size;               /* number of valid bytes in data */
+    int capacity;           /* number of bytes allocated for data */
+
+    struct timeval timestamp;
+    unsigned long sequence; /* set by input_publish(), starts at 1 */
+    struct timespec published; /* CLOCK_MONOTONIC, set by input_publish() */
+
+    /* stages before publishing, CLOCK_MONOTONIC, set by inputs that know them, see trace.h */
+    struct timespec dequeued;
+    struct timespec encode_start;
+    struct timespec encode_end;
+
+    /*
+     * Frames made with frame_wrap() point into memory of the input, e.g. a
+     * driver buffer, and may consist of several pieces. Their data is NULL
+     * until someone calls frame_data(), consumers that can should send the
+     * pieces of frame_iov() instead.
+     */
+    struct iovec iov[FRAME_IOV_MAX];
+    int iovcnt;                 /* 0 for frames of frame_new() */
+    void (*release)(void *opaque);
+    void *opaque;
+
+    int refcount;
+};
+
+frame *frame_new(int capacity);
+frame *frame_wrap(const struct iovec *iov, int iovcnt, void (*release)(void *opaque), void *opaque);
+int frame_iov(frame *f, struct iovec *iov);
+unsigned char *frame_data(frame *f);
+frame *frame_ref(frame *f);
+void frame_unref(frame *f);
+int frame_age_ms(frame *f);
+
+#endif
@@ -0,0 +1,248 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifdef LOCK_STATS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "mjpg_streamer.h"
+
+/******************************************************************************
+Description.: records a duration in a histogram, the caller holds the lock
+              the statistics belong to
+Input Value.: h is the histogram, from and to limit the duration
+Return Value: -
+******************************************************************************/
+static void histogram_add(lock_histogram *h, struct timespec *from, struct timespec *to)
+{
+    long long ns = (to->tv_sec - from->tv_sec) * 1000000000LL + (to->tv_nsec - from->tv_nsec);
+    int bucket = 0;
+
+    if(ns < 0)
+        ns = 0;
+
+    while(bucket < LOCK_STATS_BUCKETS - 1 && (ns >> (bucket + 1)) > 0)
+        bucket++;
+
+    h->count++;
+    h->sum_ns += ns;
+    if(ns > h->max_ns)
+        h->max_ns = ns;
+    h->buckets[bucket]++;
+}
+
+/******************************************************************************
+Description.: locks in->db and measures how long that took
+Input Value.: in is the input
+Return Value: the result of pthread_mutex_lock()
+******************************************************************************/
+int input_lock(input *in)
+{
+    lock_stats *s = &in->db_stats;
+    struct timespec start, now;
+    int waiting, rc;
+
+    /* uncontended acquisitions are not delayed by taking the time */
+    if(pthread_mutex_trylock(&in->db) == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &s->locked);
+        histogram_add(&s->wait, &s->locked, &s->locked);
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    waiting = __sync_fetch_and_add(&s->waiters, 1);
+
+    rc = pthread_mutex_lock(&in->db);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    __sync_fetch_and_sub(&s->waiters, 1);
+    if(rc != 0)
+        return rc;
+
+    s->locked = now;
+    s->contended++;
+    s->waiters_seen[(waiting < LOCK_STATS_WAITERS) ? waiting : LOCK_STATS_WAITERS - 1]++;
+    histogram_add(&s->wait, &start, &now);
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: unlocks in->db and records how long it was held
+Input Value.: in is the input
+Return Value: -
+******************************************************************************/
+void input_unlock(input *in)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    histogram_add(&in->db_stats.hold, &in->db_stats.locked, &now);
+    pthread_mutex_unlock(&in->db);
+}
+
+/******************************************************************************
+Description.: waits for in->db_update, the lock is not held while waiting
+              so the time until then counts as held
+Input Value.: in is the input, the caller holds in->db
+Return Value: the result of pthread_cond_wait()
+******************************************************************************/
+int input_cond_wait(input *in)
+{
+    struct timespec now;
+    int rc;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    histogram_add(&in->db_stats.hold, &in->db_stats.locked, &now);
+
+    rc = pthread_cond_wait(&in->db_update, &in->db);
+
+    clock_gettime(CLOCK_MONOTONIC, &in->db_stats.locked);
+    return rc;
+}
+
+/******************************************************************************
+Description.: waits for in->db_update until the deadline, see input_cond_wait()
+Input Value.: in is the input, the caller holds in->db
+              deadline is an absolute CLOCK_REALTIME time
+Return Value: the result of pthread_cond_timedwait()
+******************************************************************************/
+int input_cond_timedwait(input *in, struct timespec *deadline)
+{
+    struct timespec now;
+    int rc;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    histogram_add(&in->db_stats.hold, &in->db_stats.locked, &now);
+
+    rc = pthread_cond_timedwait(&in->db_update, &in->db, deadline);
+
+    clock_gettime(CLOCK_MONOTONIC, &in->db_stats.locked);
+    return rc;
+}
+
+/******************************************************************************
+Description.: prints a histogram as JSON object, only buckets in use are listed
+Input Value.: out is the stream, name the key, h the histogram
+Return Value: -
+******************************************************************************/
+static void histogram_print(FILE *out, const char *name, lock_histogram *h)
+{
+    int i, first = 1;
+
+    fprintf(out, "\"%s\": {\"count\": %lu, \"sum\": %llu, \"max\": %llu, \"buckets\": [",
+            name, h->count, h->sum_ns, h->max_ns);
+    for(i = 0; i < LOCK_STATS_BUCKETS; i++) {
+        if(h->buckets[i] == 0)
+            continue;
+        fprintf(out, "%s{\"le\": %llu, \"count\": %lu}", first ? "" : ", ",
+                (1ULL << (i + 1)) - 1, h->buckets[i]);
+        first = 0;
+    }
+    fprintf(out, "]}");
+}
+
+/******************************************************************************
+Description.: prints the lock statistics of all inputs as JSON, durations are
+              given in nanoseconds
+Input Value.: out is the stream, pglobal lists the inputs
+Return Value: -
+******************************************************************************/
+void lockstats_print(FILE *out, globals *pglobal)
+{
+    lock_stats s;
+    int i, j;
+
+    fprintf(out, "{\n\"inputs\": [\n");
+    for(i = 0; i < pglobal->incnt; i++) {
+        /* a copy, so the figures belong together */
+        pthread_mutex_lock(&pglobal->in[i].db);
+        s = pglobal->in[i].db_stats;
+        pthread_mutex_unlock(&pglobal->in[i].db);
+
+        fprintf(out, "{\n\"input\": %d,\n\"acquired\": %lu,\n\"contended\": %lu,\n\"waiting\": %d,\n",
+                i, s.wait.count, s.contended, s.waiters);
+        fprintf(out, "\"waiters\": [");
+        for(j = 0; j < LOCK_STATS_WAITERS; j++)
+            fprintf(out, "%s%lu", (j > 0) ? ", " : "", s.waiters_seen[j]);
+        fprintf(out, "],\n");
+        histogram_print(out, "wait_ns", &s.wait);
+        fprintf(out, ",\n");
+        histogram_print(out, "hold_ns", &s.hold);
+        fprintf(out, "\n}%s\n", (i < pglobal->incnt - 1) ? "," : "");
+    }
+    fprintf(out, "]\n}\n");
+}
+
+/******************************************************************************
+Description.: thread that prints the statistics whenever SIGUSR1 arrives
+Input Value.: arg is the global context
+Return Value: never returns
+******************************************************************************/
+static void *lockstats_thread(void *arg)
+{
+    sigset_t set;
+    int sig;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+
+    while(1) {
+        if(sigwait(&set, &sig) != 0)
+            continue;
+        lockstats_print(stderr, arg);
+        fflush(stderr);
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: blocks SIGUSR1 and starts a thread that dumps the statistics
+              when it arrives, must be called before any other thread starts
+              so all of them inherit the blocked signal
+Input Value.: pglobal is the global context
+Return Value: 0 on success, -1 otherwise
+******************************************************************************/
+int lockstats_start(globals *pglobal)
+{
+    pthread_t thread;
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    if(pthread_sigmask(SIG_BLOCK, &set, NULL) != 0)
+        return -1;
+
+    if(pthread_create(&thread, NULL, lockstats_thread, pglobal) != 0)
+        return -1;
+    pthread_detach(thread);
+
+    return 0;
+}
+
+#endif
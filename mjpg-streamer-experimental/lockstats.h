@@ -0,0 +1,77 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef LOCKSTATS_H
+#define LOCKSTATS_H
+
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Every input and output serializes on in[n].db, so all plugins lock it
+ * through input_lock() and input_unlock(). Built with -DLOCK_STATS=ON these
+ * measure how long threads wait for the lock, how long they hold it and how
+ * many threads were already waiting, otherwise they are plain mutex calls.
+ * The statistics are listed by output_http at /locks.json and written to
+ * stderr when the process receives SIGUSR1.
+ */
+
+/* bucket i counts durations from 2^i up to 2^(i+1) nanoseconds */
+#define LOCK_STATS_BUCKETS 32
+/* threads found waiting, the last entry counts this many and more */
+#define LOCK_STATS_WAITERS 16
+
+typedef struct {
+    unsigned long count;
+    unsigned long long sum_ns;
+    unsigned long long max_ns;
+    unsigned long buckets[LOCK_STATS_BUCKETS];
+} lock_histogram;
+
+typedef struct _lock_stats lock_stats;
+struct _lock_stats {
+    lock_histogram wait;        /* until the lock was acquired */
+    lock_histogram hold;        /* from acquiring until releasing or waiting for frames */
+    unsigned long contended;    /* acquisitions that found the lock taken */
+    int waiters;                /* threads waiting for the lock right now */
+    unsigned long waiters_seen[LOCK_STATS_WAITERS];
+    struct timespec locked;     /* when the current holder acquired it */
+};
+
+#ifdef LOCK_STATS
+struct _input;
+struct _globals;
+
+int input_lock(struct _input *in);
+void input_unlock(struct _input *in);
+int input_cond_wait(struct _input *in);
+int input_cond_timedwait(struct _input *in, struct timespec *deadline);
+void lockstats_print(FILE *out, struct _globals *pglobal);
+int lockstats_start(struct _globals *pglobal);
+#else
+#define input_lock(in)                      pthread_mutex_lock(&(in)->db)
+#define input_unlock(in)                    pthread_mutex_unlock(&(in)->db)
+#define input_cond_wait(in)                 pthread_cond_wait(&(in)->db_update, &(in)->db)
+#define input_cond_timedwait(in, deadline)  pthread_cond_timedwait(&(in)->db_update, &(in)->db, deadline)
+#endif
+
+#endif
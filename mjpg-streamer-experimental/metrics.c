@@ -0,0 +1,279 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "mjpg_streamer.h"
+
+static metric registry[METRICS_MAX];
+static int registered = 0;
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static const long bucket_bounds[METRIC_BUCKETS] = METRIC_BUCKET_BOUNDS;
+
+/******************************************************************************
+Description.: finds a metric or adds it to the registry
+              only the registration takes a lock, readers see an entry once
+              it is complete because the count is raised afterwards
+Input Value.: type, name, help and scale of the metric
+              labels is a printf format for the labels, args its arguments
+Return Value: the metric, NULL if the registry is full
+******************************************************************************/
+static metric *metric_register(metric_type type, const char *name, const char *help,
+                               long scale, const char *labels, va_list args)
+{
+    char formatted[sizeof(registry[0].labels)];
+    metric *m = NULL;
+    int i;
+
+    if(labels != NULL)
+        vsnprintf(formatted, sizeof(formatted), labels, args);
+    else
+        formatted[0] = '\0';
+
+    pthread_mutex_lock(&registry_mutex);
+    for(i = 0; i < registered; i++) {
+        if(strcmp(registry[i].name, name) == 0 && strcmp(registry[i].labels, formatted) == 0) {
+            m = &registry[i];
+            goto out;
+        }
+    }
+
+    if(registered == METRICS_MAX) {
+        syslog(LOG_WARNING, "metrics registry is full, %s is not recorded", name);
+        goto out;
+    }
+
+    m = &registry[registered];
+    memset(m, 0, sizeof(metric));
+    m->type = type;
+    m->scale = (scale > 0) ? scale : 1;
+    snprintf(m->name, sizeof(m->name), "%s", name);
+    snprintf(m->labels, sizeof(m->labels), "%s", formatted);
+    snprintf(m->help, sizeof(m->help), "%s", help);
+
+    __sync_synchronize();
+    registered++;
+
+out:
+    pthread_mutex_unlock(&registry_mutex);
+    return m;
+}
+
+/******************************************************************************
+Description.: registers a counter, a value that only grows
+Input Value.: name and help text of the metric, labels is a printf format
+              followed by its arguments, NULL for no labels
+Return Value: the metric, NULL if the registry is full
+              registering the same name and labels again returns the same metric
+******************************************************************************/
+metric *metric_counter(const char *name, const char *help, const char *labels, ...)
+{
+    va_list args;
+    metric *m;
+
+    va_start(args, labels);
+    m = metric_register(METRIC_COUNTER, name, help, 1, labels, args);
+    va_end(args);
+
+    return m;
+}
+
+/******************************************************************************
+Description.: registers a gauge, a value that goes up and down
+Input Value.: name and help text of the metric
+              scale divides the value when it is exported, e.g. 1000 for a
+              value kept in thousandths
+              labels is a printf format followed by its arguments
+Return Value: the metric, NULL if the registry is full
+******************************************************************************/
+metric *metric_gauge(const char *name, const char *help, long scale, const char *labels, ...)
+{
+    va_list args;
+    metric *m;
+
+    va_start(args, labels);
+    m = metric_register(METRIC_GAUGE, name, help, scale, labels, args);
+    va_end(args);
+
+    return m;
+}
+
+/******************************************************************************
+Description.: registers a histogram of durations, observed in microseconds
+              and exported in seconds with the buckets of METRIC_BUCKET_BOUNDS
+Input Value.: name and help text of the metric, labels is a printf format
+              followed by its arguments
+Return Value: the metric, NULL if the registry is full
+******************************************************************************/
+metric *metric_histogram(const char *name, const char *help, const char *labels, ...)
+{
+    va_list args;
+    metric *m;
+
+    va_start(args, labels);
+    m = metric_register(METRIC_HISTOGRAM, name, help, 1000000, labels, args);
+    va_end(args);
+
+    return m;
+}
+
+/******************************************************************************
+Description.: adds to a counter or gauge
+Input Value.: m may be NULL, n is added
+Return Value: -
+******************************************************************************/
+void metric_add(metric *m, long n)
+{
+    if(m != NULL)
+        __sync_fetch_and_add(&m->value, n);
+}
+
+/******************************************************************************
+Description.: sets a gauge
+Input Value.: m may be NULL, value is the new value
+Return Value: -
+******************************************************************************/
+void metric_set(metric *m, long value)
+{
+    if(m != NULL)
+        m->value = value;
+}
+
+/******************************************************************************
+Description.: records a duration in a histogram
+Input Value.: m may be NULL, usec is the duration in microseconds
+Return Value: -
+******************************************************************************/
+void metric_observe(metric *m, long usec)
+{
+    int i;
+
+    if(m == NULL)
+        return;
+
+    for(i = 0; i < METRIC_BUCKETS; i++) {
+        if(usec <= bucket_bounds[i]) {
+            __sync_fetch_and_add(&m->buckets[i], 1);
+            break;
+        }
+    }
+
+    __sync_fetch_and_add(&m->value, usec);
+    __sync_fetch_and_add(&m->count, 1);
+}
+
+/******************************************************************************
+Description.: calculates the time passed since a CLOCK_MONOTONIC timestamp
+Input Value.: since is the start of the duration
+Return Value: elapsed time in microseconds
+******************************************************************************/
+long metric_elapsed_us(struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - since->tv_sec) * 1000000L +
+           (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+/******************************************************************************
+Description.: prints a value divided by scale without losing the fraction
+Input Value.: out is the stream, value and scale as stored in the metric
+Return Value: -
+******************************************************************************/
+static void print_value(FILE *out, long value, long scale)
+{
+    if(scale == 1)
+        fprintf(out, "%ld", value);
+    else
+        fprintf(out, "%.6f", (double)value / scale);
+}
+
+/******************************************************************************
+Description.: prints a single metric in the Prometheus text format
+Input Value.: out is the stream, m the metric
+Return Value: -
+******************************************************************************/
+static void metric_print(FILE *out, metric *m)
+{
+    unsigned long cumulative = 0;
+    const char *sep = (m->labels[0] != '\0') ? "," : "";
+    int i;
+
+    if(m->type != METRIC_HISTOGRAM) {
+        fprintf(out, m->labels[0] != '\0' ? "%s{%s} " : "%s%s ", m->name, m->labels);
+        print_value(out, m->value, m->scale);
+        fprintf(out, "\n");
+        return;
+    }
+
+    for(i = 0; i < METRIC_BUCKETS; i++) {
+        cumulative += m->buckets[i];
+        fprintf(out, "%s_bucket{%s%sle=\"", m->name, m->labels, sep);
+        print_value(out, bucket_bounds[i], m->scale);
+        fprintf(out, "\"} %lu\n", cumulative);
+    }
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", m->name, m->labels, sep, m->count);
+    fprintf(out, m->labels[0] != '\0' ? "%s_sum{%s} " : "%s_sum%s ", m->name, m->labels);
+    print_value(out, m->value, m->scale);
+    fprintf(out, "\n");
+    fprintf(out, m->labels[0] != '\0' ? "%s_count{%s} %lu\n" : "%s_count%s %lu\n",
+            m->name, m->labels, m->count);
+}
+
+/******************************************************************************
+Description.: prints all registered metrics in the Prometheus text format,
+              the metrics of a family are grouped below their HELP and TYPE
+Input Value.: out is the stream to print to
+Return Value: -
+******************************************************************************/
+void metrics_print(FILE *out)
+{
+    static const char *types[] = { "counter", "gauge", "histogram" };
+    int i, j, count;
+
+    count = registered;
+    __sync_synchronize();
+
+    for(i = 0; i < count; i++) {
+        /* the family was printed with an earlier member */
+        for(j = 0; j < i; j++) {
+            if(strcmp(registry[j].name, registry[i].name) == 0)
+                break;
+        }
+        if(j < i)
+            continue;
+
+        fprintf(out, "# HELP %s %s\n", registry[i].name, registry[i].help);
+        fprintf(out, "# TYPE %s %s\n", registry[i].name, types[registry[i].type]);
+        for(j = i; j < count; j++) {
+            if(strcmp(registry[j].name, registry[i].name) == 0)
+                metric_print(out, &registry[j]);
+        }
+    }
+}
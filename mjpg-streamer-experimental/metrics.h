@@ -0,0 +1,71 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <time.h>
+
+/* maximum number of metrics in the registry, further ones are not recorded */
+#define METRICS_MAX 256
+
+/* upper bounds of the histogram buckets in microseconds */
+#define METRIC_BUCKETS 12
+#define METRIC_BUCKET_BOUNDS { 1000, 2500, 5000, 10000, 25000, 50000, \
+                               100000, 250000, 500000, 1000000, 2500000, 5000000 }
+
+typedef enum {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM
+} metric_type;
+
+/*
+ * A metric of the registry, exported in the Prometheus text format.
+ * Metrics are registered once, e.g. when a plugin starts, and then updated
+ * with atomic operations only, so counting costs no lock in the hot paths.
+ * Metrics with the same name and different labels form one family.
+ */
+typedef struct _metric metric;
+struct _metric {
+    metric_type type;
+    char name[64];
+    char labels[96];        /* e.g. input="0",reason="every", may be empty */
+    char help[128];
+    long scale;             /* values are divided by this when exported */
+
+    long value;             /* counter, gauge or sum of the observations */
+    unsigned long count;    /* number of observations of a histogram */
+    unsigned long buckets[METRIC_BUCKETS];
+};
+
+metric *metric_counter(const char *name, const char *help, const char *labels, ...);
+metric *metric_gauge(const char *name, const char *help, long scale, const char *labels, ...);
+metric *metric_histogram(const char *name, const char *help, const char *labels, ...);
+void metric_add(metric *m, long n);
+void metric_set(metric *m, long value);
+void metric_observe(metric *m, long usec);
+long metric_elapsed_us(struct timespec *since);
+void metrics_print(FILE *out);
+
+#endif
@@ -58,7 +58,9 @@ static void help(char *progname)
             "  -o | --output \"<output-plugin.so> [parameters]\"\n" \
             " [-h | --help ]........: display this help\n" \
             " [-v | --version ].....: display version information\n" \
-            " [-b | --background]...: fork to the background, daemon mode\n", progname);
+            " [-b | --background]...: fork to the background, daemon mode\n" \
+            " [-t | --trace FILE]...: write the timing of every frame to FILE,\n" \
+            "                         Chrome trace events if it ends with .json\n", progname);
     fprintf(stderr, "-----------------------------------------------------------------------\n");
     fprintf(stderr, "Example #1:\n" \
             " To open an UVC webcam \"/dev/video1\" and stream it via HTTP:\n" \
@@ -99,6 +101,9 @@ static void signal_handler(int sig)
     global.stop = 1;
     usleep(1000 * 1000);
 
+    /* no frames are pushed to the outputs after this */
+    dispatch_stop(&global);
+
     /* clean up threads */
     LOG("force cancellation of threads and cleanup resources\n");
     for(i = 0; i < global.incnt; i++) {
@@ -147,6 +152,8 @@ static void signal_handler(int sig)
     }
     DBG("all plugin handles closed\n");
 
+    trace_close();
+
     LOG("done\n");
 
     closelog();
@@ -195,6 +202,7 @@ int main(int argc, char *argv[])
     char *input[MAX_INPUT_PLUGINS];
     char *output[MAX_OUTPUT_PLUGINS];
     int daemon = 0, i, j;
+    char *trace = NULL;
     size_t tmp = 0;
 
     output[0] = "output_http.so --port 8080";
@@ -210,10 +218,11 @@ int main(int argc, char *argv[])
             {"output", required_argument, NULL, 'o'},
             {"version", no_argument, NULL, 'v'},
             {"background", no_argument, NULL, 'b'},
+            {"trace", required_argument, NULL, 't'},
             {NULL, 0, NULL, 0}
         };
 
-        c = getopt_long(argc, argv, "hi:o:vb", long_options, NULL);
+        c = getopt_long(argc, argv, "hi:o:vbt:", long_options, NULL);
 
         /* no more options to parse */
         if(c == -1) break;
@@ -242,6 +251,10 @@ int main(int argc, char *argv[])
             daemon = 1;
             break;
 
+        case 't':
+            trace = optarg;
+            break;
+
         case 'h': /* fall through */
         default:
             help(argv[0]);
@@ -253,12 +266,31 @@ int main(int argc, char *argv[])
     //openlog("MJPG-streamer ", LOG_PID|LOG_CONS|LOG_PERROR, LOG_USER);
     syslog(LOG_INFO, "starting application");
 
+    /* opened before forking, the daemon changes to / */
+    if(trace != NULL) {
+        if(trace_open(trace) < 0) {
+            LOG("could not open the trace file %s\n", trace);
+            closelog();
+            exit(EXIT_FAILURE);
+        }
+        LOG("writing the frame timing to %s\n", trace);
+    }
+
     /* fork to the background */
     if(daemon) {
         LOG("enabling daemon mode");
         daemon_mode();
     }
 
+    #ifdef LOCK_STATS
+    /* before the plugins start threads, they must not receive SIGUSR1 */
+    if(lockstats_start(&global) < 0) {
+        LOG("could not start the lock statistics\n");
+        closelog();
+        exit(EXIT_FAILURE);
+    }
+    #endif
+
     /* ignore SIGPIPE (send by OS if transmitting to closed TCP sockets) */
     signal(SIGPIPE, SIG_IGN);
 
@@ -302,8 +334,19 @@ int main(int argc, char *argv[])
         tmp = (size_t)(strchr(input[i], ' ') - input[i]);
         global.in[i].stop      = 0;
         global.in[i].context   = NULL;
+        global.in[i].frame     = NULL;
+        global.in[i].sequence  = 0;
+        memset(global.in[i].history, 0, sizeof(global.in[i].history));
         global.in[i].buf       = NULL;
         global.in[i].size      = 0;
+        global.in[i].published = metric_counter("mjpg_input_frames_published_total",
+                                                "Frames published by the input", "input=\"%d\"", i);
+        global.in[i].fps       = metric_gauge("mjpg_input_fps", "Rate the input publishes frames at",
+                                              1000, "input=\"%d\"", i);
+        global.in[i].consumers = 0;
+        global.in[i].attached  = metric_gauge("mjpg_input_consumers", "Streams, snapshots and outputs waiting for frames",
+                                              1, "input=\"%d\"", i);
+        global.in[i].capture   = CAPTURE_ACTIVE;
         global.in[i].plugin = (tmp > 0) ? strndup(input[i], tmp) : strdup(input[i]);
         global.in[i].handle = dlopen(global.in[i].plugin, RTLD_LAZY);
         if(!global.in[i].handle) {
@@ -381,6 +424,14 @@ int main(int argc, char *argv[])
         /* try to find optional command */
         global.out[i].cmd = dlsym(global.out[i].handle, "output_cmd");
 
+        /* plugins without it read the frames themselves */
+        global.out[i].on_frame = dlsym(global.out[i].handle, "output_on_frame");
+        global.out[i].input = 0;
+        global.out[i].priority = 0;
+        global.out[i].delivery = DELIVERY_LATEST;
+        global.out[i].queue_size = DELIVERY_QUEUE_SIZE;
+        global.out[i].attaches = 0;
+
         global.out[i].param.parameters = strchr(output[i], ' ');
 
         for (j = 0; j<MAX_PLUGIN_ARGUMENTS; j++) {
@@ -395,6 +446,7 @@ int main(int argc, char *argv[])
             closelog();
             exit(EXIT_FAILURE);
         }
+        dispatch_init_output(&global.out[i], i);
     }
 
     /* start to read the input, push pictures into global buffer */
@@ -414,6 +466,11 @@ int main(int argc, char *argv[])
         global.out[i].run(global.out[i].param.id);
     }
 
+    if(dispatch_start(&global) != 0) {
+        closelog();
+        return 1;
+    }
+
     /* wait for signals */
     pause();
 
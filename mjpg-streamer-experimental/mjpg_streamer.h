@@ -41,6 +41,11 @@
 
 #define LOG(...) { char _bf[1024] = {0}; snprintf(_bf, sizeof(_bf)-1, __VA_ARGS__); fprintf(stderr, "%s", _bf); syslog(LOG_INFO, "%s", _bf); }
 
+#include "frame.h"
+#include "metrics.h"
+#include "trace.h"
+#include "lockstats.h"
+#include "dispatch.h"
 #include "plugins/input.h"
 #include "plugins/output.h"
 
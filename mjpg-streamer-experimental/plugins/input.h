@@ -49,6 +49,11 @@ struct _input_format {
     char currentResolution;
 };
 
+/* what an input does with the frames of its device */
+#define CAPTURE_ACTIVE  0   /* frames are published */
+#define CAPTURE_IDLE    1   /* no consumer attached, frames are grabbed and discarded */
+#define CAPTURE_SUSPENDED 2 /* no consumer for a while, the device stopped streaming */
+
 /* structure to store variables/functions for input plugin */
 typedef struct _input input;
 struct _input {
@@ -65,17 +70,37 @@ struct _input {
 
     struct v4l2_jpegcompression jpegcomp;
 
-    /* signal fresh frames */
+    /* signal fresh frames, lock with input_lock() */
     pthread_mutex_t db;
     pthread_cond_t  db_update;
+    #ifdef LOCK_STATS
+    lock_stats db_stats;            /* protected by db */
+    #endif
+
+    /* the most recently published frame, protected by db */
+    struct _frame *frame;
+    unsigned long sequence;
+
+    /* ring of the last published frames, indexed by sequence */
+    struct _frame *history[INPUT_FRAME_HISTORY];
 
-    /* global JPG frame, this is more or less the "database" */
+    /* aliases of frame->data, frame->size and frame->timestamp, kept for
+       plugins which still read them, only valid while holding db */
     unsigned char *buf;
     int size;
 
     /* v4l2_buffer timestamp */
     struct timeval timestamp;
 
+    /* updated by input_publish(), see metrics.h */
+    struct _metric *published;
+    struct _metric *fps;            /* in thousandths */
+
+    /* streams, snapshots and outputs waiting for frames, see input_attach() */
+    int consumers;
+    struct _metric *attached;
+    int capture;                    /* CAPTURE_ACTIVE, _IDLE or _SUSPENDED, set by the input */
+
     input_format *in_formats;
     int formatCount;
     int currentFormat; // holds the current format number
@@ -87,3 +112,15 @@ struct _input {
     int (*run)(int);
     int (*cmd)(int plugin, unsigned int control_id, unsigned int group, int value, char *value_str);
 };
+
+/* provided by the mjpg_streamer core, see frame.c */
+void input_publish(input *in, frame *f);
+void input_release_frame(input *in);
+void input_attach(input *in);
+void input_detach(input *in);
+int input_consumers(input *in);
+int input_wait_consumers(input *in, int timeout_ms);
+unsigned long input_sequence(input *in);
+frame *input_latest(input *in, int max_age_ms);
+frame *input_wait_newer(input *in, unsigned long last_seq, int timeout_ms, unsigned long *skipped);
+frame *input_wait_latest(input *in, unsigned long last_seq, int timeout_ms, unsigned long *skipped);
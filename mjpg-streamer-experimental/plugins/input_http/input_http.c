@@ -110,14 +110,7 @@ Return Value: 0
 ******************************************************************************/
 int input_run(int id)
 {
-    pglobal->in[id].buf = malloc(256 * 1024);
-    if(pglobal->in[id].buf == NULL) {
-        fprintf(stderr, "could not allocate memory\n");
-        exit(EXIT_FAILURE);
-    }
-
     if(pthread_create(&worker, 0, worker_thread, NULL) != 0) {
-        free(pglobal->in[id].buf);
         fprintf(stderr, "could not start worker thread\n");
         exit(EXIT_FAILURE);
     }
@@ -128,16 +121,20 @@ int input_run(int id)
 
 
 void on_image_received(char * data, int length){
-        /* copy JPG picture to global buffer */
-        pthread_mutex_lock(&pglobal->in[plugin_number].db);
+        frame *f;
 
-        pglobal->in[plugin_number].size = length;
-        memcpy(pglobal->in[plugin_number].buf, data, pglobal->in[plugin_number].size);
+        /* copy JPG picture to a new frame */
+        if((f = frame_new(length)) == NULL) {
+            fprintf(stderr, "could not allocate memory\n");
+            return;
+        }
 
-        /* signal fresh_frame */
-        pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
-        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+        f->size = length;
+        memcpy(f->data, data, length);
+        gettimeofday(&f->timestamp, NULL);
 
+        /* publish frame and signal fresh_frame */
+        input_publish(&pglobal->in[plugin_number], f);
 }
 
 void *worker_thread(void *arg)
@@ -173,7 +170,7 @@ void worker_cleanup(void *arg)
     first_run = 0;
     DBG("cleaning up resources allocated by input thread\n");
     close_mjpg_proxy(&proxy);
-    if(pglobal->in[plugin_number].buf != NULL) free(pglobal->in[plugin_number].buf);
+    input_release_frame(&pglobal->in[plugin_number]);
 }
 
 
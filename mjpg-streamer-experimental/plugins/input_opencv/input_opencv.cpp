@@ -19,6 +19,7 @@
 *******************************************************************************/
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <dlfcn.h>
@@ -361,9 +362,6 @@ int input_run(int id)
     input * in = &pglobal->in[id];
     context *pctx = (context*)in->context;
     
-    in->buf = NULL;
-    in->size = 0;
-    
     if(pthread_create(&pctx->worker, 0, worker_thread, in) != 0) {
         worker_cleanup(in);
         fprintf(stderr, "could not start worker thread\n");
@@ -427,21 +425,25 @@ void *worker_thread(void *arg)
         // call the filter function
         pctx->filter_process(pctx->filter_ctx, src, dst);
             
-        /* copy JPG picture to global buffer */
-        pthread_mutex_lock(&in->db);
-        
         // take whatever Mat it returns, and write it to jpeg buffer
         imencode(".jpg", dst, jpeg_buffer, compression_params);
         
         // TODO: what to do if imencode returns an error?
         
+        /* copy JPG picture to a new frame, the vector is reused */
+        frame *f = frame_new(jpeg_buffer.size());
+        if (f == NULL) {
+            fprintf(stderr, "could not allocate memory\n");
+            break;
+        }
+        
         // std::vector is guaranteed to be contiguous
-        in->buf = &jpeg_buffer[0];
-        in->size = jpeg_buffer.size();
+        memcpy(f->data, &jpeg_buffer[0], jpeg_buffer.size());
+        f->size = jpeg_buffer.size();
+        gettimeofday(&f->timestamp, NULL);
         
-        /* signal fresh_frame */
-        pthread_cond_broadcast(&in->db_update);
-        pthread_mutex_unlock(&in->db);
+        /* publish frame and signal fresh_frame */
+        input_publish(in, f);
     }
     
     IPRINT("leaving input thread, calling cleanup function now\n");
@@ -458,6 +460,9 @@ Return Value: -
 void worker_cleanup(void *arg)
 {
     input * in = (input*)arg;
+    
+    input_release_frame(in);
+    
     if (in->context != NULL) {
         context *pctx = (context*)in->context;
         
@@ -131,12 +131,6 @@ int input_run(int id)
 {
 	int res, i;
 
-	global->in[id].buf = malloc(256 * 1024);
-	if(global->in[id].buf == NULL)
-	{
-		IPRINT(INPUT_PLUGIN_NAME " - could not allocate memory\n");
-		exit(EXIT_FAILURE);
-	}
 	plugin_id = id;
 
 	// auto-detect algorithm
@@ -214,7 +208,6 @@ int input_run(int id)
 	// starting thread
 	if(pthread_create(&thread, 0, capture, NULL) != 0)
 	{
-		free(global->in[id].buf);
 		IPRINT("could not start worker thread\n");
 		exit(EXIT_FAILURE);
 	}
@@ -234,12 +227,12 @@ void* capture(void* arg)
 					{
 						unsigned long int xsize;
 						const char* xdata;
+						frame* f;
 						pthread_mutex_lock(&control_mutex);
 						res = gp_file_new(&file);
 						CAMERA_CHECK_GP(res, "gp_file_new");
 						res = gp_camera_capture_preview(camera, file, context);
 						CAMERA_CHECK_GP(res, "gp_camera_capture_preview");
-						pthread_mutex_lock(&global->in[plugin_id].db);
 						res = gp_file_get_data_and_size(file, &xdata, &xsize);
 						if(xsize == 0)
 						{
@@ -258,14 +251,20 @@ void* capture(void* arg)
 						else
 							i = 0;
 						CAMERA_CHECK_GP(res, "gp_file_get_data_and_size");
-						memcpy(global->in[plugin_id].buf, xdata, xsize);
+						f = frame_new(xsize);
+						if(f == NULL)
+						{
+							IPRINT(INPUT_PLUGIN_NAME " - could not allocate memory\n");
+							exit(EXIT_FAILURE);
+						}
+						memcpy(f->data, xdata, xsize);
+						f->size = xsize;
+						gettimeofday(&f->timestamp, NULL);
 						res = gp_file_unref(file);
 						pthread_mutex_unlock(&control_mutex);
 						CAMERA_CHECK_GP(res, "gp_file_unref");
-						global->in[plugin_id].size = xsize;
-						DBG("Read %d bytes from camera.\n", global->in[plugin_id].size);
-						pthread_cond_broadcast(&global->in[plugin_id].db_update);
-						pthread_mutex_unlock(&global->in[plugin_id].db);
+						DBG("Read %d bytes from camera.\n", f->size);
+						input_publish(&global->in[plugin_id], f);
 						usleep(delay);
 					}
 					pthread_cleanup_pop(1);
@@ -302,7 +301,7 @@ void cleanup(void *arg)
 	gp_camera_exit(camera, context);
 	gp_camera_unref(camera);
 	gp_context_unref(context);
-	free(global->in[plugin_id].buf);
+	input_release_frame(&global->in[plugin_id]);
 }
 
 int input_cmd(int plugin, unsigned int control_id, unsigned int group, int value)
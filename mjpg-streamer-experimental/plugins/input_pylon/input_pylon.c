@@ -78,6 +78,7 @@ static pthread_t worker_encoder_th4;
 static pthread_mutex_t controls_mutex;
 static pthread_mutex_t encode_queue_mutex;
 static pthread_mutex_t release_buf_queue_mutex;
+static pthread_mutex_t publish_mutex;
 static pthread_cond_t encode_cond;
 
 /* Handle for mjpeg-streamer globals. */
@@ -249,6 +250,11 @@ int input_init(input_parameter *param, int plugin_no)
         exit(EXIT_FAILURE);
     }
 
+    if(pthread_mutex_init(&publish_mutex, NULL) != 0) {
+        IPRINT("could not initialize publish mutex variable\n");
+        exit(EXIT_FAILURE);
+    }
+
     if(pthread_cond_init(&encode_cond, NULL) != 0) {
         IPRINT("could not initialize compress condition variable\n");
         exit(EXIT_FAILURE);
@@ -348,7 +354,6 @@ int input_run(int id)
 {
     DBG("Creating frame grabber thread 1\n");
     if (pthread_create(&worker_grabber_th1, 0, worker_grabber, NULL) != 0) {
-        free(pglobal->in[id].buf);
         fprintf(stderr, "ERROR: Failed to start grabber thread 1!\n");
         exit(EXIT_FAILURE);
     }
@@ -1050,8 +1055,21 @@ void *worker_encoder(void *arg)
         pthread_mutex_unlock(&release_buf_queue_mutex);
         DBG("Encoder %d released buffer %d\n", enc->index, frame->buffer);
 
-        /* Reserve output object. */
-        pthread_mutex_lock(&pglobal->in[plugin_number].db);
+        /* Copy image from encode buffer to a new output frame. */
+        struct _frame *out = frame_new(encoded_size);
+        if (out == NULL) {
+            fprintf(stderr, "ERROR: Encoder memory alloc failed!\n");
+            free(frame);
+            exit(EXIT_FAILURE);
+        }
+        memcpy(out->data, enc->buffer, encoded_size);
+        out->size = encoded_size;
+
+        /* Set timestamp. */
+        out->timestamp = frame->timestamp;
+
+        /* Reserve output order. */
+        pthread_mutex_lock(&publish_mutex);
 
         /* Ensure correct frame order: if our frame is not the next, wait. */
         int delay = 10000;
@@ -1059,15 +1077,15 @@ void *worker_encoder(void *arg)
 #ifdef ENSURE_CORRECT_FRAME_ORDER
         while (frame->number != 0 && frame->number > frameNumLastSent + 1) {
 
-            /* Release output object to give chance to other threads. */
-            pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+            /* Release output order to give chance to other threads. */
+            pthread_mutex_unlock(&publish_mutex);
 
             /* Wait a moment so other threads can send their frames. */
             usleep(delay);
             total_delay += delay;
 
-            /* Reserve output object and check again... */
-            pthread_mutex_lock(&pglobal->in[plugin_number].db);
+            /* Reserve output order and check again... */
+            pthread_mutex_lock(&publish_mutex);
         }
         if (total_delay > 0) {
             fprintf(stderr, "Encoder %d delayed sending frame %d for %d ms\n",
@@ -1075,35 +1093,14 @@ void *worker_encoder(void *arg)
         }
 #endif
 
-        /* Allocate memory for output buffer. */
-        if (pglobal->in[plugin_number].buf == NULL) {
-            pglobal->in[plugin_number].buf = malloc(frame->size);
-            if (pglobal->in[plugin_number].buf == NULL) {
-                pthread_mutex_unlock(&pglobal->in[plugin_number].db);
-                fprintf(stderr, "ERROR: Encoder memory alloc failed!\n");
-                free(frame);
-                exit(EXIT_FAILURE);
-            } else {
-                DBG("Encoder %d allocated %d bytes for output buffer\n",
-                    enc->index, frame->size);
-            }
-        }
-
-        /* Copy image from encode buffer to output buffer. */
-        memcpy(pglobal->in[plugin_number].buf, enc->buffer, encoded_size);
-        pglobal->in[plugin_number].size = encoded_size;
-
-        /* Set timestamp. */
-        pglobal->in[plugin_number].timestamp = frame->timestamp;
-
         /* Signal fresh image to output plugins. */
-        pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
+        input_publish(&pglobal->in[plugin_number], out);
 
         /* Update last sent frame number. */
         frameNumLastSent = frame->number;
 
-        /* Release output object. */
-        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+        /* Release output order. */
+        pthread_mutex_unlock(&publish_mutex);
 
         double time_taken = ((double)walltime) / CLOCKS_PER_SEC; /* in sec */
         struct timespec time_thread;
@@ -1158,13 +1155,8 @@ void worker_encoder_cleanup(void *arg)
     /* After last encoder, free the common output buffer used by this plugin. */
     if (encoders_online == 0) {
         DBG("All encoders cleaned, now cleaning common resources\n");
-        pthread_mutex_lock(&pglobal->in[plugin_number].db);
-        if (pglobal->in[plugin_number].buf != NULL) {
-            free(pglobal->in[plugin_number].buf);
-            pglobal->in[plugin_number].buf = NULL;
-            DBG("Cleaned plugin output buffer\n");
-        }
-        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+        input_release_frame(&pglobal->in[plugin_number]);
+        DBG("Cleaned plugin output frame\n");
         DBG("Common resources cleaned\n");
     }
 }
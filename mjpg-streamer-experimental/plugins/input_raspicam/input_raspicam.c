@@ -96,6 +96,7 @@ typedef struct
   VCOS_SEMAPHORE_T complete_semaphore; /// semaphore which is posted when we reach end of frame (indicates end of capture or fault)
   MMAL_POOL_T *pool; /// pointer to our state in case required in callback
   uint32_t offset;
+  frame *pending; /// frame currently being assembled from encoder buffers
 } PORT_USERDATA;
 
 
@@ -386,12 +387,15 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
       //fprintf(stderr, "The flags are %x of length %i offset %i\n", buffer->flags, buffer->length, pData->offset);
 
       //Write bytes
-      /* copy JPG picture to global buffer */
-      if(pData->offset == 0)
-        pthread_mutex_lock(&pglobal->in[plugin_number].db);
+      /* copy JPG picture to a private frame, it is published once complete */
+      if(pData->pending == NULL)
+        pData->pending = frame_new(width * height * 3);
 
-      memcpy(pData->offset + pglobal->in[plugin_number].buf, buffer->data, buffer->length);
-      pData->offset += buffer->length;
+      if(pData->pending != NULL && pData->offset + buffer->length <= (uint32_t)pData->pending->capacity)
+      {
+        memcpy(pData->offset + pData->pending->data, buffer->data, buffer->length);
+        pData->offset += buffer->length;
+      }
       //fwrite(buffer->data, 1, buffer->length, pData->file_handle);
       mmal_buffer_header_mem_unlock(buffer);
     }
@@ -399,23 +403,27 @@ static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
     // Now flag if we have completed
     if (buffer->flags & (MMAL_BUFFER_HEADER_FLAG_FRAME_END | MMAL_BUFFER_HEADER_FLAG_TRANSMISSION_FAILED))
     {
-      //set frame size
-      pglobal->in[plugin_number].size = pData->offset;
-
-      //Set frame timestamp
-      if(wantTimestamp)
+      if(pData->pending != NULL)
       {
-        gettimeofday(&timestamp, NULL);
-        pglobal->in[plugin_number].timestamp = timestamp;
+        //set frame size
+        pData->pending->size = pData->offset;
+
+        //Set frame timestamp
+        if(wantTimestamp)
+        {
+          gettimeofday(&timestamp, NULL);
+          pData->pending->timestamp = timestamp;
+        }
+
+        /* publish frame and signal fresh_frame */
+        input_publish(&pglobal->in[plugin_number], pData->pending);
+        pData->pending = NULL;
       }
 
       //mark frame complete
       complete = 1;
 
       pData->offset = 0;
-      /* signal fresh_frame */
-      pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
-      pthread_mutex_unlock(&pglobal->in[plugin_number].db);
     }
   }
   else
@@ -485,16 +493,8 @@ static void camera_control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buf
  ******************************************************************************/
 int input_run(int id)
 {
-  pglobal->in[id].buf = malloc(width * height * 3);
-  if (pglobal->in[id].buf == NULL)
-  {
-    fprintf(stderr, "could not allocate memory\n");
-    exit(EXIT_FAILURE);
-  }
-
   if (pthread_create(&worker, 0, worker_thread, NULL) != 0)
   {
-    free(pglobal->in[id].buf);
     fprintf(stderr, "could not start worker thread\n");
     exit(EXIT_FAILURE);
   }
@@ -928,6 +928,7 @@ void *worker_thread(void *arg)
   callback_data.file_handle = NULL;
   callback_data.pool = pool;
   callback_data.offset = 0;
+  callback_data.pending = NULL;
 
   vcos_assert(vcos_semaphore_create(&callback_data.complete_semaphore, "RaspiStill-sem", 0) == VCOS_SUCCESS);
 
@@ -1098,8 +1099,7 @@ void worker_cleanup(void *arg)
   first_run = 0;
   DBG("cleaning up resources allocated by input thread\n");
 
-  if(pglobal->in[plugin_number].buf != NULL)
-    free(pglobal->in[plugin_number].buf);
+  input_release_frame(&pglobal->in[plugin_number]);
 }
 
 
@@ -189,14 +189,7 @@ Return Value: 0
 ******************************************************************************/
 int input_run(int id)
 {
-    pglobal->in[id].buf = malloc(256 * 1024);
-    if(pglobal->in[id].buf == NULL) {
-        fprintf(stderr, "could not allocate memory\n");
-        exit(EXIT_FAILURE);
-    }
-
     if(pthread_create(&worker, 0, worker_thread, NULL) != 0) {
-        free(pglobal->in[id].buf);
         fprintf(stderr, "could not start worker thread\n");
         exit(EXIT_FAILURE);
     }
@@ -230,22 +223,25 @@ Return Value: NULL
 void *worker_thread(void *arg)
 {
     int i = 0;
+    frame *f;
 
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
     while(!pglobal->stop) {
 
-        /* copy JPG picture to global buffer */
-        pthread_mutex_lock(&pglobal->in[plugin_number].db);
-
+        /* copy JPG picture to a new frame */
         i = (i + 1) % LENGTH_OF(pics->sequence);
-        pglobal->in[plugin_number].size = pics->sequence[i].size;
-        memcpy(pglobal->in[plugin_number].buf, pics->sequence[i].data, pglobal->in[plugin_number].size);
+        if((f = frame_new(pics->sequence[i].size)) == NULL) {
+            fprintf(stderr, "could not allocate memory\n");
+            break;
+        }
+        f->size = pics->sequence[i].size;
+        memcpy(f->data, pics->sequence[i].data, f->size);
+        gettimeofday(&f->timestamp, NULL);
 
-        /* signal fresh_frame */
-        pthread_cond_broadcast(&pglobal->in[plugin_number].db_update);
-        pthread_mutex_unlock(&pglobal->in[plugin_number].db);
+        /* publish frame and signal fresh_frame */
+        input_publish(&pglobal->in[plugin_number], f);
 
         usleep(1000 * delay);
     }
@@ -273,7 +269,7 @@ void worker_cleanup(void *arg)
     first_run = 0;
     DBG("cleaning up resources allocated by input thread\n");
 
-    if(pglobal->in[plugin_number].buf != NULL) free(pglobal->in[plugin_number].buf);
+    input_release_frame(&pglobal->in[plugin_number]);
 }
 
 
@@ -74,6 +74,11 @@ static unsigned int every = 1;
 static int wantTimestamp = 0;
 static struct timeval timestamp;
 static int softfps = -1;
+static int suspend_after = 0;
+static int zerocopy = 0;
+static int buffers = 0;
+static int drain = 0;
+static int encoders = 1;
 
 static const struct {
   const char * k;
@@ -211,6 +216,11 @@ int input_init(input_parameter *param, int id)
             {"cb", required_argument, 0, 0},
             {"timestamp", no_argument, 0, 0},
             {"softfps", required_argument, 0, 0},
+            {"suspend", required_argument, 0, 0},
+            {"zerocopy", no_argument, 0, 0},
+            {"buffers", required_argument, 0, 0},
+            {"latest", no_argument, 0, 0},
+            {"encoders", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -373,6 +383,21 @@ int input_init(input_parameter *param, int id)
        case 40:
            softfps = atoi(optarg);
            break;
+       case 41:
+           suspend_after = MAX(atoi(optarg), 0);
+           break;
+       case 42:
+           zerocopy = 1;
+           break;
+       case 43:
+           buffers = MAX(atoi(optarg), 2);
+           break;
+       case 44:
+           drain = 1;
+           break;
+       case 45:
+           encoders = MAX(atoi(optarg), 1);
+           break;
        default:
            DBG("default case\n");
            help();
@@ -382,6 +407,7 @@ int input_init(input_parameter *param, int id)
     DBG("input id: %d\n", id);
     pctx->id = id;
     pctx->pglobal = param->global;
+    pctx->quality = settings->quality;
 
     /* allocate webcam datastructure */
     pctx->videoIn = calloc(1, sizeof(struct vdIn));
@@ -428,6 +454,15 @@ int input_init(input_parameter *param, int id)
         IPRINT("TV-Norm...........: DEFAULT\n");
     }
 
+    /* only JPEGs of the camera can be published as they are */
+    if(zerocopy && format != V4L2_PIX_FMT_MJPEG && format != V4L2_PIX_FMT_JPEG) {
+        IPRINT("zerocopy needs a JPEG format, copying the frames\n");
+        zerocopy = 0;
+    }
+    pctx->videoIn->zerocopy = zerocopy;
+    pctx->videoIn->nbuffers = buffers;
+    pctx->videoIn->drain = drain;
+
     DBG("vdIn pn: %d\n", id);
     /* open video device and prepare data structure */
     if(init_videoIn(pctx->videoIn, dev, width, height, fps, format, 1, pctx->pglobal, id, tvnorm) < 0) {
@@ -439,6 +474,27 @@ int input_init(input_parameter *param, int id)
     if (softfps > 0) {
         IPRINT("Framedrop FPS.....: %d\n", softfps);
     }
+    if (suspend_after > 0) {
+        IPRINT("Suspend when idle.: after %d s\n", suspend_after);
+    }
+    IPRINT("Driver buffers....: %d%s\n", pctx->videoIn->nbuffers,
+           pctx->videoIn->zerocopy ? ", zerocopy" : "");
+    if (drain) {
+        IPRINT("Queued frames.....: dropped for the newest one\n");
+    }
+
+    #ifndef NO_LIBJPEG
+    /* frames compressed by the plugin may be cut into strips for several threads */
+    if (encoders > 1 && format != V4L2_PIX_FMT_MJPEG && format != V4L2_PIX_FMT_JPEG) {
+        pctx->videoIn->strips = jpeg_strip_encoder_new(encoders);
+        if (pctx->videoIn->strips == NULL) {
+            IPRINT("could not start the JPEG encoder threads\n");
+            closelog();
+            exit(EXIT_FAILURE);
+        }
+        IPRINT("JPEG encoders.....: %d threads\n", encoders);
+    }
+    #endif
 
     /*
      * recent linux-uvc driver (revision > ~#125) requires to use dynctrls
@@ -478,12 +534,6 @@ int input_run(int id)
     input * in = &pglobal->in[id];
     context *pctx = (context*)in->context;
     
-    in->buf = malloc(pctx->videoIn->framesizeIn);
-    if(in->buf == NULL) {
-        fprintf(stderr, "could not allocate memory\n");
-        exit(EXIT_FAILURE);
-    }
-
     DBG("launching camera thread #%02d\n", id);
     /* create thread and pass context to thread function */
     pthread_create(&(pctx->threadID), NULL, cam_thread, in);
@@ -531,6 +581,14 @@ void help(void)
     " [-timestamp ]..........: Populate frame timestamp with system time\n" \
     " [-softfps] ............: Drop frames to try and achieve this fps\n" \
     "                          set your camera to its maximum fps to avoid stuttering\n" \
+    " [-suspend] ............: stop streaming after this many seconds without viewers\n" \
+    "                          and restart on the next one, default 0 (never)\n" \
+    " [-zerocopy] ...........: publish the JPEGs in the driver buffers without copying\n" \
+    " [-buffers] ............: number of driver buffers to request, default 4\n" \
+    "                          or 12 with -zerocopy\n" \
+    " [-latest] .............: always continue with the newest frame of the driver,\n" \
+    "                          drop the older ones waiting in its queue\n" \
+    " [-encoders] ...........: number of threads compressing each YUV frame, default 1\n" \
     " ---------------------------------------------------------------\n");
 
     fprintf(stderr, "\n"\
@@ -565,7 +623,39 @@ void *cam_thread(void *arg)
     context_settings *settings = pcontext->init_settings;
     
     unsigned int every_count = 0;
-    int quality = settings->quality;
+    frame *f;
+    metric *grabbed, *drop_every, *drop_small, *drop_soft, *drop_idle, *drop_drained;
+    unsigned long drained = 0;
+    metric *resume_time, *copied;
+    struct timespec idle_since = {0, 0}, resume_start;
+    int resuming = 0;
+    #ifndef NO_LIBJPEG
+    metric *encode_time, *drop_encode;
+    #endif
+
+    grabbed = metric_counter("mjpg_input_frames_captured_total",
+                             "Frames grabbed from the camera", "input=\"%d\"", pcontext->id);
+    drop_every = metric_counter("mjpg_input_frames_dropped_total", "Frames dropped by the input",
+                                "input=\"%d\",reason=\"every\"", pcontext->id);
+    drop_small = metric_counter("mjpg_input_frames_dropped_total", "Frames dropped by the input",
+                                "input=\"%d\",reason=\"minimum_size\"", pcontext->id);
+    drop_soft = metric_counter("mjpg_input_frames_dropped_total", "Frames dropped by the input",
+                               "input=\"%d\",reason=\"soft_framedrop\"", pcontext->id);
+    drop_idle = metric_counter("mjpg_input_frames_dropped_total", "Frames dropped by the input",
+                               "input=\"%d\",reason=\"idle\"", pcontext->id);
+    drop_drained = metric_counter("mjpg_input_frames_dropped_total", "Frames dropped by the input",
+                                  "input=\"%d\",reason=\"drained\"", pcontext->id);
+    resume_time = metric_histogram("mjpg_input_resume_seconds",
+                                   "Time from restarting a suspended device to its first frame",
+                                   "input=\"%d\"", pcontext->id);
+    copied = metric_counter("mjpg_input_zerocopy_fallback_total",
+                            "Frames copied although zerocopy was enabled", "input=\"%d\"", pcontext->id);
+    #ifndef NO_LIBJPEG
+    encode_time = metric_histogram("mjpg_input_encode_seconds",
+                                   "Time spent compressing raw frames to JPEG", "input=\"%d\"", pcontext->id);
+    drop_encode = metric_counter("mjpg_input_frames_dropped_total", "Frames dropped by the input",
+                                 "input=\"%d\",reason=\"encode\"", pcontext->id);
+    #endif
     
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(cam_cleanup, in);
@@ -653,14 +743,43 @@ void *cam_thread(void *arg)
             usleep(1); // maybe not the best way so FIXME
         }
 
+        /* a suspended device streams again once someone waits for frames */
+        if(in->capture == CAPTURE_SUSPENDED) {
+            if(input_wait_consumers(in, 500) == 0)
+                continue;
+
+            DBG("resuming input %d\n", pcontext->id);
+            clock_gettime(CLOCK_MONOTONIC, &resume_start);
+            if(uvcResume(pcontext->videoIn) < 0) {
+                IPRINT("Error resuming the device\n");
+                exit(EXIT_FAILURE);
+            }
+            in->capture = CAPTURE_IDLE;
+            resuming = 1;
+        }
+
         /* grab a frame */
         if(uvcGrab(pcontext->videoIn) < 0) {
             IPRINT("Error grabbing frames\n");
             exit(EXIT_FAILURE);
         }
+        metric_add(grabbed, 1);
+
+        /* frames uvcGrab() skipped for a newer one */
+        if(pcontext->videoIn->drained != drained) {
+            metric_add(grabbed, pcontext->videoIn->drained - drained);
+            metric_add(drop_drained, pcontext->videoIn->drained - drained);
+            drained = pcontext->videoIn->drained;
+        }
+
+        if(resuming) {
+            metric_observe(resume_time, metric_elapsed_us(&resume_start));
+            resuming = 0;
+        }
 
         if ( every_count < every - 1 ) {
             DBG("dropping %d frame for every=%d\n", every_count + 1, every);
+            metric_add(drop_every, 1);
             ++every_count;
             continue;
         } else {
@@ -678,6 +797,7 @@ void *cam_thread(void *arg)
          */
         if(pcontext->videoIn->tmpbytesused < minimum_size) {
             DBG("dropping too small frame, assuming it as broken\n");
+            metric_add(drop_small, 1);
             continue;
         }
 
@@ -699,13 +819,52 @@ void *cam_thread(void *arg)
             // if the requested time did not esplashed skip the frame
             if ((current - last) < pcontext->videoIn->frame_period_time) {
                 DBG("Last frame taken %d ms ago so drop it\n", (current - last));
+                metric_add(drop_soft, 1);
                 continue;
             }
             DBG("Lagg: %ld\n", (current - last) - pcontext->videoIn->frame_period_time);
         }
 
-        /* copy JPG picture to global buffer */
-        pthread_mutex_lock(&pglobal->in[pcontext->id].db);
+        /*
+         * Nobody waits for frames: keep grabbing so the device stays ready,
+         * but neither compress nor publish them. The next frame after a
+         * consumer attached is published again.
+         */
+        if(input_consumers(in) == 0) {
+            if(in->capture != CAPTURE_IDLE || idle_since.tv_sec == 0) {
+                DBG("no consumers, input %d is idle now\n", pcontext->id);
+                in->capture = CAPTURE_IDLE;
+                clock_gettime(CLOCK_MONOTONIC, &idle_since);
+            }
+            metric_add(drop_idle, 1);
+
+            /* free the camera and the USB bus if it stays like this */
+            if(suspend_after > 0 &&
+               metric_elapsed_us(&idle_since) >= suspend_after * 1000000L &&
+               uvcSuspend(pcontext->videoIn) == 0) {
+                DBG("suspending input %d\n", pcontext->id);
+                in->capture = CAPTURE_SUSPENDED;
+                idle_since.tv_sec = 0;
+            }
+            continue;
+        }
+        if(in->capture != CAPTURE_ACTIVE) {
+            DBG("input %d has consumers again\n", pcontext->id);
+            in->capture = CAPTURE_ACTIVE;
+        }
+
+        /* the frame is private until it gets published, no need to lock */
+        if(pcontext->videoIn->zerocopy) {
+            f = uvcTakeFrame(pcontext->videoIn);
+            if(f != NULL && f->iovcnt == 0)
+                metric_add(copied, 1);
+        } else {
+            f = frame_new(pcontext->videoIn->framesizeIn);
+        }
+        if(f == NULL) {
+            IPRINT("not enough memory for frame\n");
+            exit(EXIT_FAILURE);
+        }
 
         /*
          * If capturing in YUV mode convert to JPEG now.
@@ -718,18 +877,32 @@ void *cam_thread(void *arg)
 	    (pcontext->videoIn->formatIn == V4L2_PIX_FMT_UYVY) ||
 	    (pcontext->videoIn->formatIn == V4L2_PIX_FMT_RGB565) ) {
             DBG("compressing frame from input: %d\n", (int)pcontext->id);
-            pglobal->in[pcontext->id].size = compress_image_to_jpeg(pcontext->videoIn, pglobal->in[pcontext->id].buf, pcontext->videoIn->framesizeIn, quality);
-            /* copy this frame's timestamp to user space */
-            pglobal->in[pcontext->id].timestamp = pcontext->videoIn->tmptimestamp;
-        } else {
+            clock_gettime(CLOCK_MONOTONIC, &f->encode_start);
+            TRACE_PROBE2(frame_encode_start, pcontext->id, pcontext->videoIn->buf.index);
+            if(pcontext->videoIn->strips != NULL)
+                f->size = compress_image_to_jpeg_strips(pcontext->videoIn->strips, pcontext->videoIn,
+                                                        f->data, f->capacity, pcontext->quality);
+            else
+                f->size = compress_image_to_jpeg(pcontext->videoIn, f->data, f->capacity, pcontext->quality);
+            clock_gettime(CLOCK_MONOTONIC, &f->encode_end);
+            TRACE_PROBE2(frame_encode_end, pcontext->id, f->size);
+            metric_observe(encode_time, metric_elapsed_us(&f->encode_start));
+            if(f->size == 0) {
+                DBG("compressed frame does not fit into %zu bytes\n", (size_t)f->capacity);
+                metric_add(drop_encode, 1);
+                frame_unref(f);
+                continue;
+            }
+        } else if(!pcontext->videoIn->zerocopy) {
+        #else
+        if(!pcontext->videoIn->zerocopy) {
         #endif
             DBG("copying frame from input: %d\n", (int)pcontext->id);
-            pglobal->in[pcontext->id].size = memcpy_picture(pglobal->in[pcontext->id].buf, pcontext->videoIn->tmpbuffer, pcontext->videoIn->tmpbytesused);
-            /* copy this frame's timestamp to user space */
-            pglobal->in[pcontext->id].timestamp = pcontext->videoIn->tmptimestamp;
-        #ifndef NO_LIBJPEG
+            f->size = memcpy_picture(f->data, pcontext->videoIn->tmpbuffer, pcontext->videoIn->tmpbytesused);
         }
-        #endif
+        /* copy this frame's timestamp to user space */
+        f->timestamp = pcontext->videoIn->tmptimestamp;
+        f->dequeued = pcontext->videoIn->dequeued;
 
 #if 0
         /* motion detection can be done just by comparing the picture size, but it is not very accurate!! */
@@ -739,9 +912,8 @@ void *cam_thread(void *arg)
         prev_size = global->size;
 #endif
 
-        /* signal fresh_frame */
-        pthread_cond_broadcast(&pglobal->in[pcontext->id].db_update);
-        pthread_mutex_unlock(&pglobal->in[pcontext->id].db);
+        /* publish frame and signal fresh_frame */
+        input_publish(&pglobal->in[pcontext->id], f);
     }
 
     DBG("leaving input thread, calling cleanup function now\n");
@@ -759,19 +931,31 @@ void cam_cleanup(void *arg)
 {
     input * in = (input*)arg;
     context *pctx = (context*)in->context;
+    int last;
     
     IPRINT("cleaning up resources allocated by input thread\n");
 
+    /* zerocopy frames give their buffers back to videoIn when released */
+    input_release_frame(in);
+
     if (pctx->videoIn != NULL) {
         close_v4l2(pctx->videoIn);
+        #ifndef NO_LIBJPEG
+        jpeg_encoder_free(pctx->videoIn->encoder);
+        pctx->videoIn->encoder = NULL;
+        jpeg_strip_encoder_free(pctx->videoIn->strips);
+        pctx->videoIn->strips = NULL;
+        #endif
         free(pctx->videoIn->tmpbuffer);
-        free(pctx->videoIn);
+        /* clients still sending such a frame keep it, the last release frees it */
+        pthread_mutex_lock(&pctx->videoIn->bufs_mutex);
+        pctx->videoIn->closing = 1;
+        last = (pctx->videoIn->held == 0);
+        pthread_mutex_unlock(&pctx->videoIn->bufs_mutex);
+        if (last)
+            free(pctx->videoIn);
         pctx->videoIn = NULL;
     }
-    
-    free(in->buf);
-    in->buf = NULL;
-    in->size = 0;
 }
 
 /******************************************************************************
@@ -830,7 +1014,12 @@ int input_cmd(int plugin_number, unsigned int control_id, unsigned int group, in
     case IN_CMD_JPEG_QUALITY:
         if((value >= 0) && (value < 101)) {
             in->jpegcomp.quality = value;
-            if(IOCTL_VIDEO(pctx->videoIn->fd, VIDIOC_S_JPEGCOMP, &in->jpegcomp) != EINVAL) {
+            /* used for the next frame compressed by the plugin */
+            pctx->quality = value;
+            if(pctx->videoIn->formatIn != V4L2_PIX_FMT_MJPEG && pctx->videoIn->formatIn != V4L2_PIX_FMT_JPEG) {
+                DBG("JPEG quality is set to %d\n", value);
+                ret = 0;
+            } else if(IOCTL_VIDEO(pctx->videoIn->fd, VIDIOC_S_JPEGCOMP, &in->jpegcomp) != EINVAL) {
                 DBG("JPEG quality is set to %d\n", value);
                 ret = 0;
             } else {
@@ -0,0 +1,235 @@
+/*******************************************************************************
+# Linux-UVC streaming input-plugin for MJPG-streamer                           #
+#                                                                              #
+# This package work with the Logitech UVC based webcams with the mjpeg feature #
+#                                                                              #
+#   Orginally Copyright (C) 2005 2006 Laurent Pinchart &&  Michel Xhaard       #
+#   Modifications Copyright (C) 2006  Gabriel A. Devenyi                       #
+#   Modifications Copyright (C) 2007  Tom Stöveken                             #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; either version 2 of the License, or            #
+# (at your option) any later version.                                          #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+ * Compares the throughput of compress_image_to_jpeg() with the strip encoder
+ * of compress_image_to_jpeg_strips() on a synthetic picture. Built with
+ * cmake -DJPEG_BENCHMARK=ON, it is not installed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <math.h>
+#include <time.h>
+#include <jpeglib.h>
+
+#include <linux/types.h>          /* for videodev2.h */
+#include <linux/videodev2.h>
+
+#include "../../utils.h"
+#include "v4l2uvc.h"
+#include "jpeg_utils.h"
+
+/******************************************************************************
+Description.: fills the picture with a pattern that compresses like a camera
+              picture, smooth areas with some noise
+Input Value.: vd describes the picture, framebuffer is allocated
+Return Value: -
+******************************************************************************/
+static void fill_picture(struct vdIn *vd)
+{
+    unsigned int x, y;
+    unsigned char *p = vd->framebuffer;
+
+    for(y = 0; y < vd->height; y++) {
+        for(x = 0; x < vd->width; x++, p += 2) {
+            int luma = 128 + 60 * sin(x * 0.01) * cos(y * 0.013) + (rand() % 16);
+            int chroma = 128 + ((x & 1) ? 20 * sin(y * 0.02) : 20 * cos(x * 0.02));
+
+            if(vd->formatIn == V4L2_PIX_FMT_RGB565) {
+                p[0] = luma;
+                p[1] = chroma;
+            } else if(vd->formatIn == V4L2_PIX_FMT_UYVY) {
+                p[0] = chroma;
+                p[1] = luma;
+            } else {
+                p[0] = luma;
+                p[1] = chroma;
+            }
+        }
+    }
+}
+
+/******************************************************************************
+Description.: checks that libjpeg decodes a JPEG without warnings
+Input Value.: buf and size are the JPEG, vd the picture it should have
+Return Value: 1 if it is fine, 0 otherwise
+******************************************************************************/
+static int check_jpeg(unsigned char *buf, int size, struct vdIn *vd)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    JSAMPROW row;
+    int ok;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, buf, size);
+    jpeg_read_header(&cinfo, TRUE);
+    jpeg_start_decompress(&cinfo);
+
+    row = malloc(cinfo.output_width * cinfo.output_components);
+    while(cinfo.output_scanline < cinfo.output_height)
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    free(row);
+
+    ok = (cinfo.output_width == vd->width && cinfo.output_height == vd->height &&
+          jerr.num_warnings == 0);
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+    return ok;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void help(void)
+{
+    fprintf(stderr,
+    "Usage: jpeg_bench [options]\n" \
+    " [-r | --resolution ]...: size of the picture, default 1920x1080\n" \
+    " [-t | --threads ]......: highest number of threads to try, default 4\n" \
+    " [-n | --frames ].......: frames to compress per run, default 100\n" \
+    " [-q | --quality ]......: JPEG quality, default 80\n" \
+    " [-u | --uyvy ].........: compress UYVY instead of YUYV\n" \
+    " [-565 ]................: compress RGB565 instead of YUYV\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct vdIn vd;
+    struct jpeg_strip_encoder *se;
+    unsigned char *buffer;
+    int threads = 4, frames = 100, quality = 80, size, len = 0, i, t;
+    double start, serial;
+
+    static struct option long_options[] = {
+        {"r", required_argument, 0, 'r'},
+        {"resolution", required_argument, 0, 'r'},
+        {"t", required_argument, 0, 't'},
+        {"threads", required_argument, 0, 't'},
+        {"n", required_argument, 0, 'n'},
+        {"frames", required_argument, 0, 'n'},
+        {"q", required_argument, 0, 'q'},
+        {"quality", required_argument, 0, 'q'},
+        {"u", no_argument, 0, 'u'},
+        {"uyvy", no_argument, 0, 'u'},
+        {"565", no_argument, 0, '5'},
+        {"h", no_argument, 0, 'h'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    memset(&vd, 0, sizeof(vd));
+    vd.width = 1920;
+    vd.height = 1080;
+    vd.formatIn = V4L2_PIX_FMT_YUYV;
+
+    for(;;) {
+        int c = getopt_long_only(argc, argv, "", long_options, NULL);
+
+        if(c == -1)
+            break;
+
+        switch(c) {
+        case 'r':
+            if(sscanf(optarg, "%ux%u", &vd.width, &vd.height) != 2) {
+                help();
+                return 1;
+            }
+            vd.width &= ~1u;
+            break;
+        case 't':
+            threads = MAX(atoi(optarg), 1);
+            break;
+        case 'n':
+            frames = MAX(atoi(optarg), 1);
+            break;
+        case 'q':
+            quality = MIN(MAX(atoi(optarg), 0), 100);
+            break;
+        case 'u':
+            vd.formatIn = V4L2_PIX_FMT_UYVY;
+            break;
+        case '5':
+            vd.formatIn = V4L2_PIX_FMT_RGB565;
+            break;
+        default:
+            help();
+            return 1;
+        }
+    }
+
+    size = vd.width * vd.height * 2;
+    vd.framebuffer = malloc(size);
+    buffer = malloc(size);
+    if(vd.framebuffer == NULL || buffer == NULL) {
+        fprintf(stderr, "not enough memory\n");
+        return 1;
+    }
+    fill_picture(&vd);
+
+    printf("%ux%u, %d frames, quality %d\n", vd.width, vd.height, frames, quality);
+
+    start = now();
+    for(i = 0; i < frames; i++)
+        len = compress_image_to_jpeg(&vd, buffer, size, quality);
+    serial = now() - start;
+    printf("serial.....: %7.1f fps, %7d bytes, %s\n", frames / serial, len,
+           check_jpeg(buffer, len, &vd) ? "ok" : "INVALID");
+
+    for(t = 1; t <= threads; t++) {
+        double elapsed;
+
+        se = jpeg_strip_encoder_new(t);
+        if(se == NULL) {
+            fprintf(stderr, "could not start %d threads\n", t);
+            return 1;
+        }
+
+        start = now();
+        for(i = 0; i < frames; i++)
+            len = compress_image_to_jpeg_strips(se, &vd, buffer, size, quality);
+        elapsed = now() - start;
+        printf("%2d threads.: %7.1f fps, %7d bytes, %s, %.2fx\n", t, frames / elapsed, len,
+               check_jpeg(buffer, len, &vd) ? "ok" : "INVALID", serial / elapsed);
+
+        jpeg_strip_encoder_free(se);
+    }
+
+    jpeg_encoder_free(vd.encoder);
+    free(vd.framebuffer);
+    free(buffer);
+
+    return 0;
+}
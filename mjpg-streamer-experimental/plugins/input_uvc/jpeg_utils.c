@@ -31,25 +31,50 @@
 #include <linux/videodev2.h>
 
 #include "v4l2uvc.h"
+#include "jpeg_utils.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON
+#endif
 
 #define OUTPUT_BUF_SIZE  4096
 
 typedef struct {
     struct jpeg_destination_mgr pub; /* public fields */
 
-    JOCTET * buffer;    /* start of buffer */
-
     unsigned char *outbuffer;
     int outbuffer_size;
-    unsigned char *outbuffer_cursor;
-    int *written;
+    int overflow;                   /* the picture did not fit into outbuffer */
+    JOCTET spill[OUTPUT_BUF_SIZE];  /* takes the rest of such a picture */
 
 } mjpg_destination_mgr;
 
 typedef mjpg_destination_mgr * mjpg_dest_ptr;
 
+/* the compressor of an input, kept from frame to frame */
+struct jpeg_encoder {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    mjpg_destination_mgr dest;
+
+    /* the pictures the parameters in cinfo were set up for, height is
+       the one of the current picture or strip */
+    unsigned int width, height, format;
+    int quality;
+
+    unsigned char *mem;             /* planes or line buffer */
+    JSAMPROW rows[3][DCTSIZE];      /* lines of the Y, Cb and Cr planes in mem */
+};
+
 /******************************************************************************
-Description.:
+Description.: libjpeg writes straight into the buffer of the frame
 Input Value.:
 Return Value:
 ******************************************************************************/
@@ -57,17 +82,14 @@ METHODDEF(void) init_destination(j_compress_ptr cinfo)
 {
     mjpg_dest_ptr dest = (mjpg_dest_ptr) cinfo->dest;
 
-    /* Allocate the output buffer --- it will be released when done with image */
-    dest->buffer = (JOCTET *)(*cinfo->mem->alloc_small)((j_common_ptr) cinfo, JPOOL_IMAGE, OUTPUT_BUF_SIZE * sizeof(JOCTET));
-
-    *(dest->written) = 0;
-
-    dest->pub.next_output_byte = dest->buffer;
-    dest->pub.free_in_buffer = OUTPUT_BUF_SIZE;
+    dest->overflow = 0;
+    dest->pub.next_output_byte = dest->outbuffer;
+    dest->pub.free_in_buffer = dest->outbuffer_size;
 }
 
 /******************************************************************************
-Description.: called whenever local jpeg buffer fills up
+Description.: called if the buffer of the frame is full, the rest of the
+              picture is discarded
 Input Value.:
 Return Value:
 ******************************************************************************/
@@ -75,55 +97,316 @@ METHODDEF(boolean) empty_output_buffer(j_compress_ptr cinfo)
 {
     mjpg_dest_ptr dest = (mjpg_dest_ptr) cinfo->dest;
 
-    memcpy(dest->outbuffer_cursor, dest->buffer, OUTPUT_BUF_SIZE);
-    dest->outbuffer_cursor += OUTPUT_BUF_SIZE;
-    *(dest->written) += OUTPUT_BUF_SIZE;
-
-    dest->pub.next_output_byte = dest->buffer;
+    dest->overflow = 1;
+    dest->pub.next_output_byte = dest->spill;
     dest->pub.free_in_buffer = OUTPUT_BUF_SIZE;
 
     return TRUE;
 }
 
 /******************************************************************************
-Description.: called by jpeg_finish_compress after all data has been written.
-              Usually needs to flush buffer.
+Description.: called by jpeg_finish_compress after all data has been written,
+              nothing to flush since the data is in place already
 Input Value.:
 Return Value:
 ******************************************************************************/
 METHODDEF(void) term_destination(j_compress_ptr cinfo)
 {
-    mjpg_dest_ptr dest = (mjpg_dest_ptr) cinfo->dest;
-    size_t datacount = OUTPUT_BUF_SIZE - dest->pub.free_in_buffer;
+}
+
+/******************************************************************************
+Description.: allocates a compressor, it can be used for any number of
+              pictures and is set up again when their format changes
+Input Value.: -
+Return Value: the encoder or NULL if there is not enough memory
+******************************************************************************/
+struct jpeg_encoder *jpeg_encoder_new(void)
+{
+    struct jpeg_encoder *enc;
+
+    enc = calloc(1, sizeof(struct jpeg_encoder));
+    if(enc == NULL)
+        return NULL;
+
+    enc->cinfo.err = jpeg_std_error(&enc->jerr);
+    jpeg_create_compress(&enc->cinfo);
+
+    /* jpeg_stdio_dest (&cinfo, file); */
+    enc->dest.pub.init_destination = init_destination;
+    enc->dest.pub.empty_output_buffer = empty_output_buffer;
+    enc->dest.pub.term_destination = term_destination;
+    enc->cinfo.dest = &enc->dest.pub;
+
+    return enc;
+}
+
+/******************************************************************************
+Description.: frees a compressor of jpeg_encoder_new()
+Input Value.: enc is the encoder, may be NULL
+Return Value: -
+******************************************************************************/
+void jpeg_encoder_free(struct jpeg_encoder *enc)
+{
+    if(enc == NULL)
+        return;
+
+    enc->cinfo.dest = NULL;
+    jpeg_destroy_compress(&enc->cinfo);
+    free(enc->mem);
+    free(enc);
+}
+
+/******************************************************************************
+Description.: splits a line of YUYV or UYVY pixels into the Y, Cb and Cr
+              planes libjpeg takes as raw data, 16 pixels at a time with SIMD
+Input Value.: src is the line, pixels its width (even), uyvy selects the
+              byte order, y receives pixels and cb, cr pixels/2 samples
+Return Value: -
+******************************************************************************/
+static void split_422(const unsigned char *src, int pixels, int uyvy,
+                      JSAMPROW y, JSAMPROW cb, JSAMPROW cr)
+{
+    int x = 0;
+
+#if defined(__SSE2__)
+    const __m128i low = _mm_set1_epi16(0x00ff);
+
+    for(; x + 16 <= pixels; x += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + 2 * x));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 2 * x + 16));
+        __m128i luma, chroma;
+
+        if(uyvy) {
+            luma = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+            chroma = _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low));
+        } else {
+            luma = _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low));
+            chroma = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+        }
 
-    /* Write any data remaining in the buffer */
-    memcpy(dest->outbuffer_cursor, dest->buffer, datacount);
-    dest->outbuffer_cursor += datacount;
-    *(dest->written) += datacount;
+        /* chroma holds Cb Cr pairs now */
+        _mm_storeu_si128((__m128i *)(y + x), luma);
+        _mm_storel_epi64((__m128i *)(cb + x / 2),
+                         _mm_packus_epi16(_mm_and_si128(chroma, low), _mm_setzero_si128()));
+        _mm_storel_epi64((__m128i *)(cr + x / 2),
+                         _mm_packus_epi16(_mm_srli_epi16(chroma, 8), _mm_setzero_si128()));
+    }
+#elif defined(HAVE_NEON)
+    for(; x + 16 <= pixels; x += 16) {
+        uint8x8x4_t p = vld4_u8(src + 2 * x);
+        uint8x8x2_t luma;
+
+        luma.val[0] = uyvy ? p.val[1] : p.val[0];
+        luma.val[1] = uyvy ? p.val[3] : p.val[2];
+        vst2_u8(y + x, luma);
+        vst1_u8(cb + x / 2, uyvy ? p.val[0] : p.val[1]);
+        vst1_u8(cr + x / 2, uyvy ? p.val[2] : p.val[3]);
+    }
+#endif
+
+    for(; x + 2 <= pixels; x += 2, src += 4) {
+        if(uyvy) {
+            y[x] = src[1];
+            y[x + 1] = src[3];
+            cb[x / 2] = src[0];
+            cr[x / 2] = src[2];
+        } else {
+            y[x] = src[0];
+            y[x + 1] = src[2];
+            cb[x / 2] = src[1];
+            cr[x / 2] = src[3];
+        }
+    }
 }
 
 /******************************************************************************
-Description.: Prepare for output to a stdio stream.
-Input Value.: buffer is the already allocated buffer memory that will hold
-              the compressed picture. "size" is the size in bytes.
+Description.: expands a line of RGB5:6:5 pixels to RGB, 8 pixels at a time
+              with SIMD
+Input Value.: src is the line, pixels its width, dst receives 3 * pixels bytes
 Return Value: -
 ******************************************************************************/
-GLOBAL(void) dest_buffer(j_compress_ptr cinfo, unsigned char *buffer, int size, int *written)
+static void rgb565_to_rgb(const unsigned char *src, int pixels, JSAMPROW dst)
+{
+    int x = 0;
+
+#if defined(__SSSE3__)
+    const __m128i mask_rb = _mm_set1_epi16(0x00f8), mask_g = _mm_set1_epi16(0x00fc);
+    const __m128i rg_lo = _mm_setr_epi8(0, 1, -1, 2, 3, -1, 4, 5, -1, 6, 7, -1, 8, 9, -1, 10);
+    const __m128i b_lo = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+    const __m128i rg_hi = _mm_setr_epi8(11, -1, 12, 13, -1, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i b_hi = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+
+    for(; x + 8 <= pixels; x += 8, dst += 24) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(src + 2 * x));
+        __m128i r = _mm_and_si128(_mm_srli_epi16(p, 8), mask_rb);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(p, 3), mask_g);
+        __m128i b = _mm_and_si128(_mm_slli_epi16(p, 3), mask_rb);
+        /* rg holds r0 g0 r1 g1 ... r7 g7, bb b0 ... b7 */
+        __m128i rg = _mm_unpacklo_epi8(_mm_packus_epi16(r, r), _mm_packus_epi16(g, g));
+        __m128i bb = _mm_packus_epi16(b, b);
+
+        _mm_storeu_si128((__m128i *)dst,
+                         _mm_or_si128(_mm_shuffle_epi8(rg, rg_lo), _mm_shuffle_epi8(bb, b_lo)));
+        _mm_storel_epi64((__m128i *)(dst + 16),
+                         _mm_or_si128(_mm_shuffle_epi8(rg, rg_hi), _mm_shuffle_epi8(bb, b_hi)));
+    }
+#elif defined(HAVE_NEON)
+    for(; x + 8 <= pixels; x += 8, dst += 24) {
+        uint16x8_t p = vld1q_u16((const uint16_t *)(src + 2 * x));
+        uint8x8x3_t rgb;
+
+        rgb.val[0] = vand_u8(vmovn_u16(vshrq_n_u16(p, 8)), vdup_n_u8(0xf8));
+        rgb.val[1] = vand_u8(vmovn_u16(vshrq_n_u16(p, 3)), vdup_n_u8(0xfc));
+        rgb.val[2] = vand_u8(vmovn_u16(vshlq_n_u16(p, 3)), vdup_n_u8(0xf8));
+        vst3_u8(dst, rgb);
+    }
+#endif
+
+    for(; x < pixels; x++, dst += 3) {
+        const unsigned char *px = src + 2 * x;
+        unsigned int twoByte = (px[1] << 8) + px[0];
+
+        dst[0] = (px[1] & 248);
+        dst[1] = (unsigned char)((twoByte & 2016) >> 3);
+        dst[2] = ((px[0] & 31) * 8);
+    }
+}
+
+/******************************************************************************
+Description.: sets the compressor up for the width and format of the
+              pictures, unless it already is. The quantization tables are
+              built again by the caller afterwards. A different height, like
+              the one of the last strip of a picture, only changes
+              image_height and keeps the setup and the tables.
+Input Value.: enc is the encoder, width, height and format describe the
+              pictures
+Return Value: 0 if ok, -1 if there is not enough memory
+******************************************************************************/
+static int encoder_setup(struct jpeg_encoder *enc, unsigned int width, unsigned int height, unsigned int format)
 {
-    mjpg_dest_ptr dest;
+    j_compress_ptr cinfo = &enc->cinfo;
+    int raw = (format == V4L2_PIX_FMT_YUYV || format == V4L2_PIX_FMT_UYVY);
+    /* libjpeg reads whole MCUs of 16x8 pixels */
+    int ypad = (width + 15) & ~15, cpad = ypad / 2, i;
+
+    /* jpeg_start_compress() derives everything that depends on it */
+    cinfo->image_height = height;
+    enc->height = height;
+
+    if(enc->mem != NULL && enc->width == width && enc->format == format)
+        return 0;
+
+    free(enc->mem);
+    enc->mem = malloc(raw ? DCTSIZE * (ypad + 2 * cpad) : width * 3);
+    if(enc->mem == NULL)
+        return -1;
+
+    for(i = 0; raw && i < DCTSIZE; i++) {
+        enc->rows[0][i] = enc->mem + i * ypad;
+        enc->rows[1][i] = enc->mem + DCTSIZE * ypad + i * cpad;
+        enc->rows[2][i] = enc->mem + DCTSIZE * (ypad + cpad) + i * cpad;
+    }
 
-    if(cinfo->dest == NULL) {
-        cinfo->dest = (struct jpeg_destination_mgr *)(*cinfo->mem->alloc_small)((j_common_ptr) cinfo, JPOOL_PERMANENT, sizeof(mjpg_destination_mgr));
+    cinfo->image_width = width;
+    cinfo->input_components = 3;
+    cinfo->in_color_space = raw ? JCS_YCbCr : JCS_RGB;
+
+    jpeg_set_defaults(cinfo);
+
+    if(raw) {
+        /* the chroma of the camera is already subsampled horizontally */
+        cinfo->raw_data_in = TRUE;
+        cinfo->comp_info[0].h_samp_factor = 2;
+        cinfo->comp_info[0].v_samp_factor = 1;
+        cinfo->comp_info[1].h_samp_factor = 1;
+        cinfo->comp_info[1].v_samp_factor = 1;
+        cinfo->comp_info[2].h_samp_factor = 1;
+        cinfo->comp_info[2].v_samp_factor = 1;
     }
 
-    dest = (mjpg_dest_ptr) cinfo->dest;
-    dest->pub.init_destination = init_destination;
-    dest->pub.empty_output_buffer = empty_output_buffer;
-    dest->pub.term_destination = term_destination;
-    dest->outbuffer = buffer;
-    dest->outbuffer_size = size;
-    dest->outbuffer_cursor = buffer;
-    dest->written = written;
+    enc->width = width;
+    enc->format = format;
+    enc->quality = -1;
+    return 0;
+}
+
+/******************************************************************************
+Description.: compresses YUYV or UYVY pictures without converting them to RGB
+              first: the planes are handed to libjpeg as raw 4:2:2 data, in
+              groups of DCTSIZE lines. Y is used as full range like the RGB
+              conversion did before.
+Input Value.: enc is set up for raw YCbCr data, src is the picture
+Return Value: -
+******************************************************************************/
+static void compress_422(struct jpeg_encoder *enc, const unsigned char *src)
+{
+    j_compress_ptr cinfo = &enc->cinfo;
+    unsigned int width = enc->width, height = enc->height;
+    int ypad = (width + 15) & ~15, cpad = ypad / 2;
+    int uyvy = (enc->format == V4L2_PIX_FMT_UYVY), i;
+    JSAMPROW *yrows = enc->rows[0], *cbrows = enc->rows[1], *crrows = enc->rows[2];
+    JSAMPARRAY planes[3] = {yrows, cbrows, crrows};
+
+    while(cinfo->next_scanline < height) {
+        for(i = 0; i < DCTSIZE; i++) {
+            unsigned int row = cinfo->next_scanline + i;
+
+            /* repeat the last line and column to fill the last MCUs */
+            if(row >= height)
+                row = height - 1;
+            split_422(src + row * width * 2, width, uyvy, yrows[i], cbrows[i], crrows[i]);
+            memset(yrows[i] + width, yrows[i][width - 1], ypad - width);
+            memset(cbrows[i] + width / 2, cbrows[i][width / 2 - 1], cpad - width / 2);
+            memset(crrows[i] + width / 2, crrows[i][width / 2 - 1], cpad - width / 2);
+        }
+        jpeg_write_raw_data(cinfo, planes, DCTSIZE);
+    }
+}
+
+/******************************************************************************
+Description.: compresses a YUYV, UYVY or RGB5:6:5 picture with an encoder
+Input Value.: enc is the encoder, src the picture of width x height pixels in
+              format, buffer and size take the JPEG
+Return Value: size of the JPEG, 0 if it did not fit or there is not enough
+              memory
+******************************************************************************/
+static int encode_picture(struct jpeg_encoder *enc, const unsigned char *src,
+                          unsigned int width, unsigned int height, unsigned int format,
+                          int quality, unsigned char *buffer, int size)
+{
+    JSAMPROW row_pointer[1];
+
+    if(encoder_setup(enc, width, height, format) < 0)
+        return 0;
+
+    /* building the quantization tables is only needed when it changes */
+    if(quality != enc->quality) {
+        jpeg_set_quality(&enc->cinfo, quality, TRUE);
+        enc->quality = quality;
+    }
+
+    enc->dest.outbuffer = buffer;
+    enc->dest.outbuffer_size = size;
+
+    jpeg_start_compress(&enc->cinfo, TRUE);
+
+    if (enc->cinfo.raw_data_in) {
+        compress_422(enc, src);
+    } else if (format == V4L2_PIX_FMT_RGB565) {
+        while(enc->cinfo.next_scanline < height) {
+            rgb565_to_rgb(src, width, enc->mem);
+            src += width * 2;
+
+            row_pointer[0] = enc->mem;
+            jpeg_write_scanlines(&enc->cinfo, row_pointer, 1);
+        }
+    }
+    jpeg_finish_compress(&enc->cinfo);
+
+    if(enc->dest.overflow)
+        return 0;
+
+    return (size - enc->dest.pub.free_in_buffer);
 }
 
 /******************************************************************************
@@ -134,133 +417,371 @@ Description.: yuv2jpeg function is based on compress_yuyv_to_jpeg written by
               YUYV data to JPEG. Most other implementations use the
               "jpeg_stdio_dest" from libjpeg, which can not store compressed
               pictures to memory instead of a file.
+              YUYV and UYVY are passed to libjpeg as YCbCr planes, RGB5:6:5
+              is expanded to RGB line by line.
+              The compressor of vd is created by the first call and kept, so
+              inputs can compress at the same time.
 Input Value.: video structure from v4l2uvc.c/h, destination buffer and buffersize
-              the buffer must be large enough, no error/size checking is done!
-Return Value: the buffer will contain the compressed data
+Return Value: size of the compressed data in the buffer, 0 if the picture did
+              not fit or there is not enough memory
 ******************************************************************************/
 int compress_image_to_jpeg(struct vdIn *vd, unsigned char *buffer, int size, int quality)
 {
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    JSAMPROW row_pointer[1];
-    unsigned char *line_buffer, *yuyv;
-    int z;
-    static int written;
+    if(vd->encoder == NULL) {
+        vd->encoder = jpeg_encoder_new();
+        if(vd->encoder == NULL)
+            return 0;
+    }
 
-    line_buffer = calloc(vd->width * 3, 1);
-    yuyv = vd->framebuffer;
+    return encode_picture(vd->encoder, vd->framebuffer, vd->width, vd->height,
+                          vd->formatIn, quality, buffer, size);
+}
 
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_compress(&cinfo);
-    /* jpeg_stdio_dest (&cinfo, file); */
-    dest_buffer(&cinfo, buffer, size, &written);
+/*
+ * The strip encoder cuts a picture into horizontal strips of whole MCU rows
+ * and compresses each of them as a JPEG of its own on a thread of a pool.
+ * All strips use the same tables, so they are joined into one baseline JPEG:
+ * the headers of the first strip with the full height and a restart interval
+ * of one strip, then the entropy coded data of the strips separated by RSTn
+ * markers. A decoder resets the DC prediction at every marker, which is just
+ * what encoding the strips on their own did.
+ */
+
+/* a strip and its JPEG */
+struct jpeg_strip {
+    unsigned char *buf;
+    int capacity;
+    int size;
+};
+
+struct jpeg_strip_encoder {
+    int threads;                        /* running, including the caller */
+    int size;                           /* of workers + 1 and encoders */
+    pthread_t *workers;                 /* the caller helps, it is not one of them */
+    struct jpeg_encoder **encoders;     /* one per thread, [0] is the caller's */
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;               /* a picture was handed out */
+    pthread_cond_t done;                /* the last strip is finished */
+    unsigned long job;
+    int stop;
+
+    /* the picture being compressed */
+    const unsigned char *src;
+    unsigned int width, height, format;
+    int quality;
+    unsigned int strip_height;
+    int nstrips, next, finished;
+    struct jpeg_strip *strips;
+    int allocated;
+};
+
+/* the worker and the encoder it uses */
+struct strip_worker {
+    struct jpeg_strip_encoder *se;
+    struct jpeg_encoder *enc;
+};
 
-    cinfo.image_width = vd->width;
-    cinfo.image_height = vd->height;
-    cinfo.input_components = 3;
-    cinfo.in_color_space = JCS_RGB;
+/******************************************************************************
+Description.: compresses strips of the current picture until none is left
+Input Value.: se is the strip encoder, enc the encoder of the calling thread
+Return Value: -
+******************************************************************************/
+static void encode_strips(struct jpeg_strip_encoder *se, struct jpeg_encoder *enc)
+{
+    struct jpeg_strip *strip;
+    unsigned int row, height;
+    int i;
+
+    for(;;) {
+        pthread_mutex_lock(&se->lock);
+        i = (se->next < se->nstrips) ? se->next++ : -1;
+        pthread_mutex_unlock(&se->lock);
+        if(i < 0)
+            return;
+
+        strip = &se->strips[i];
+        row = i * se->strip_height;
+        height = (row + se->strip_height <= se->height) ? se->strip_height : se->height - row;
+        strip->size = encode_picture(enc, se->src + row * se->width * 2, se->width, height,
+                                     se->format, se->quality, strip->buf, strip->capacity);
+
+        pthread_mutex_lock(&se->lock);
+        if(++se->finished == se->nstrips)
+            pthread_cond_signal(&se->done);
+        pthread_mutex_unlock(&se->lock);
+    }
+}
 
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE);
+/******************************************************************************
+Description.: thread of the pool, helps with every picture handed out
+Input Value.: arg is the struct strip_worker
+Return Value: NULL
+******************************************************************************/
+static void *strip_thread(void *arg)
+{
+    struct strip_worker *w = arg;
+    struct jpeg_strip_encoder *se = w->se;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&se->lock);
+    while(!se->stop) {
+        if(se->job == seen) {
+            pthread_cond_wait(&se->start, &se->lock);
+            continue;
+        }
+        seen = se->job;
+        pthread_mutex_unlock(&se->lock);
+        encode_strips(se, w->enc);
+        pthread_mutex_lock(&se->lock);
+    }
+    pthread_mutex_unlock(&se->lock);
 
-    jpeg_start_compress(&cinfo, TRUE);
+    free(w);
+    return NULL;
+}
 
-    z = 0;
-    if (vd->formatIn == V4L2_PIX_FMT_YUYV) {
-        while(cinfo.next_scanline < vd->height) {
-            int x;
-            unsigned char *ptr = line_buffer;
+/******************************************************************************
+Description.: creates a strip encoder and its threads
+Input Value.: threads is the number of threads compressing a picture,
+              including the one calling compress_image_to_jpeg_strips()
+Return Value: the strip encoder or NULL on errors
+******************************************************************************/
+struct jpeg_strip_encoder *jpeg_strip_encoder_new(int threads)
+{
+    struct jpeg_strip_encoder *se;
+    struct strip_worker *w;
+    int i;
+
+    if(threads < 1)
+        return NULL;
+
+    se = calloc(1, sizeof(struct jpeg_strip_encoder));
+    if(se == NULL)
+        return NULL;
+    se->workers = calloc(threads, sizeof(pthread_t));
+    se->encoders = calloc(threads, sizeof(struct jpeg_encoder *));
+    if(se->workers == NULL || se->encoders == NULL) {
+        free(se->workers);
+        free(se->encoders);
+        free(se);
+        return NULL;
+    }
+    se->size = threads;
+    se->threads = 1;
+    pthread_mutex_init(&se->lock, NULL);
+    pthread_cond_init(&se->start, NULL);
+    pthread_cond_init(&se->done, NULL);
+
+    for(i = 0; i < threads; i++) {
+        se->encoders[i] = jpeg_encoder_new();
+        if(se->encoders[i] == NULL)
+            goto error;
+    }
 
+    for(i = 1; i < threads; i++) {
+        w = malloc(sizeof(struct strip_worker));
+        if(w == NULL)
+            goto error;
+        w->se = se;
+        w->enc = se->encoders[i];
+        if(pthread_create(&se->workers[i - 1], NULL, strip_thread, w) != 0) {
+            free(w);
+            goto error;
+        }
+        se->threads = i + 1;
+    }
 
-            for(x = 0; x < vd->width; x++) {
-                int r, g, b;
-                int y, u, v;
+    return se;
 
-                if(!z)
-                    y = yuyv[0] << 8;
-                else
-                    y = yuyv[2] << 8;
-                u = yuyv[1] - 128;
-                v = yuyv[3] - 128;
+error:
+    jpeg_strip_encoder_free(se);
+    return NULL;
+}
 
-                r = (y + (359 * v)) >> 8;
-                g = (y - (88 * u) - (183 * v)) >> 8;
-                b = (y + (454 * u)) >> 8;
+/******************************************************************************
+Description.: stops the threads of a strip encoder and frees it
+Input Value.: se is the strip encoder, may be NULL
+Return Value: -
+******************************************************************************/
+void jpeg_strip_encoder_free(struct jpeg_strip_encoder *se)
+{
+    int i;
+
+    if(se == NULL)
+        return;
+
+    pthread_mutex_lock(&se->lock);
+    se->stop = 1;
+    pthread_cond_broadcast(&se->start);
+    pthread_mutex_unlock(&se->lock);
+
+    /* threads counts the ones started so far */
+    for(i = 1; i < se->threads; i++)
+        pthread_join(se->workers[i - 1], NULL);
+
+    for(i = 0; i < se->allocated; i++)
+        free(se->strips[i].buf);
+    free(se->strips);
+    for(i = 0; i < se->size; i++)
+        jpeg_encoder_free(se->encoders[i]);
+    free(se->encoders);
+    free(se->workers);
+    pthread_cond_destroy(&se->done);
+    pthread_cond_destroy(&se->start);
+    pthread_mutex_destroy(&se->lock);
+    free(se);
+}
 
-                *(ptr++) = (r > 255) ? 255 : ((r < 0) ? 0 : r);
-                *(ptr++) = (g > 255) ? 255 : ((g < 0) ? 0 : g);
-                *(ptr++) = (b > 255) ? 255 : ((b < 0) ? 0 : b);
+/******************************************************************************
+Description.: finds a marker segment in the headers of a JPEG
+Input Value.: p and size are the JPEG, marker the second byte of the marker
+Return Value: offset of the marker, -1 if it is not found before the SOS
+******************************************************************************/
+static int find_marker(const unsigned char *p, int size, unsigned char marker)
+{
+    int i = 2;                          /* after the SOI */
+
+    while(i + 4 <= size && p[i] == 0xff) {
+        if(p[i + 1] == marker)
+            return i;
+        if(p[i + 1] == 0xda)
+            return -1;
+        i += 2 + ((p[i + 2] << 8) | p[i + 3]);
+    }
 
-                if(z++) {
-                    z = 0;
-                    yuyv += 4;
-                }
-            }
+    return -1;
+}
 
-            row_pointer[0] = line_buffer;
-            jpeg_write_scanlines(&cinfo, row_pointer, 1);
-        }
-    } else if (vd->formatIn == V4L2_PIX_FMT_RGB565) {
-        while(cinfo.next_scanline < vd->height) {
-            int x;
-            unsigned char *ptr = line_buffer;
-
-            for(x = 0; x < vd->width; x++) {
-                /*
-                unsigned int tb = ((unsigned char)raw[i+1] << 8) + (unsigned char)raw[i];
-                r =  ((unsigned char)(raw[i+1]) & 248);
-                g = (unsigned char)(( tb & 2016) >> 3);
-                b =  ((unsigned char)raw[i] & 31) * 8;
-                */
-                unsigned int twoByte = (yuyv[1] << 8) + yuyv[0];
-                *(ptr++) = (yuyv[1] & 248);
-                *(ptr++) = (unsigned char)((twoByte & 2016) >> 3);
-                *(ptr++) = ((yuyv[0] & 31) * 8);
-                yuyv += 2;
-            }
-
-            row_pointer[0] = line_buffer;
-            jpeg_write_scanlines(&cinfo, row_pointer, 1);
-        }
-    }  else if (vd->formatIn == V4L2_PIX_FMT_UYVY) {
-        while(cinfo.next_scanline < vd->height) {
-            int x;
-            unsigned char *ptr = line_buffer;
-
-
-            for(x = 0; x < vd->width; x++) {
-                int r, g, b;
-                int y, u, v;
-
-                if(!z)
-                    y = yuyv[1] << 8;
-                else
-                    y = yuyv[3] << 8;
-                u = yuyv[0] - 128;
-                v = yuyv[2] - 128;
-
-                r = (y + (359 * v)) >> 8;
-                g = (y - (88 * u) - (183 * v)) >> 8;
-                b = (y + (454 * u)) >> 8;
-
-                *(ptr++) = (r > 255) ? 255 : ((r < 0) ? 0 : r);
-                *(ptr++) = (g > 255) ? 255 : ((g < 0) ? 0 : g);
-                *(ptr++) = (b > 255) ? 255 : ((b < 0) ? 0 : b);
-
-                if(z++) {
-                    z = 0;
-                    yuyv += 4;
-                }
-            }
-
-            row_pointer[0] = line_buffer;
-            jpeg_write_scanlines(&cinfo, row_pointer, 1);
+/******************************************************************************
+Description.: joins the strips of the current picture to one JPEG
+Input Value.: se is the strip encoder, all strips are compressed
+              buffer and size take the JPEG
+Return Value: size of the JPEG, 0 if it did not fit
+******************************************************************************/
+static int join_strips(struct jpeg_strip_encoder *se, unsigned char *buffer, int size)
+{
+    /* whole MCUs of 16 pixels in every strip */
+    unsigned int interval = ((se->width + 15) / 16) * (se->strip_height / (se->format == V4L2_PIX_FMT_RGB565 ? 16 : 8));
+    const unsigned char *p = se->strips[0].buf;
+    int sof, sos, len, i, out;
+
+    sof = find_marker(p, se->strips[0].size, 0xc0);
+    sos = find_marker(p, se->strips[0].size, 0xda);
+    if(sof < 0 || sos < 0)
+        return 0;
+
+    /* the headers of the first strip, a DRI and its scan */
+    len = se->strips[0].size - 2;
+    if(len + 6 > size)
+        return 0;
+    memcpy(buffer, p, sos);
+    buffer[sof + 5] = se->height >> 8;
+    buffer[sof + 6] = se->height & 0xff;
+    buffer[sos] = 0xff;
+    buffer[sos + 1] = 0xdd;
+    buffer[sos + 2] = 0;
+    buffer[sos + 3] = 4;
+    buffer[sos + 4] = interval >> 8;
+    buffer[sos + 5] = interval & 0xff;
+    memcpy(buffer + sos + 6, p + sos, len - sos);
+    out = len + 6;
+
+    /* the entropy coded data of the others, without SOS and EOI */
+    for(i = 1; i < se->nstrips; i++) {
+        p = se->strips[i].buf;
+        sos = find_marker(p, se->strips[i].size, 0xda);
+        if(sos < 0)
+            return 0;
+        sos += 2 + ((p[sos + 2] << 8) | p[sos + 3]);
+        len = se->strips[i].size - 2 - sos;
+        if(out + 2 + len > size)
+            return 0;
+        buffer[out++] = 0xff;
+        buffer[out++] = 0xd0 + ((i - 1) & 7);
+        memcpy(buffer + out, p + sos, len);
+        out += len;
+    }
+
+    if(out + 2 > size)
+        return 0;
+    buffer[out++] = 0xff;
+    buffer[out++] = 0xd9;
+
+    return out;
+}
+
+/******************************************************************************
+Description.: compresses the picture of vd like compress_image_to_jpeg(), but
+              on all threads of the strip encoder. Pictures too small for
+              two strips are compressed by the calling thread alone.
+Input Value.: se is the strip encoder, the other parameters are those of
+              compress_image_to_jpeg()
+Return Value: size of the compressed data in the buffer, 0 if the picture did
+              not fit or there is not enough memory
+******************************************************************************/
+int compress_image_to_jpeg_strips(struct jpeg_strip_encoder *se, struct vdIn *vd, unsigned char *buffer, int size, int quality)
+{
+    unsigned int mcu_height = (vd->formatIn == V4L2_PIX_FMT_RGB565) ? 16 : 8;
+    unsigned int mcu_rows = (vd->height + mcu_height - 1) / mcu_height;
+    unsigned int mcus = (vd->width + 15) / 16, rows;
+    int i, n;
+
+    /* the restart interval has 16 bits */
+    rows = (mcu_rows + se->threads - 1) / se->threads;
+    if(rows * mcus > 65535)
+        rows = 65535 / mcus;
+    n = (rows == 0) ? 1 : (mcu_rows + rows - 1) / rows;
+    if(n < 2)
+        return encode_picture(se->encoders[0], vd->framebuffer, vd->width, vd->height,
+                              vd->formatIn, quality, buffer, size);
+
+    if(n > se->allocated) {
+        struct jpeg_strip *strips = realloc(se->strips, n * sizeof(struct jpeg_strip));
+        if(strips == NULL)
+            return 0;
+        memset(strips + se->allocated, 0, (n - se->allocated) * sizeof(struct jpeg_strip));
+        se->strips = strips;
+        se->allocated = n;
+    }
+
+    /* as large as the raw strip, plus the headers */
+    for(i = 0; i < n; i++) {
+        int capacity = vd->width * rows * mcu_height * 2 + 4096;
+        if(se->strips[i].capacity < capacity) {
+            free(se->strips[i].buf);
+            se->strips[i].buf = malloc(capacity);
+            se->strips[i].capacity = (se->strips[i].buf != NULL) ? capacity : 0;
+            if(se->strips[i].buf == NULL)
+                return 0;
         }
     }
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
 
-    free(line_buffer);
+    pthread_mutex_lock(&se->lock);
+    se->src = vd->framebuffer;
+    se->width = vd->width;
+    se->height = vd->height;
+    se->format = vd->formatIn;
+    se->quality = quality;
+    se->strip_height = rows * mcu_height;
+    se->nstrips = n;
+    se->next = 0;
+    se->finished = 0;
+    se->job++;
+    pthread_cond_broadcast(&se->start);
+    pthread_mutex_unlock(&se->lock);
+
+    encode_strips(se, se->encoders[0]);
+
+    pthread_mutex_lock(&se->lock);
+    while(se->finished < se->nstrips)
+        pthread_cond_wait(&se->done, &se->lock);
+    pthread_mutex_unlock(&se->lock);
+
+    for(i = 0; i < n; i++) {
+        if(se->strips[i].size == 0)
+            return 0;
+    }
 
-    return (written);
+    return join_strips(se, buffer, size);
 }
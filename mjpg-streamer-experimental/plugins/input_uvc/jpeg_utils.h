@@ -1 +1,7 @@
+struct jpeg_encoder *jpeg_encoder_new(void);
+void jpeg_encoder_free(struct jpeg_encoder *enc);
 int compress_image_to_jpeg(struct vdIn *vd, unsigned char *buffer, int size, int quality);
+
+struct jpeg_strip_encoder *jpeg_strip_encoder_new(int threads);
+void jpeg_strip_encoder_free(struct jpeg_strip_encoder *se);
+int compress_image_to_jpeg_strips(struct jpeg_strip_encoder *se, struct vdIn *vd, unsigned char *buffer, int size, int quality);
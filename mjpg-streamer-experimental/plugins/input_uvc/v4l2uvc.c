@@ -114,6 +114,14 @@ int init_videoIn(struct vdIn *vd, char *device, int width,
 	vd->vstd = vstd;
     vd->grabmethod = grabmethod;
     vd->soft_framedrop = 0;
+    if(vd->nbuffers <= 0)
+        vd->nbuffers = vd->zerocopy ? NB_BUFFER_ZEROCOPY : NB_BUFFER;
+    if(vd->nbuffers > NB_BUFFER_MAX)
+        vd->nbuffers = NB_BUFFER_MAX;
+    vd->pending = -1;
+    vd->held = 0;
+    vd->closing = 0;
+    pthread_mutex_init(&vd->bufs_mutex, NULL);
     if(init_v4l2(vd) < 0) {
         fprintf(stderr, " Init v4L2 failed !! exit fatal \n");
         goto error;;
@@ -396,7 +404,7 @@ static int init_v4l2(struct vdIn *vd)
      * request buffers
      */
     memset(&vd->rb, 0, sizeof(struct v4l2_requestbuffers));
-    vd->rb.count = NB_BUFFER;
+    vd->rb.count = vd->nbuffers;
     vd->rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     vd->rb.memory = V4L2_MEMORY_MMAP;
 
@@ -406,10 +414,19 @@ static int init_v4l2(struct vdIn *vd)
         goto fatal;
     }
 
+    /* the driver may grant fewer buffers than requested */
+    if(vd->rb.count < 2) {
+        fprintf(stderr, "Insufficient buffer memory\n");
+        goto fatal;
+    }
+    if(vd->rb.count < vd->nbuffers)
+        IPRINT("Buffers coerced ..: from %d to %u\n", vd->nbuffers, vd->rb.count);
+    vd->nbuffers = (vd->rb.count < NB_BUFFER_MAX) ? vd->rb.count : NB_BUFFER_MAX;
+
     /*
      * map the buffers
      */
-    for(i = 0; i < NB_BUFFER; i++) {
+    for(i = 0; i < vd->nbuffers; i++) {
         memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
         vd->buf.index = i;
         vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -432,12 +449,18 @@ static int init_v4l2(struct vdIn *vd)
         }
         if(debug)
             fprintf(stderr, "Buffer mapped at address %p.\n", vd->mem[i]);
+
+        vd->bufs[i].vd = vd;
+        vd->bufs[i].index = i;
+        vd->bufs[i].held = 0;
     }
+    vd->pending = -1;
+    vd->held = 0;
 
     /*
      * Queue the buffers.
      */
-    for(i = 0; i < NB_BUFFER; ++i) {
+    for(i = 0; i < vd->nbuffers; ++i) {
         memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
         vd->buf.index = i;
         vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
@@ -531,6 +554,171 @@ int memcpy_picture(unsigned char *out, unsigned char *buf, int size)
     return pos;
 }
 
+/******************************************************************************
+Description.: returns a buffer to the driver
+Input Value.: vd is the device, index the buffer
+Return Value: 0 if queued, -1 otherwise
+******************************************************************************/
+static int queue_buffer(struct vdIn *vd, int index)
+{
+    struct v4l2_buffer buf;
+
+    memset(&buf, 0, sizeof(struct v4l2_buffer));
+    buf.index = index;
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    if(xioctl(vd->fd, VIDIOC_QBUF, &buf) < 0) {
+        perror("Unable to requeue buffer");
+        return -1;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: describes a JPEG of the camera as pieces for a frame, with the
+              Huffman tables inserted in front of the SOF0 marker if the
+              camera omitted them, like memcpy_picture() but without copying
+Input Value.: buf and size are the JPEG, iov receives FRAME_IOV_MAX entries
+Return Value: number of entries, 0 if there is no SOF0 marker
+******************************************************************************/
+static int jpeg_iov(unsigned char *buf, int size, struct iovec *iov)
+{
+    unsigned char *ptcur = buf, *ptlimit = buf + size;
+
+    if(is_huffman(buf)) {
+        iov[0].iov_base = buf;
+        iov[0].iov_len = size;
+        return 1;
+    }
+
+    /* the marker takes two bytes, check the bound before reading them */
+    while(ptcur + 1 < ptlimit && (((ptcur[0] << 8) | ptcur[1]) != 0xffc0))
+        ptcur++;
+    if(ptcur + 1 >= ptlimit)
+        return 0;
+
+    iov[0].iov_base = buf;
+    iov[0].iov_len = ptcur - buf;
+    iov[1].iov_base = (void *)dht_data;
+    iov[1].iov_len = sizeof(dht_data);
+    iov[2].iov_base = ptcur;
+    iov[2].iov_len = size - (ptcur - buf);
+    return 3;
+}
+
+/******************************************************************************
+Description.: called when the last reference to a frame made by
+              uvcTakeFrame() is gone, the buffer goes back to the driver.
+              If the device was closed meanwhile, the last released frame
+              frees vd.
+Input Value.: opaque is the struct uvcBuffer
+Return Value: -
+******************************************************************************/
+static void release_buffer(void *opaque)
+{
+    struct uvcBuffer *b = opaque;
+    struct vdIn *vd = b->vd;
+    int last;
+
+    pthread_mutex_lock(&vd->bufs_mutex);
+    b->held = 0;
+    vd->held--;
+
+    /* after STREAMOFF uvcResume() queues it together with the others */
+    if(vd->streamingState == STREAMING_ON)
+        queue_buffer(vd, b->index);
+    last = (vd->closing && vd->held == 0);
+    pthread_mutex_unlock(&vd->bufs_mutex);
+
+    if(last)
+        free(vd);
+}
+
+/******************************************************************************
+Description.: makes a frame of the MJPEG buffer the last uvcGrab() dequeued.
+              The buffer itself is published and only queued again once all
+              consumers released the frame. If too few buffers would be left
+              for the driver, the picture is copied instead.
+Input Value.: vd is the device, streaming MJPEG with zerocopy set
+Return Value: the frame, NULL if there is not enough memory
+******************************************************************************/
+frame *uvcTakeFrame(struct vdIn *vd)
+{
+    struct iovec iov[FRAME_IOV_MAX];
+    int index = vd->pending, n = 0, held;
+    frame *f;
+
+    pthread_mutex_lock(&vd->bufs_mutex);
+    held = vd->held;
+    pthread_mutex_unlock(&vd->bufs_mutex);
+
+    /* the driver needs at least two buffers to keep capturing */
+    if(held < vd->nbuffers - 2)
+        n = jpeg_iov(vd->mem[index], vd->tmpbytesused, iov);
+
+    if(n == 0) {
+        f = frame_new(vd->framesizeIn);
+        if(f != NULL)
+            f->size = memcpy_picture(f->data, vd->mem[index], vd->tmpbytesused);
+        return f;
+    }
+
+    f = frame_wrap(iov, n, release_buffer, &vd->bufs[index]);
+    if(f == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&vd->bufs_mutex);
+    vd->bufs[index].held = 1;
+    vd->held++;
+    pthread_mutex_unlock(&vd->bufs_mutex);
+    vd->pending = -1;
+
+    return f;
+}
+
+/******************************************************************************
+Description.: checks without waiting if the driver has another filled buffer
+Input Value.: vd is the device
+Return Value: 1 if a buffer can be dequeued, 0 otherwise
+******************************************************************************/
+static int buffer_ready(struct vdIn *vd)
+{
+    struct timeval tv = {0, 0};
+    fd_set rfds;
+
+    FD_ZERO(&rfds);
+    FD_SET(vd->fd, &rfds);
+
+    return (select(vd->fd + 1, &rfds, NULL, NULL, &tv) > 0) ? 1 : 0;
+}
+
+/******************************************************************************
+Description.: replaces the buffer in vd->buf by the newest one the driver
+              filled meanwhile, the older ones are queued again at once
+Input Value.: vd is the device, vd->buf holds a dequeued buffer
+Return Value: 0 if ok, -1 if a buffer could not be queued again
+******************************************************************************/
+static int drain_buffers(struct vdIn *vd)
+{
+    struct v4l2_buffer newer;
+
+    while(buffer_ready(vd)) {
+        memset(&newer, 0, sizeof(struct v4l2_buffer));
+        newer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        newer.memory = V4L2_MEMORY_MMAP;
+        if(xioctl(vd->fd, VIDIOC_DQBUF, &newer) < 0)
+            break;
+
+        if(queue_buffer(vd, vd->buf.index) < 0)
+            return -1;
+        vd->buf = newer;
+        vd->drained++;
+    }
+
+    return 0;
+}
+
 int uvcGrab(struct vdIn *vd)
 {
 #define HEADERFRAME1 0xaf
@@ -540,6 +728,15 @@ int uvcGrab(struct vdIn *vd)
         if(video_enable(vd))
             goto err;
     }
+
+    /* the buffer of the previous frame was not taken by uvcTakeFrame() */
+    if(vd->pending >= 0) {
+        if(queue_buffer(vd, vd->pending) < 0)
+            goto err;
+        vd->pending = -1;
+    }
+
+retry:
     memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
     vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     vd->buf.memory = V4L2_MEMORY_MMAP;
@@ -549,6 +746,10 @@ int uvcGrab(struct vdIn *vd)
         perror("Unable to dequeue buffer");
         goto err;
     }
+    if(vd->drain && drain_buffers(vd) < 0)
+        goto err;
+    clock_gettime(CLOCK_MONOTONIC, &vd->dequeued);
+    TRACE_PROBE2(frame_dequeue, vd->buf.index, vd->buf.bytesused);
 
     switch(vd->formatIn) {
     case V4L2_PIX_FMT_JPEG:
@@ -558,9 +759,22 @@ int uvcGrab(struct vdIn *vd)
             /* Prevent crash
              * on empty image */
             fprintf(stderr, "Ignoring empty buffer ...\n");
+            if(vd->zerocopy) {
+                if(queue_buffer(vd, vd->buf.index) < 0)
+                    goto err;
+                goto retry;
+            }
             break;
         }
 
+        /* the buffer stays dequeued for uvcTakeFrame() */
+        if(vd->zerocopy) {
+            vd->pending = vd->buf.index;
+            vd->tmpbytesused = vd->buf.bytesused;
+            vd->tmptimestamp = vd->buf.timestamp;
+            return 0;
+        }
+
         /* memcpy(vd->tmpbuffer, vd->mem[vd->buf.index], vd->buf.bytesused);
 
         memcpy (vd->tmpbuffer, vd->mem[vd->buf.index], HEADERFRAME1);
@@ -605,10 +819,64 @@ err:
     return -1;
 }
 
+/******************************************************************************
+Description.: stops streaming while nobody needs frames, so the camera and the
+              USB bus can rest. Format, buffers and controls are kept, which
+              makes uvcResume() much faster than opening the device again.
+Input Value.: vd is the device
+Return Value: 0 if the device stopped streaming, -1 otherwise
+******************************************************************************/
+int uvcSuspend(struct vdIn *vd)
+{
+    int ret;
+
+    if(vd->streamingState != STREAMING_ON)
+        return -1;
+
+    /* STREAMOFF hands all buffers back, released frames must not queue theirs */
+    pthread_mutex_lock(&vd->bufs_mutex);
+    ret = video_disable(vd, STREAMING_SUSPENDED);
+    pthread_mutex_unlock(&vd->bufs_mutex);
+    if(ret != 0)
+        return -1;
+
+    vd->pending = -1;
+    return 0;
+}
+
+/******************************************************************************
+Description.: starts streaming again after uvcSuspend(). STREAMOFF returned
+              all buffers to the application, so they are queued again first,
+              except the ones still held by published frames.
+Input Value.: vd is the device
+Return Value: 0 if the device streams, -1 otherwise
+******************************************************************************/
+int uvcResume(struct vdIn *vd)
+{
+    int i, ret = 0;
+
+    /* setResolution() may have restarted it in the meantime */
+    if(vd->streamingState != STREAMING_SUSPENDED)
+        return 0;
+
+    pthread_mutex_lock(&vd->bufs_mutex);
+    for(i = 0; i < vd->nbuffers && ret == 0; i++) {
+        if(!vd->bufs[i].held)
+            ret = queue_buffer(vd, i);
+    }
+    if(ret == 0)
+        ret = video_enable(vd);
+    pthread_mutex_unlock(&vd->bufs_mutex);
+
+    return (ret == 0) ? 0 : -1;
+}
+
 int close_v4l2(struct vdIn *vd)
 {
+    pthread_mutex_lock(&vd->bufs_mutex);
     if(vd->streamingState == STREAMING_ON)
         video_disable(vd, STREAMING_OFF);
+    pthread_mutex_unlock(&vd->bufs_mutex);
     if(vd->tmpbuffer)
         free(vd->tmpbuffer);
     vd->tmpbuffer = NULL;
@@ -892,11 +1160,17 @@ int setResolution(struct vdIn *vd, int width, int height)
     int ret;
     DBG("setResolution(%d, %d)\n", width, height);
 
+    /* the buffers are unmapped, published frames must be gone */
+    if(vd->held > 0) {
+        IPRINT("can not change the resolution while frames use the driver buffers\n");
+        return -1;
+    }
+
     vd->streamingState = STREAMING_PAUSED;
     if(video_disable(vd, STREAMING_PAUSED) == 0) {  // do streamoff
         DBG("Unmap buffers\n");
         int i;
-        for(i = 0; i < NB_BUFFER; i++)
+        for(i = 0; i < vd->nbuffers; i++)
             munmap(vd->mem[i], vd->buf.length);
 
         if(CLOSE_VIDEO(vd->fd) == 0) {
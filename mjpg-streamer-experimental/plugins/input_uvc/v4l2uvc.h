@@ -42,6 +42,10 @@
 
 #include "../../mjpg_streamer.h"
 #define NB_BUFFER 4
+/* upper limit of buffers requested with -buffers */
+#define NB_BUFFER_MAX 32
+/* default number of buffers when frames are published straight from them */
+#define NB_BUFFER_ZEROCOPY (2 * INPUT_FRAME_HISTORY + 4)
 
 
 #define IOCTL_RETRY 4
@@ -71,6 +75,15 @@ enum _streaming_state {
     STREAMING_OFF = 0,
     STREAMING_ON = 1,
     STREAMING_PAUSED = 2,
+    STREAMING_SUSPENDED = 3,    /* stopped by uvcSuspend(), buffers stay mapped */
+};
+
+/* a driver buffer that may be published as a frame, see uvcTakeFrame() */
+struct vdIn;
+struct uvcBuffer {
+    struct vdIn *vd;
+    int index;
+    int held;               /* published, back to the driver when released */
 };
 
 struct vdIn {
@@ -82,7 +95,8 @@ struct vdIn {
     struct v4l2_format fmt;
     struct v4l2_buffer buf;
     struct v4l2_requestbuffers rb;
-    void *mem[NB_BUFFER];
+    void *mem[NB_BUFFER_MAX];
+    int nbuffers;                       /* requested, then granted by the driver */
     unsigned char *tmpbuffer;
     unsigned char *framebuffer;
     streaming_state streamingState;
@@ -111,9 +125,26 @@ struct vdIn {
     int recordtime;
     uint32_t tmpbytesused;
     struct timeval tmptimestamp;
+    struct timespec dequeued;           /* CLOCK_MONOTONIC, when the buffer was dequeued */
     v4l2_std_id vstd;
     unsigned long frame_period_time; // in ms
     unsigned char soft_framedrop;
+
+    /* publish MJPEG frames from the driver buffers instead of copying them */
+    int zerocopy;
+    int pending;                        /* dequeued by uvcGrab() and not taken, or -1 */
+    struct uvcBuffer bufs[NB_BUFFER_MAX];
+    int held;                           /* number of buffers held by frames */
+    char closing;                       /* set by the cleanup, the last release frees the struct */
+    pthread_mutex_t bufs_mutex;         /* protects bufs, held, closing and streamingState */
+
+    /* compresses YUV frames, see jpeg_utils.c */
+    struct jpeg_encoder *encoder;
+    struct jpeg_strip_encoder *strips;  /* NULL unless compressing on several threads */
+
+    /* dequeue all ready buffers and continue with the newest one */
+    int drain;
+    unsigned long drained;              /* older buffers given back unused */
 };
 
 /* optional initial settings */
@@ -143,6 +174,7 @@ typedef struct {
     pthread_mutex_t controls_mutex;
     struct vdIn *videoIn;
     context_settings *init_settings;
+    int quality;                        /* of the JPEGs compressed by the plugin */
 } context;
 
 int init_videoIn(struct vdIn *vd, char *device, int width, int height, int fps, int format, int grabmethod, globals *pglobal, int id, v4l2_std_id vstd);
@@ -152,6 +184,9 @@ int setResolution(struct vdIn *vd, int width, int height);
 
 int memcpy_picture(unsigned char *out, unsigned char *buf, int size);
 int uvcGrab(struct vdIn *vd);
+frame *uvcTakeFrame(struct vdIn *vd);
+int uvcSuspend(struct vdIn *vd);
+int uvcResume(struct vdIn *vd);
 int close_v4l2(struct vdIn *vd);
 
 int v4l2GetControl(struct vdIn *vd, int control);
@@ -52,5 +52,17 @@ struct _output {
     int (*stop)(int);
     int (*run)(int);
     int (*cmd)(int plugin, unsigned int control_id, unsigned int group, int value, char *value_str);
+
+    /* optional, frames are pushed to it by the core, see dispatch.h */
+    int (*on_frame)(int id, frame *f);
+    int input;      /* input to receive frames from, default 0 */
+    int priority;   /* outputs with higher priority are served first, default 0 */
+    int delivery;   /* DELIVERY_LATEST (default) or DELIVERY_LOSSLESS */
+    int queue_size; /* frames queued for a lossless output, default DELIVERY_QUEUE_SIZE */
+    struct _delivery *queue;
+    int attaches;   /* the plugin calls input_attach() for its consumers, see frame.c */
+
+    /* counted by the core for pushed frames, by the plugin otherwise */
+    struct _metric *delivered, *dropped, *backpressure;
 };
 
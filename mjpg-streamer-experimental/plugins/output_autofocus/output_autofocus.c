@@ -49,7 +49,7 @@
 static pthread_t worker;
 static globals *pglobal;
 static int fd, delay;
-static unsigned char *frame = NULL;
+static frame *current = NULL;
 static int input_number;
 
 /******************************************************************************
@@ -84,7 +84,8 @@ void worker_cleanup(void *arg)
     first_run = 0;
     OPRINT("cleaning up resources allocated by worker thread\n");
 
-    free(frame);
+    frame_unref(current);
+    current = NULL;
     close(fd);
 }
 
@@ -98,31 +99,31 @@ Return Value:
 ******************************************************************************/
 void *worker_thread(void *arg)
 {
+    unsigned long last_seq;
     int frame_size = 0;
     double sv = -1.0, max_sv = 100.0, delta = 500;
     int focus = 255, step = 10, max_focus = 100, search_focus = 1;
 
-    if((frame = malloc(256 * 1024)) == NULL) {
-        OPRINT("not enough memory for worker thread\n");
-        exit(EXIT_FAILURE);
-    }
-
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
+    last_seq = input_sequence(&pglobal->in[input_number]);
     while(!pglobal->stop) {
         DBG("waiting for fresh frame\n");
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+        frame_unref(current);
+        current = NULL;
 
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
+        /* take a reference to the frame following the last one we got */
+        current = input_wait_newer(&pglobal->in[input_number], last_seq, -1, NULL);
 
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
+        /* the picture must be in one piece, see frame_data() */
+        if(current == NULL || frame_data(current) == NULL)
+            continue;
+        last_seq = current->sequence;
+        frame_size = current->size;
 
         /* process frame */
-        sv = getFrameSharpnessValue(frame, frame_size);
+        sv = getFrameSharpnessValue(current->data, frame_size);
         DBG("sharpness is: %f\n", sv);
 
         if(search_focus || (ABS(sv - max_sv) > delta)) {
@@ -30,6 +30,7 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <getopt.h>
 #include <pthread.h>
 #include <fcntl.h>
@@ -44,13 +45,15 @@
 
 #define OUTPUT_PLUGIN_NAME "FILE output plugin"
 
-static pthread_t worker;
 static globals *pglobal;
-static int fd, delay, ringbuffer_size = -1, ringbuffer_exceed = 0, max_frame_size;
+static int fd, delay, ringbuffer_size = -1, ringbuffer_exceed = 0;
 static char *folder = "/tmp";
-static unsigned char *frame = NULL;
+static unsigned long long counter = 0;
+static struct timespec last_saved;  /* publishing time of the last saved frame */
+static int stopped = 0;
 static char *command = NULL;
 static int input_number = 0;
+static int queue_size = DELIVERY_QUEUE_SIZE;
 static char *mjpgFileName = NULL;
 static char *linkFileName = NULL;
 
@@ -70,6 +73,8 @@ void help(void)
             " [-l | --link ]..........: link the last picture in ringbuffer as this fixed named file\n" \
             " [-d | --delay ].........: delay after saving pictures in ms\n" \
             " [-i | --input ].........: read frames from the specified input plugin\n" \
+            " [-q | --queue ].........: frames to buffer while saving is slower than the input,\n" \
+            "                           0 only saves the newest frame and drops the others, default 32\n" \
             " The following arguments are takes effect only if the current mode is not MJPG\n" \
             " [-s | --size ]..........: size of ring buffer (max number of pictures to hold)\n" \
             " [-e | --exceed ]........: allow ringbuffer to exceed limit by this amount\n" \
@@ -98,9 +103,6 @@ void worker_cleanup(void *arg)
     first_run = 0;
     OPRINT("cleaning up resources allocated by worker thread\n");
 
-    if(frame != NULL) {
-        free(frame);
-    }
     close(fd);
 }
 
@@ -196,153 +198,107 @@ void maintain_ringbuffer(int size)
 }
 
 /******************************************************************************
-Description.: this is the main worker thread
-              it loops forever, grabs a fresh frame and stores it to file
-Input Value.:
-Return Value:
+Description.: stores a frame, either as a file of the ringbuffer or appended
+              to the MJPG file
+Input Value.: f is the frame
+Return Value: 0 if it was saved, -1 on errors that end the recording
 ******************************************************************************/
-void *worker_thread(void *arg)
+static int save_frame(frame *f)
 {
-    int ok = 1, frame_size = 0, rc = 0;
     char buffer1[1024] = {0}, buffer2[1024] = {0};
-    unsigned long long counter = 0;
+    struct iovec iov[FRAME_IOV_MAX];
     time_t t;
     struct tm *now;
-    unsigned char *tmp_framebuffer = NULL;
+    int rc;
 
-    /* set cleanup handler to cleanup allocated resources */
-    pthread_cleanup_push(worker_cleanup, NULL);
+    if (mjpgFileName != NULL) { // recording to MJPG file
+        /* save picture to file */
+        if(writev(fd, iov, frame_iov(f, iov)) < 0) {
+            OPRINT("could not write to the MJPG file\n");
+            perror("write()");
+            close(fd);
+            return -1;
+        }
+        return 0;
+    }
 
-    while(ok >= 0 && !pglobal->stop) {
-        DBG("waiting for fresh frame\n");
+    /* single files with ringbuffer mode, get current time */
+    t = time(NULL);
+    now = localtime(&t);
+    if(now == NULL) {
+        perror("localtime");
+        return -1;
+    }
 
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+    /* prepare string, add time and date values */
+    if(strftime(buffer1, sizeof(buffer1), "%%s/%Y_%m_%d_%H_%M_%S_picture_%%09llu.jpg", now) == 0) {
+        OPRINT("strftime returned 0\n");
+        return -1;
+    }
 
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
+    /* finish filename by adding the foldername and a counter value */
+    snprintf(buffer2, sizeof(buffer2), buffer1, folder, counter);
 
-        /* check if buffer for frame is large enough, increase it if necessary */
-        if(frame_size > max_frame_size) {
-            DBG("increasing buffer size to %d\n", frame_size);
+    counter++;
 
-            max_frame_size = frame_size + (1 << 16);
-            if((tmp_framebuffer = realloc(frame, max_frame_size)) == NULL) {
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                LOG("not enough memory\n");
-                return NULL;
-            }
+    DBG("writing file: %s\n", buffer2);
 
-            frame = tmp_framebuffer;
-        }
+    /* open file for write */
+    if((fd = open(buffer2, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+        OPRINT("could not open the file %s\n", buffer2);
+        return -1;
+    }
 
-        /* copy frame to our local buffer now */
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
-
-        /* allow others to access the global buffer again */
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
-
-        if (mjpgFileName == NULL) { // single files with ringbuffer mode
-            /* prepare filename */
-            memset(buffer1, 0, sizeof(buffer1));
-            memset(buffer2, 0, sizeof(buffer2));
-
-            /* get current time */
-            t = time(NULL);
-            now = localtime(&t);
-            if(now == NULL) {
-                perror("localtime");
-                return NULL;
-            }
-
-            /* prepare string, add time and date values */
-            if(strftime(buffer1, sizeof(buffer1), "%%s/%Y_%m_%d_%H_%M_%S_picture_%%09llu.jpg", now) == 0) {
-                OPRINT("strftime returned 0\n");
-                free(frame); frame = NULL;
-                return NULL;
-            }
-
-            /* finish filename by adding the foldername and a counter value */
-            snprintf(buffer2, sizeof(buffer2), buffer1, folder, counter);
-
-            counter++;
-
-            DBG("writing file: %s\n", buffer2);
-
-            /* open file for write */
-            if((fd = open(buffer2, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
-                OPRINT("could not open the file %s\n", buffer2);
-                return NULL;
-            }
-
-            /* save picture to file */
-            if(write(fd, frame, frame_size) < 0) {
-                OPRINT("could not write to file %s\n", buffer2);
-                perror("write()");
-                close(fd);
-                return NULL;
-            }
+    /* save picture to file */
+    if(writev(fd, iov, frame_iov(f, iov)) < 0) {
+        OPRINT("could not write to file %s\n", buffer2);
+        perror("write()");
+        close(fd);
+        return -1;
+    }
 
-            close(fd);
+    close(fd);
+
+    /* link the picture as fixed name file */
+    if (linkFileName) {
+        snprintf(buffer1, sizeof(buffer1), "%s/%s", folder, linkFileName);
+        unlink(buffer1);
+        (void) link(buffer2, buffer1);
+    }
 
-            /* link the picture as fixed name file */
-            if (linkFileName) {
-                snprintf(buffer1, sizeof(buffer1), "%s/%s", folder, linkFileName);
-                unlink(buffer1);
-                (void) link(buffer2, buffer1);
-            }
-
-            /* call the command if user specified one, pass current filename as argument */
-            if(command != NULL) {
-                memset(buffer1, 0, sizeof(buffer1));
-
-                /* buffer2 still contains the filename, pass it to the command as parameter */
-                snprintf(buffer1, sizeof(buffer1), "%s \"%s\"", command, buffer2);
-                DBG("calling command %s", buffer1);
-
-                /* in addition provide the filename as environment variable */
-                if((rc = setenv("MJPG_FILE", buffer2, 1)) != 0) {
-                    LOG("setenv failed (return value %d)\n", rc);
-                }
-
-                /* execute the command now */
-                if((rc = system(buffer1)) != 0) {
-                    LOG("command failed (return value %d)\n", rc);
-                }
-            }
-
-            /*
-             * maintain ringbuffer
-             * do not maintain ringbuffer for each picture, this saves resources since
-             * each run of the maintainance function involves sorting/malloc/free operations
-             */
-            if(ringbuffer_exceed <= 0) {
-                /* keep ringbuffer excactly at specified siOUTPUT_PLUGIN_NAMEze */
-                maintain_ringbuffer(ringbuffer_size);
-            } else if(counter == 1 || counter % (ringbuffer_exceed + 1) == 0) {
-                DBG("counter: %llu, will clean-up now\n", counter);
-                maintain_ringbuffer(ringbuffer_size);
-            }
-        } else { // recording to MJPG file
-            /* save picture to file */
-            if(write(fd, frame, frame_size) < 0) {
-                OPRINT("could not write to file %s\n", buffer2);
-                perror("write()");
-                close(fd);
-                return NULL;
-            }
+    /* call the command if user specified one, pass current filename as argument */
+    if(command != NULL) {
+        memset(buffer1, 0, sizeof(buffer1));
+
+        /* buffer2 still contains the filename, pass it to the command as parameter */
+        snprintf(buffer1, sizeof(buffer1), "%s \"%s\"", command, buffer2);
+        DBG("calling command %s", buffer1);
+
+        /* in addition provide the filename as environment variable */
+        if((rc = setenv("MJPG_FILE", buffer2, 1)) != 0) {
+            LOG("setenv failed (return value %d)\n", rc);
         }
 
-        /* if specified, wait now */
-        if(delay > 0) {
-            usleep(1000 * delay);
+        /* execute the command now */
+        if((rc = system(buffer1)) != 0) {
+            LOG("command failed (return value %d)\n", rc);
         }
     }
 
-    /* cleanup now */
-    pthread_cleanup_pop(1);
+    /*
+     * maintain ringbuffer
+     * do not maintain ringbuffer for each picture, this saves resources since
+     * each run of the maintainance function involves sorting/malloc/free operations
+     */
+    if(ringbuffer_exceed <= 0) {
+        /* keep ringbuffer excactly at specified size */
+        maintain_ringbuffer(ringbuffer_size);
+    } else if(counter == 1 || counter % (ringbuffer_exceed + 1) == 0) {
+        DBG("counter: %llu, will clean-up now\n", counter);
+        maintain_ringbuffer(ringbuffer_size);
+    }
 
-    return NULL;
+    return 0;
 }
 
 /*** plugin interface functions ***/
@@ -390,6 +346,8 @@ int output_init(output_parameter *param, int id)
             {"link", required_argument, 0, 0},
             {"c", required_argument, 0, 0},
             {"command", required_argument, 0, 0},
+            {"q", required_argument, 0, 0},
+            {"queue", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -467,6 +425,12 @@ int output_init(output_parameter *param, int id)
             DBG("case 16,17\n");
             command = strdup(optarg);
             break;
+            /* q queue */
+        case 18:
+        case 19:
+            DBG("case 18,19\n");
+            queue_size = atoi(optarg);
+            break;
         }
     }
 
@@ -478,6 +442,7 @@ int output_init(output_parameter *param, int id)
     OPRINT("output folder.....: %s\n", folder);
     OPRINT("input plugin.....: %d: %s\n", input_number, pglobal->in[input_number].plugin);
     OPRINT("delay after save..: %d\n", delay);
+    OPRINT("delivery..........: %s\n", (queue_size > 0) ? "lossless" : "latest frame only");
     if  (mjpgFileName == NULL) {
         if(ringbuffer_size > 0) {
             OPRINT("ringbuffer size...: %d to %d\n", ringbuffer_size, ringbuffer_size + ringbuffer_exceed);
@@ -497,6 +462,11 @@ int output_init(output_parameter *param, int id)
         free(fnBuffer);
     }
 
+    /* frames are pushed to output_on_frame(), recordings should not miss any */
+    param->global->out[id].input = input_number;
+    param->global->out[id].delivery = (queue_size > 0) ? DELIVERY_LOSSLESS : DELIVERY_LATEST;
+    param->global->out[id].queue_size = queue_size;
+
     param->global->out[id].parametercount = 2;
 
     param->global->out[id].out_parameters = (control*) calloc(2, sizeof(control));
@@ -538,27 +508,53 @@ int output_init(output_parameter *param, int id)
 }
 
 /******************************************************************************
-Description.: calling this function stops the worker thread
+Description.: calling this function stops the recording
 Input Value.: -
 Return Value: always 0
 ******************************************************************************/
 int output_stop(int id)
 {
-    DBG("will cancel worker thread\n");
-    pthread_cancel(worker);
+    DBG("stopping the recording\n");
+    stopped = 1;
+    worker_cleanup(NULL);
     return 0;
 }
 
 /******************************************************************************
-Description.: calling this function creates and starts the worker thread
+Description.: there is no thread to start, the core pushes the frames of the
+              input to output_on_frame() once this returned
 Input Value.: -
 Return Value: always 0
 ******************************************************************************/
 int output_run(int id)
 {
-    DBG("launching worker thread\n");
-    pthread_create(&worker, 0, worker_thread, NULL);
-    pthread_detach(worker);
+    DBG("ready to receive frames\n");
+    return 0;
+}
+
+/******************************************************************************
+Description.: called by the core for every frame of the input, in order and
+              without gaps as long as saving keeps up with the input
+Input Value.: id of the plugin instance, f the frame, only valid during the call
+Return Value: 0 to receive further frames, -1 to stop
+******************************************************************************/
+int output_on_frame(int id, frame *f)
+{
+    if(stopped)
+        return -1;
+
+    /* after a delay the next frame published afterwards is saved */
+    if(delay > 0 && last_saved.tv_sec != 0 &&
+       (f->published.tv_sec - last_saved.tv_sec) * 1000 +
+       (f->published.tv_nsec - last_saved.tv_nsec) / 1000000 < delay)
+        return 0;
+    last_saved = f->published;
+
+    if(save_frame(f) < 0) {
+        stopped = 1;
+        return -1;
+    }
+
     return 0;
 }
 
@@ -574,54 +570,45 @@ int output_cmd(int plugin_id, unsigned int control_id, unsigned int group, int v
 					switch(control_id) {
                             case OUT_FILE_CMD_TAKE: {
                                 if (valueStr != NULL) {
-                                    int frame_size = 0;
-                                    unsigned char *tmp_framebuffer = NULL;
+                                    frame *f = NULL;
+                                    struct iovec iov[FRAME_IOV_MAX];
 
-                                    if(pthread_mutex_lock(&pglobal->in[input_number].db)) {
+                                    if(input_lock(&pglobal->in[input_number])) {
                                         DBG("Unable to lock mutex\n");
                                         return -1;
                                     }
-                                    /* read buffer */
-                                    frame_size = pglobal->in[input_number].size;
+                                    /* take a reference to the current frame */
+                                    f = frame_ref(pglobal->in[input_number].frame);
 
-                                    /* check if buffer for frame is large enough, increase it if necessary */
-                                    if(frame_size > max_frame_size) {
-                                        DBG("increasing buffer size to %d\n", frame_size);
-
-                                        max_frame_size = frame_size + (1 << 16);
-                                        if((tmp_framebuffer = realloc(frame, max_frame_size)) == NULL) {
-                                            pthread_mutex_unlock(&pglobal->in[input_number].db);
-                                            LOG("not enough memory\n");
-                                            return -1;
-                                        }
+                                    /* allow others to access the global buffer again */
+                                    input_unlock(&pglobal->in[input_number]);
 
-                                        frame = tmp_framebuffer;
+                                    if(f == NULL) {
+                                        DBG("No frame available yet\n");
+                                        return -1;
                                     }
 
-                                    /* copy frame to our local buffer now */
-                                    memcpy(frame, pglobal->in[input_number].buf, frame_size);
-
-                                    /* allow others to access the global buffer again */
-                                    pthread_mutex_unlock(&pglobal->in[input_number].db);
-
                                     DBG("writing file: %s\n", valueStr);
 
                                     int fd;
                                     /* open file for write */
                                     if((fd = open(valueStr, O_CREAT | O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
                                         OPRINT("could not open the file %s\n", valueStr);
+                                        frame_unref(f);
                                         return -1;
                                     }
 
                                     /* save picture to file */
-                                    if(write(fd, frame, frame_size) < 0) {
+                                    if(writev(fd, iov, frame_iov(f, iov)) < 0) {
                                         OPRINT("could not write to file %s\n", valueStr);
                                         perror("write()");
                                         close(fd);
+                                        frame_unref(f);
                                         return -1;
                                     }
 
                                     close(fd);
+                                    frame_unref(f);
                                 } else {
                                     DBG("No filename specified\n");
                                     return -1;
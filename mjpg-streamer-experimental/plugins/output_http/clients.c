@@ -0,0 +1,339 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+ * Client registry of the management mode
+ *
+ * The time each client address was last served a frame is kept in a hash
+ * table keyed by the binary address. The buckets are protected by a small
+ * number of mutexes, so lookups of different clients rarely wait for each
+ * other. Entries that were not served for CLIENTS_EXPIRE seconds are removed
+ * whenever their bucket is written to. Once CLIENTS_MAX entries are kept, a
+ * new address first sweeps all buckets for expired entries or, if there are
+ * none, evicts the least recent client. So a public server does not
+ * accumulate every address it ever saw, and new clients are still tracked.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../../mjpg_streamer.h"
+#include "../../utils.h"
+#include "httpd.h"
+
+#ifdef MANAGMENT
+
+#define CLIENTS_BUCKETS 1024
+#define CLIENTS_STRIPES 32
+#define CLIENTS_MAX     16384   /* at most this many addresses are tracked */
+#define CLIENTS_EXPIRE  600     /* seconds an address is remembered after its last frame */
+
+static client_info *buckets[CLIENTS_BUCKETS];
+static pthread_mutex_t stripes[CLIENTS_STRIPES];
+static pthread_once_t clients_once = PTHREAD_ONCE_INIT;
+static int client_count = 0;
+
+static void clients_init(void)
+{
+    int i;
+
+    for(i = 0; i < CLIENTS_STRIPES; i++)
+        pthread_mutex_init(&stripes[i], NULL);
+}
+
+/******************************************************************************
+Description.: extract the address of a client without the port and find the
+              bucket it belongs to
+Input Value.: addr is the address of the client
+              key receives family and address
+Return Value: the bucket, -1 for unsupported address families
+******************************************************************************/
+static int client_key(struct sockaddr_storage *addr, client_info *key)
+{
+    unsigned int hash = 2166136261u;
+    int i, len;
+
+    memset(key->ip, 0, sizeof(key->ip));
+    key->family = addr->ss_family;
+
+    if(addr->ss_family == AF_INET) {
+        len = sizeof(struct in_addr);
+        memcpy(key->ip, &((struct sockaddr_in *)addr)->sin_addr, len);
+    } else if(addr->ss_family == AF_INET6) {
+        len = sizeof(struct in6_addr);
+        memcpy(key->ip, &((struct sockaddr_in6 *)addr)->sin6_addr, len);
+    } else {
+        return -1;
+    }
+
+    /* FNV-1a */
+    for(i = 0; i < len; i++)
+        hash = (hash ^ key->ip[i]) * 16777619u;
+
+    pthread_once(&clients_once, clients_init);
+    return hash % CLIENTS_BUCKETS;
+}
+
+/******************************************************************************
+Description.: look up a client, the caller holds the lock of the bucket
+Input Value.: bucket and key as determined by client_key()
+Return Value: the entry or NULL
+******************************************************************************/
+static client_info *client_find(int bucket, client_info *key)
+{
+    client_info *c;
+
+    for(c = buckets[bucket]; c != NULL; c = c->next) {
+        if(c->family == key->family && memcmp(c->ip, key->ip, sizeof(c->ip)) == 0)
+            return c;
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: make room in the full registry: all expired entries are
+              removed, if there are none the least recent entry of all
+              buckets. The buckets are locked one after the other, the
+              caller must not hold any of the locks.
+Input Value.: now is the current time
+Return Value: -
+******************************************************************************/
+static void clients_evict(struct timeval *now)
+{
+    client_info *c, **p, oldest;
+    int i, removed = 0, oldest_bucket = -1;
+
+    for(i = 0; i < CLIENTS_BUCKETS; i++) {
+        pthread_mutex_lock(&stripes[i % CLIENTS_STRIPES]);
+        for(p = &buckets[i]; (c = *p) != NULL;) {
+            if(now->tv_sec - c->last_take_time.tv_sec > CLIENTS_EXPIRE) {
+                *p = c->next;
+                free(c);
+                removed++;
+                continue;
+            }
+            if(oldest_bucket < 0 || timercmp(&c->last_take_time, &oldest.last_take_time, <)) {
+                oldest = *c;
+                oldest_bucket = i;
+            }
+            p = &c->next;
+        }
+        pthread_mutex_unlock(&stripes[i % CLIENTS_STRIPES]);
+    }
+
+    __sync_fetch_and_sub(&client_count, removed);
+    if(removed > 0 || oldest_bucket < 0)
+        return;
+
+    /* a client served since the sweep keeps its entry */
+    pthread_mutex_lock(&stripes[oldest_bucket % CLIENTS_STRIPES]);
+    for(p = &buckets[oldest_bucket]; (c = *p) != NULL; p = &c->next) {
+        if(c->family == oldest.family && memcmp(c->ip, oldest.ip, sizeof(c->ip)) == 0) {
+            if(!timercmp(&c->last_take_time, &oldest.last_take_time, >)) {
+                *p = c->next;
+                free(c);
+                __sync_fetch_and_sub(&client_count, 1);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stripes[oldest_bucket % CLIENTS_STRIPES]);
+}
+
+/******************************************************************************
+Description.: Looks up the client address.
+Input Value.: addr is the address of the client
+Return Value: If a frame was served to it within the specified interval it returns 1
+              If not it returns with 0
+******************************************************************************/
+int check_client_status(struct sockaddr_storage *addr)
+{
+    client_info key, *c;
+    struct timeval tim;
+    long msec;
+    int bucket, cheater = 0;
+
+    if((bucket = client_key(addr, &key)) < 0)
+        return 0;
+
+    pthread_mutex_lock(&stripes[bucket % CLIENTS_STRIPES]);
+    if((c = client_find(bucket, &key)) != NULL) {
+        gettimeofday(&tim, NULL);
+        msec  = (tim.tv_sec - c->last_take_time.tv_sec) * 1000;
+        msec += (tim.tv_usec - c->last_take_time.tv_usec) / 1000;
+        DBG("diff: %ld\n", msec);
+        if((msec < 1000) && (msec > 0)) { // FIXME make it parameter
+            DBG("CHEATER\n");
+            cheater = 1;
+        }
+    }
+    pthread_mutex_unlock(&stripes[bucket % CLIENTS_STRIPES]);
+
+    return cheater;
+}
+
+/******************************************************************************
+Description.: Remember that a frame was served to a client. New addresses are
+              added, expired entries of the same bucket are removed. If the
+              registry is full, clients_evict() makes room first.
+Input Value.: addr is the address of the client
+Return Value: -
+******************************************************************************/
+void update_client_timestamp(struct sockaddr_storage *addr)
+{
+    client_info key, *c, **p;
+    struct timeval tim;
+    int bucket;
+
+    if((bucket = client_key(addr, &key)) < 0)
+        return;
+
+    gettimeofday(&tim, NULL);
+
+    pthread_mutex_lock(&stripes[bucket % CLIENTS_STRIPES]);
+
+    /* forget the clients of this bucket that were not seen for a long time */
+    for(p = &buckets[bucket]; (c = *p) != NULL;) {
+        if(tim.tv_sec - c->last_take_time.tv_sec > CLIENTS_EXPIRE) {
+            *p = c->next;
+            free(c);
+            __sync_fetch_and_sub(&client_count, 1);
+            continue;
+        }
+        p = &c->next;
+    }
+
+    if((c = client_find(bucket, &key)) == NULL && client_count >= CLIENTS_MAX) {
+        /* the sweep locks every bucket itself */
+        pthread_mutex_unlock(&stripes[bucket % CLIENTS_STRIPES]);
+        clients_evict(&tim);
+        pthread_mutex_lock(&stripes[bucket % CLIENTS_STRIPES]);
+        c = client_find(bucket, &key);
+    }
+
+    if(c == NULL && (c = malloc(sizeof(client_info))) != NULL) {
+        c->family = key.family;
+        memcpy(c->ip, key.ip, sizeof(c->ip));
+        c->next = buckets[bucket];
+        buckets[bucket] = c;
+        __sync_fetch_and_add(&client_count, 1);
+    }
+
+    if(c != NULL)
+        c->last_take_time = tim;
+
+    pthread_mutex_unlock(&stripes[bucket % CLIENTS_STRIPES]);
+}
+
+/******************************************************************************
+Description.: delay the next frame a client may take
+Input Value.: addr is the address of the client, seconds the delay
+Return Value: -
+******************************************************************************/
+void client_penalty(struct sockaddr_storage *addr, int seconds)
+{
+    client_info key, *c;
+    int bucket;
+
+    if((bucket = client_key(addr, &key)) < 0)
+        return;
+
+    pthread_mutex_lock(&stripes[bucket % CLIENTS_STRIPES]);
+    if((c = client_find(bucket, &key)) != NULL)
+        c->last_take_time.tv_sec += seconds;
+    pthread_mutex_unlock(&stripes[bucket % CLIENTS_STRIPES]);
+}
+
+/******************************************************************************
+Description.: Send the known clients and the time they were last served
+Input Value.: fildescriptor fd to send the answer to
+              keep_alive announces that the connection stays open
+Return Value: 0 if the answer was sent, -1 otherwise
+******************************************************************************/
+int send_clients_JSON(int fd, int keep_alive)
+{
+    char *buffer, *bigger, address[INET6_ADDRSTRLEN];
+    int i, len, size = BUFFER_SIZE, first = 1;
+    client_info *c;
+
+    DBG("Serving the clients JSON file\n");
+
+    if((buffer = malloc(size)) == NULL) {
+        send_error(fd, 500, "not enough memory");
+        return -1;
+    }
+
+    len = sprintf(buffer,
+                  "{\n"
+                  "\"clients\": [\n");
+
+    pthread_once(&clients_once, clients_init);
+    for(i = 0; i < CLIENTS_BUCKETS; i++) {
+        pthread_mutex_lock(&stripes[i % CLIENTS_STRIPES]);
+        for(c = buckets[i]; c != NULL; c = c->next) {
+            /* every entry is far shorter than BUFFER_SIZE */
+            if(len + BUFFER_SIZE > size) {
+                if((bigger = realloc(buffer, size * 2)) == NULL)
+                    break;
+                buffer = bigger;
+                size *= 2;
+            }
+
+            if(inet_ntop(c->family, c->ip, address, sizeof(address)) == NULL)
+                snprintf(address, sizeof(address), "unknown");
+
+            len += sprintf(buffer + len,
+                           "%s{\n"
+                           "\"address\": \"%s\",\n"
+                           "\"timestamp\": %ld\n"
+                           "}\n",
+                           first ? "" : ",\n",
+                           address,
+                           (long)c->last_take_time.tv_sec);
+            first = 0;
+        }
+        pthread_mutex_unlock(&stripes[i % CLIENTS_STRIPES]);
+    }
+
+    len += sprintf(buffer + len, "]\n}\n");
+
+    if(send_reply(fd, keep_alive, "application/x-javascript", buffer, len) < 0) {
+        DBG("unable to serve the control JSON file\n");
+        free(buffer);
+        return -1;
+    }
+
+    free(buffer);
+    return 0;
+}
+
+#endif
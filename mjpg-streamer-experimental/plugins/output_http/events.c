@@ -0,0 +1,637 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 busybox-project (base64 function)                    #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+ * Event mode of the HTTP server
+ *
+ * Instead of parking one thread per viewer in pthread_cond_wait(), stream
+ * and snapshot connections are handed over to a small number of epoll
+ * workers once their request was parsed. The sockets are switched to
+ * non-blocking mode and each connection remembers how much of the current
+ * frame was written. A notifier thread per input waits for new frames and
+ * wakes the workers through an eventfd, so a publish only wakes the workers
+ * and not every client.
+ *
+ * A connection only ever holds the frame it is currently sending. Once that
+ * is complete it continues with the newest frame, everything published in
+ * between is dropped. A half sent frame is always finished to keep the
+ * multipart stream intact, so slow clients get a lower frame rate but never
+ * old pictures and never hold back anybody else.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "../../mjpg_streamer.h"
+#include "../../utils.h"
+#include "httpd.h"
+
+#define EVENT_MAX_EVENTS 64
+
+/* a connection served by an event worker */
+typedef struct _event_conn event_conn;
+struct _event_conn {
+    int fd;
+    int input;
+    answer_t type;              /* A_STREAM or A_SNAPSHOT */
+    unsigned long last_seq;     /* sequence of the last frame taken */
+
+    frame *f;                   /* snapshot currently being sent, or NULL */
+    stream_part *part;          /* stream part currently being sent, or NULL */
+    char head[BUFFER_SIZE];     /* header that precedes a snapshot */
+    struct iovec iov[STREAM_PART_IOV];  /* what is left to send */
+    int iov_first, iov_count;
+    size_t length;              /* of the frame being sent, for the statistics */
+    struct timespec first_byte; /* when sending the frame began */
+    struct timespec progress;   /* when the client last accepted data or got a frame */
+    char want_out;              /* EPOLLOUT is registered */
+    stream_client *stats;       /* NULL for snapshots */
+    zerocopy zc;
+
+    #ifdef MANAGMENT
+    struct sockaddr_storage addr;
+    #endif
+
+    event_conn *prev, *next;
+};
+
+/* an epoll worker thread and the connections it serves */
+struct _event_worker {
+    context *pc;
+    int epfd;
+    int evfd;                   /* signals new frames and new connections */
+    pthread_t threadID;
+
+    pthread_mutex_t mutex;      /* protects incoming */
+    event_conn *incoming;       /* connections handed over by client threads */
+
+    event_conn *conns;          /* connections owned by this worker */
+    int clients;
+};
+typedef struct _event_worker event_worker;
+
+/* arguments of a notifier thread */
+typedef struct {
+    context *pc;
+    int input;
+} event_notifier_arg;
+
+static unsigned int next_worker = 0;
+
+/******************************************************************************
+Description.: wake up an event worker
+Input Value.: w is the worker
+Return Value: -
+******************************************************************************/
+static void event_wake(event_worker *w)
+{
+    uint64_t one = 1;
+
+    if(write(w->evfd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("write(eventfd)");
+    }
+}
+
+/******************************************************************************
+Description.: register or unregister interest in writing to a connection
+Input Value.: w is the worker, c the connection, on selects EPOLLOUT
+Return Value: -
+******************************************************************************/
+static void conn_want_output(event_worker *w, event_conn *c, int on)
+{
+    struct epoll_event ev;
+
+    if(c->want_out == on)
+        return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | (on ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    if(epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev) == 0)
+        c->want_out = on;
+}
+
+/******************************************************************************
+Description.: close a connection and release everything it holds
+Input Value.: w is the worker, c the connection
+Return Value: -
+******************************************************************************/
+static void conn_close(event_worker *w, event_conn *c)
+{
+    /* the statistics refer to the descriptor, remove them before closing it */
+    stream_client_remove(w->pc, c->stats);
+    if(c->type == A_SNAPSHOT)
+        input_detach(&w->pc->pglobal->in[c->input]);
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    frame_unref(c->f);
+    stream_part_unref(c->part);
+    zerocopy_cleanup(&c->zc);
+
+    if(c->prev != NULL)
+        c->prev->next = c->next;
+    else
+        w->conns = c->next;
+    if(c->next != NULL)
+        c->next->prev = c->prev;
+
+    w->clients--;
+    DBG("event worker closed connection, %d left\n", w->clients);
+    free(c);
+}
+
+/******************************************************************************
+Description.: take the newest frame of the input and prepare it for sending
+Input Value.: c is an idle connection
+Return Value: 1 if there is something to send, 0 if no new frame is available,
+              -1 if memory is exhausted
+******************************************************************************/
+static int conn_next_frame(event_worker *w, event_conn *c)
+{
+    input *in = &w->pc->pglobal->in[c->input];
+    unsigned long skipped = 0;
+    frame *f;
+    int i;
+
+    f = input_wait_latest(in, c->last_seq, 0, &skipped);
+    if(f == NULL)
+        return 0;
+
+    if(skipped > 0) {
+        DBG("dropped %lu frames\n", skipped);
+        stream_frames_dropped(w->pc, c->stats, c->input, skipped);
+    }
+    c->last_seq = f->sequence;
+
+    #ifdef MANAGMENT
+    update_client_timestamp(&c->addr);
+    #endif
+
+    c->iov_first = 0;
+    c->first_byte.tv_sec = c->first_byte.tv_nsec = 0;
+    clock_gettime(CLOCK_MONOTONIC, &c->progress);
+
+    if(c->type == A_SNAPSHOT) {
+        c->f = f;
+        c->iov[0].iov_base = c->head;
+        c->iov[0].iov_len = snapshot_header(c->head, sizeof(c->head), f, 0);
+        c->iov_count = 1 + frame_iov(f, &c->iov[1]);
+        c->length = c->iov[0].iov_len + f->size;
+        return 1;
+    }
+
+    /* the part is shared with all other clients of this frame */
+    c->part = stream_part_get(w->pc, c->input, f);
+    frame_unref(f);
+    if(c->part == NULL)
+        return -1;
+
+    c->iov_count = stream_part_iov(c->part, c->iov);
+    for(i = 0, c->length = 0; i < c->iov_count; i++)
+        c->length += c->iov[i].iov_len;
+    return 1;
+}
+
+/******************************************************************************
+Description.: write as much of the pending data as the socket accepts
+Input Value.: c is the connection, threshold is the minimum frame size that
+              is sent with MSG_ZEROCOPY, 0 disables it
+Return Value: 0 if everything was sent, 1 if the socket is full, -1 on errors
+******************************************************************************/
+static int conn_flush(event_conn *c, int threshold)
+{
+    stream_part *zc_part = NULL;
+    ssize_t n;
+
+    if(c->part != NULL && threshold > 0 && c->part->f->size >= threshold)
+        zc_part = c->part;
+
+    while(c->iov_count > 0) {
+        n = zerocopy_send(&c->zc, c->fd, &c->iov[c->iov_first], c->iov_count, zc_part);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            return -1;
+        }
+
+        if(n > 0 && (c->part != NULL || c->f != NULL))
+            stream_first_byte(&c->first_byte, c->input, (c->part != NULL) ? c->part->f : c->f, c->fd);
+        if(n > 0)
+            clock_gettime(CLOCK_MONOTONIC, &c->progress);
+        iov_advance(c->iov, &c->iov_first, &c->iov_count, n);
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: handle EPOLLERR, which is also raised for zero copy completions
+Input Value.: c is the connection
+Return Value: 0 if the connection is fine, -1 if it failed
+******************************************************************************/
+static int conn_error(event_conn *c)
+{
+    socklen_t len = sizeof(int);
+    int err = 0;
+
+    if(c->zc.count > 0 && zerocopy_reap(&c->zc, c->fd) < 0)
+        return -1;
+
+    if(getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+        return -1;
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: send as many frames to a connection as are available and the
+              socket accepts, then wait for EPOLLOUT or the next frame
+Input Value.: w is the worker, c the connection
+Return Value: -
+******************************************************************************/
+static void conn_service(event_worker *w, event_conn *c)
+{
+    int rc;
+
+    while(1) {
+        if(c->iov_count == 0) {
+            rc = conn_next_frame(w, c);
+            if(rc < 0) {
+                conn_close(w, c);
+                return;
+            }
+            if(rc == 0) {
+                conn_want_output(w, c, 0);
+                return;
+            }
+        }
+
+        rc = conn_flush(c, w->pc->conf.zerocopy);
+        if(rc < 0) {
+            metric_add(w->pc->send_errors, 1);
+            if(c->stats != NULL)
+                c->stats->errors++;
+            conn_close(w, c);
+            return;
+        }
+        if(rc > 0) {
+            conn_want_output(w, c, 1);
+            return;
+        }
+
+        /* nothing to account for the response header of a stream */
+        if(c->part != NULL || c->f != NULL)
+            stream_frame_sent(w->pc, c->stats, c->input, (c->part != NULL) ? c->part->f : c->f,
+                              c->length, c->fd, &c->first_byte);
+
+        /* a snapshot is complete after its frame */
+        if(c->type == A_SNAPSHOT && c->f != NULL) {
+            conn_close(w, c);
+            return;
+        }
+
+        frame_unref(c->f);
+        c->f = NULL;
+        stream_part_unref(c->part);
+        c->part = NULL;
+
+        if(c->zc.count > 0 && zerocopy_reap(&c->zc, c->fd) < 0) {
+            conn_close(w, c);
+            return;
+        }
+    }
+}
+
+/******************************************************************************
+Description.: close connections that accepted none of their pending data
+              for the send timeout, they would keep their frame and with it
+              maybe a buffer of the input
+Input Value.: w is the worker
+Return Value: -
+******************************************************************************/
+static void event_expire(event_worker *w)
+{
+    long timeout = w->pc->conf.send_timeout * 1000000L;
+    event_conn *c, *next;
+
+    for(c = w->conns; c != NULL; c = next) {
+        next = c->next;
+        if(c->iov_count > 0 && metric_elapsed_us(&c->progress) >= timeout) {
+            DBG("client accepted no data for %d s\n", w->pc->conf.send_timeout);
+            metric_add(w->pc->send_timeouts, 1);
+            if(c->stats != NULL)
+                c->stats->errors++;
+            conn_close(w, c);
+        }
+    }
+}
+
+/******************************************************************************
+Description.: adopt connections handed over by client threads and serve all
+              idle connections, called when the eventfd was signalled
+Input Value.: w is the worker
+Return Value: -
+******************************************************************************/
+static void event_wakeup(event_worker *w)
+{
+    event_conn *c, *next, *incoming;
+    struct epoll_event ev;
+    uint64_t value;
+
+    if(read(w->evfd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        perror("read(eventfd)");
+    }
+
+    pthread_mutex_lock(&w->mutex);
+    incoming = w->incoming;
+    w->incoming = NULL;
+    pthread_mutex_unlock(&w->mutex);
+
+    for(c = incoming; c != NULL; c = next) {
+        next = c->next;
+
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if(epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(c->fd);
+            free(c);
+            continue;
+        }
+
+        c->prev = NULL;
+        c->next = w->conns;
+        if(w->conns != NULL)
+            w->conns->prev = c;
+        w->conns = c;
+        w->clients++;
+
+        /* streams start with their response header */
+        conn_service(w, c);
+    }
+
+    /* new frames or new connections, serve everybody who is idle */
+    for(c = w->conns; c != NULL; c = next) {
+        next = c->next;
+        if(c->iov_count == 0)
+            conn_service(w, c);
+    }
+}
+
+/******************************************************************************
+Description.: main loop of an event worker
+Input Value.: arg is the event_worker
+Return Value: NULL
+******************************************************************************/
+static void *event_worker_thread(void *arg)
+{
+    event_worker *w = arg;
+    struct epoll_event events[EVENT_MAX_EVENTS];
+    char discard[IO_BUFFER];
+    struct timespec expired;
+    int i, n, wakeup;
+    ssize_t r;
+
+    clock_gettime(CLOCK_MONOTONIC, &expired);
+
+    while(!w->pc->pglobal->stop) {
+        n = epoll_wait(w->epfd, events, EVENT_MAX_EVENTS, 1000);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        /*
+         * the eventfd is handled after the sockets, serving idle connections
+         * may close some of them and they must not be referenced afterwards
+         */
+        wakeup = 0;
+        for(i = 0; i < n; i++) {
+            event_conn *c = events[i].data.ptr;
+
+            if(c == NULL) {
+                wakeup = 1;
+                continue;
+            }
+
+            if((events[i].events & EPOLLHUP) ||
+               ((events[i].events & EPOLLERR) && conn_error(c) < 0)) {
+                conn_close(w, c);
+                continue;
+            }
+
+            /* clients are not expected to send anything, a read of 0 means they left */
+            if(events[i].events & EPOLLIN) {
+                r = read(c->fd, discard, sizeof(discard));
+                if(r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+                    conn_close(w, c);
+                    continue;
+                }
+            }
+
+            if(events[i].events & EPOLLOUT)
+                conn_service(w, c);
+        }
+
+        if(wakeup)
+            event_wakeup(w);
+
+        /* stalled clients are looked for once a second */
+        if(w->pc->conf.send_timeout > 0 && metric_elapsed_us(&expired) >= 1000000) {
+            event_expire(w);
+            clock_gettime(CLOCK_MONOTONIC, &expired);
+        }
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: waits for frames of one input and wakes all event workers
+Input Value.: arg is an event_notifier_arg
+Return Value: NULL
+******************************************************************************/
+static void *event_notifier_thread(void *arg)
+{
+    event_notifier_arg *na = arg;
+    context *pc = na->pc;
+    input *in = &pc->pglobal->in[na->input];
+    unsigned long seq = input_sequence(in);
+    frame *f;
+    int i;
+
+    free(na);
+
+    while(!pc->pglobal->stop) {
+        f = input_wait_newer(in, seq, 1000, NULL);
+        if(f == NULL)
+            continue;
+        seq = f->sequence;
+        frame_unref(f);
+
+        for(i = 0; i < pc->worker_count; i++)
+            event_wake(&pc->workers[i]);
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: start the event workers of a server and one notifier per input
+Input Value.: pc is the server context, conf.event_workers must be set
+Return Value: 0 if everything is ok, -1 otherwise
+******************************************************************************/
+int events_start(context *pc)
+{
+    event_worker *workers;
+    struct epoll_event ev;
+    pthread_t notifier;
+    int i, count = pc->conf.event_workers;
+
+    workers = calloc(count, sizeof(event_worker));
+    if(workers == NULL)
+        return -1;
+
+    for(i = 0; i < count; i++) {
+        event_worker *w = &workers[i];
+
+        w->pc = pc;
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        w->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(w->epfd < 0 || w->evfd < 0) {
+            perror("could not create event worker");
+            return -1;
+        }
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if(epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->evfd, &ev) < 0) {
+            perror("epoll_ctl");
+            return -1;
+        }
+
+        pthread_mutex_init(&w->mutex, NULL);
+    }
+
+    pc->workers = workers;
+
+    for(i = 0; i < count; i++) {
+        if(pthread_create(&workers[i].threadID, NULL, event_worker_thread, &workers[i]) != 0) {
+            OPRINT("could not start event worker %d\n", i);
+            return -1;
+        }
+        pthread_detach(workers[i].threadID);
+    }
+
+    for(i = 0; i < pc->pglobal->incnt; i++) {
+        event_notifier_arg *na = malloc(sizeof(event_notifier_arg));
+
+        if(na == NULL)
+            return -1;
+        na->pc = pc;
+        na->input = i;
+        if(pthread_create(&notifier, NULL, event_notifier_thread, na) != 0) {
+            OPRINT("could not start frame notifier for input %d\n", i);
+            free(na);
+            return -1;
+        }
+        pthread_detach(notifier);
+    }
+
+    /* from now on client threads hand over their connections */
+    pc->worker_count = count;
+
+    DBG("started %d event workers\n", count);
+    return 0;
+}
+
+/******************************************************************************
+Description.: hand a stream or snapshot connection over to an event worker,
+              the request must already be parsed and authorized
+Input Value.: context_fd of the client, type is A_STREAM or A_SNAPSHOT,
+              input_number selects the input, fresh as requested by the client
+Return Value: 0 if a worker owns the connection now, -1 otherwise
+******************************************************************************/
+int events_add_client(cfd *context_fd, answer_t type, int input_number, int fresh)
+{
+    context *pc = context_fd->pc;
+    event_worker *w;
+    event_conn *c;
+
+    if(pc->worker_count <= 0)
+        return -1;
+
+    c = calloc(1, sizeof(event_conn));
+    if(c == NULL)
+        return -1;
+
+    c->fd = context_fd->fd;
+    c->type = type;
+    c->input = input_number;
+    c->last_seq = stream_start_sequence(context_fd, &pc->pglobal->in[input_number], fresh);
+    clock_gettime(CLOCK_MONOTONIC, &c->progress);
+    zerocopy_init(&c->zc, c->fd, type == A_STREAM && pc->conf.zerocopy > 0);
+    #ifdef MANAGMENT
+    c->addr = context_fd->addr;
+    #endif
+
+    /* a stream starts with its response header, snapshots wait for the frame */
+    if(type == A_STREAM) {
+        c->stats = context_fd->stream;
+        c->iov[0].iov_base = STREAM_HEADER;
+        c->iov[0].iov_len = strlen(STREAM_HEADER);
+        c->iov_count = 1;
+    } else {
+        /* streams are attached with their statistics, see stream_client_add() */
+        input_attach(&pc->pglobal->in[input_number]);
+    }
+
+    w = &pc->workers[__sync_fetch_and_add(&next_worker, 1) % pc->worker_count];
+
+    pthread_mutex_lock(&w->mutex);
+    c->next = w->incoming;
+    w->incoming = c;
+    pthread_mutex_unlock(&w->mutex);
+
+    event_wake(w);
+    return 0;
+}
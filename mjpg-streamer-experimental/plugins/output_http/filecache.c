@@ -0,0 +1,199 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+ * Cache for the small files of the www folder
+ *
+ * The pages, scripts and stylesheets are requested with every page load but
+ * hardly ever change. Files up to FILE_CACHE_MAX_FILE bytes are kept in
+ * memory, keyed by their path and validated against the result of stat()
+ * on every request, so edited files are picked up right away. Larger files
+ * are sent with sendfile() and never cached.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "../../mjpg_streamer.h"
+#include "../../utils.h"
+#include "httpd.h"
+
+/* total number of bytes the cache may hold */
+#define FILE_CACHE_SIZE (1024*1024)
+
+static file_entry *entries = NULL;
+static long cached_bytes = 0;
+static unsigned long use_clock = 0;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/******************************************************************************
+Description.: check whether a cache entry still describes the file on disk
+Input Value.: e is the entry, st the current result of stat()
+Return Value: 1 if the entry is valid, 0 otherwise
+******************************************************************************/
+static int entry_matches(file_entry *e, struct stat *st)
+{
+    return e->ino == st->st_ino && e->size == st->st_size &&
+           e->mtime.tv_sec == st->st_mtim.tv_sec &&
+           e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/******************************************************************************
+Description.: unlink an entry from the cache, the caller holds cache_mutex
+Input Value.: e is the entry
+Return Value: -
+******************************************************************************/
+static void entry_remove(file_entry *e)
+{
+    file_entry **p;
+
+    for(p = &entries; *p != NULL; p = &(*p)->next) {
+        if(*p == e) {
+            *p = e->next;
+            cached_bytes -= e->size;
+            filecache_put(e);
+            return;
+        }
+    }
+}
+
+/******************************************************************************
+Description.: look up a file in the cache
+Input Value.: path of the file, st is the current result of stat() for it
+Return Value: a reference the caller must release with filecache_put(),
+              NULL if the file is not cached or was changed
+******************************************************************************/
+file_entry *filecache_get(const char *path, struct stat *st)
+{
+    file_entry *e;
+
+    pthread_mutex_lock(&cache_mutex);
+    for(e = entries; e != NULL; e = e->next) {
+        if(strcmp(e->path, path) != 0)
+            continue;
+
+        if(!entry_matches(e, st)) {
+            DBG("cached copy of %s is outdated\n", path);
+            entry_remove(e);
+            e = NULL;
+            break;
+        }
+
+        e->used = ++use_clock;
+        __sync_fetch_and_add(&e->refcount, 1);
+        break;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    return e;
+}
+
+/******************************************************************************
+Description.: read a small file into the cache, evicting the least recently
+              used entries if the cache is full
+Input Value.: path of the file, fd is the opened file, st the result of fstat()
+Return Value: a reference the caller must release with filecache_put(),
+              NULL if the file is too large or could not be read
+******************************************************************************/
+file_entry *filecache_add(const char *path, int fd, struct stat *st)
+{
+    file_entry *e, *it, *oldest;
+    ssize_t n;
+    off_t done = 0;
+
+    if(st->st_size > FILE_CACHE_MAX_FILE)
+        return NULL;
+
+    e = calloc(1, sizeof(file_entry) + st->st_size + strlen(path) + 1);
+    if(e == NULL)
+        return NULL;
+
+    e->data = (char *)(e + 1);
+    e->path = e->data + st->st_size;
+    strcpy(e->path, path);
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtim;
+    e->refcount = 2; /* the cache and the caller */
+
+    while(done < e->size) {
+        n = pread(fd, e->data + done, e->size - done, done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0) {
+            free(e);
+            return NULL;
+        }
+        done += n;
+    }
+
+    pthread_mutex_lock(&cache_mutex);
+
+    /* another thread may have been faster */
+    for(it = entries; it != NULL; it = it->next) {
+        if(strcmp(it->path, path) == 0) {
+            entry_remove(it);
+            break;
+        }
+    }
+
+    while(entries != NULL && cached_bytes + e->size > FILE_CACHE_SIZE) {
+        oldest = entries;
+        for(it = entries->next; it != NULL; it = it->next) {
+            if(it->used < oldest->used)
+                oldest = it;
+        }
+        DBG("evicting %s from the file cache\n", oldest->path);
+        entry_remove(oldest);
+    }
+
+    e->used = ++use_clock;
+    e->next = entries;
+    entries = e;
+    cached_bytes += e->size;
+
+    pthread_mutex_unlock(&cache_mutex);
+
+    return e;
+}
+
+/******************************************************************************
+Description.: release a reference to a cache entry
+Input Value.: e is the entry, may be NULL
+Return Value: -
+******************************************************************************/
+void filecache_put(file_entry *e)
+{
+    if(e == NULL)
+        return;
+
+    if(__sync_sub_and_fetch(&e->refcount, 1) == 0)
+        free(e);
+}
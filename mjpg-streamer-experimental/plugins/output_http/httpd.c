@@ -30,6 +30,11 @@
 #include <pthread.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -64,8 +69,8 @@ Return Value: iobuf
 ******************************************************************************/
 void init_iobuffer(iobuffer *iobuf)
 {
-    memset(iobuf->buffer, 0, sizeof(iobuf->buffer));
     iobuf->level = 0;
+    iobuf->head = 0;
 }
 
 /******************************************************************************
@@ -76,124 +81,113 @@ Return Value: req
 void init_request(request *req)
 {
     req->type        = A_UNKNOWN;
+    req->method      = NULL;
+    req->target      = NULL;
     req->parameter   = NULL;
     req->client      = NULL;
     req->credentials = NULL;
+    req->query_string = NULL;
+    req->fresh       = 0;
+    req->keep_alive  = 0;
+    req->accept_gzip = 0;
+    req->if_none_match = NULL;
 }
 
 /******************************************************************************
-Description.: If strings were assigned to the different members free them
-              This will fail if strings are static, so always use strdup().
-Input Value.: req: pointer to request structure
-Return Value: -
+Description.: find the empty line that terminates the request head
+Input Value.: * buffer.: the data received so far
+              * from...: where to start searching, data before was searched
+              * level..: number of bytes in buffer
+Return Value: length of the head including the empty line, 0 if incomplete
 ******************************************************************************/
-void free_request(request *req)
+static int find_head_end(const char *buffer, int from, int level)
 {
-    if(req->parameter != NULL) free(req->parameter);
-    if(req->client != NULL) free(req->client);
-    if(req->credentials != NULL) free(req->credentials);
-    if(req->query_string != NULL) free(req->query_string);
+    const char *p = buffer + from, *end = buffer + level;
+
+    while((p = memchr(p, '\n', end - p)) != NULL) {
+        if(p + 1 < end && p[1] == '\n')
+            return p + 2 - buffer;
+        if(p + 2 < end && p[1] == '\r' && p[2] == '\n')
+            return p + 3 - buffer;
+        p++;
+    }
+
+    return 0;
 }
 
 /******************************************************************************
-Description.: read with timeout, implemented without using signals
-              tries to read len bytes and returns if enough bytes were read
-              or the timeout was triggered. In case of timeout the return
-              value may differ from the requested bytes "len".
+Description.: Read the head of the next request, that is the request line and
+              all headers up to the empty line. The data is received in as
+              few recv() calls as the client allows. Bytes the client sent
+              ahead, like pipelined requests, stay in the buffer for the next
+              call, the head of the previous request is discarded first.
 Input Value.: * fd.....: fildescriptor to read from
-              * iobuf..: iobuffer that allows to use this functions from multiple
-                         threads because the complete context is the iobuffer.
-              * buffer.: The buffer to store values at, will be set to zero
-                         before storing values.
-              * len....: the length of buffer
-              * timeout: seconds to wait for an answer
-Return Value: * buffer.: will become filled with bytes read
-              * iobuf..: May get altered to save the context for future calls.
-              * func().: bytes copied to buffer or -1 in case of error
+              * iobuf..: iobuffer that keeps the context between calls
+              * timeout: seconds to wait for the request to start
+              * limit..: seconds the complete head may take once it started
+Return Value: length of the head at the start of iobuf->buffer,
+              0 if the head does not fit into the buffer,
+              -1 in case of timeout, error or if the client left,
+              -2 if the head took longer than limit
 ******************************************************************************/
-int _read(int fd, iobuffer *iobuf, void *buffer, size_t len, int timeout)
+int read_request(int fd, iobuffer *iobuf, int timeout, int limit)
 {
-    int copied = 0, rc, i;
-    fd_set fds;
-    struct timeval tv;
-
-    memset(buffer, 0, len);
-
-    while((copied < len)) {
-        i = MIN(iobuf->level, len - copied);
-        memcpy(buffer + copied, iobuf->buffer + IO_BUFFER - iobuf->level, i);
-
-        iobuf->level -= i;
-        copied += i;
-        if(copied >= len)
-            return copied;
-
-        /* select will return in case of timeout or new data arrived */
-        tv.tv_sec = timeout;
-        tv.tv_usec = 0;
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-        if((rc = select(fd + 1, &fds, NULL, NULL, &tv)) <= 0) {
-            if(rc < 0)
-                exit(EXIT_FAILURE);
-
-            /* this must be a timeout */
-            return copied;
-        }
-
-        init_iobuffer(iobuf);
+    struct pollfd pfd;
+    struct timespec now, deadline = {0, 0};
+    int end, from = 0, rc, wait;
+    ssize_t n;
+
+    /* drop the request answered before */
+    if(iobuf->head > 0) {
+        iobuf->level -= iobuf->head;
+        memmove(iobuf->buffer, iobuf->buffer + iobuf->head, iobuf->level);
+        iobuf->head = 0;
+    }
 
-        /*
-         * there should be at least one byte, because select signalled it.
-         * But: It may happen (very seldomly), that the socket gets closed remotly between
-         * the select() and the following read. That is the reason for not relying
-         * on reading at least one byte.
-         */
-        if((iobuf->level = read(fd, &iobuf->buffer, IO_BUFFER)) <= 0) {
-            /* an error occured */
-            return -1;
-        }
+    pfd.fd = fd;
+    pfd.events = POLLIN;
 
-        /* align data to the end of the buffer if less than IO_BUFFER bytes were read */
-        memmove(iobuf->buffer + (IO_BUFFER - iobuf->level), iobuf->buffer, iobuf->level);
-    }
+    while((end = find_head_end(iobuf->buffer, from, iobuf->level)) == 0) {
+        if(iobuf->level == REQUEST_BUFFER)
+            return 0;
 
-    return 0;
-}
+        /* the terminating line may have been received partially */
+        from = MAX(iobuf->level - 2, 0);
 
-/******************************************************************************
-Description.: Read a single line from the provided fildescriptor.
-              This funtion will return under two conditions:
-              * line end was reached
-              * timeout occured
-Input Value.: * fd.....: fildescriptor to read from
-              * iobuf..: iobuffer that allows to use this functions from multiple
-                         threads because the complete context is the iobuffer.
-              * buffer.: The buffer to store values at, will be set to zero
-                         before storing values.
-              * len....: the length of buffer
-              * timeout: seconds to wait for an answer
-Return Value: * buffer.: will become filled with bytes read
-              * iobuf..: May get altered to save the context for future calls.
-              * func().: bytes copied to buffer or -1 in case of error
-******************************************************************************/
-/* read just a single line or timeout */
-int _readline(int fd, iobuffer *iobuf, void *buffer, size_t len, int timeout)
-{
-    char c = '\0', *out = buffer;
-    int i;
+        /* once the request started the rest has to follow within the limit */
+        if(iobuf->level == 0) {
+            wait = timeout * 1000;
+        } else {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if(deadline.tv_sec == 0) {
+                deadline = now;
+                deadline.tv_sec += limit;
+            }
+            wait = (deadline.tv_sec - now.tv_sec) * 1000 +
+                   (deadline.tv_nsec - now.tv_nsec) / 1000000;
+            if(wait <= 0)
+                return -2;
+        }
 
-    memset(buffer, 0, len);
+        rc = poll(&pfd, 1, wait);
+        if(rc < 0 && errno == EINTR)
+            continue;
+        if(rc == 0 && iobuf->level > 0)
+            return -2;
+        if(rc <= 0)
+            return -1;
 
-    for(i = 0; i < len && c != '\n'; i++) {
-        if(_read(fd, iobuf, &c, 1, timeout) <= 0) {
-            /* timeout or error occured */
+        n = recv(fd, iobuf->buffer + iobuf->level, REQUEST_BUFFER - iobuf->level, 0);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
             return -1;
-        }
-        *out++ = c;
+
+        iobuf->level += n;
     }
 
-    return i;
+    iobuf->head = end;
+    return end;
 }
 
 /******************************************************************************
@@ -305,249 +299,559 @@ int unescape(char *string)
     return 0;
 }
 
-#ifdef MANAGMENT
+/******************************************************************************
+Description.: Split the request head in place into the request line and the
+              headers this server cares about. The lines get terminated where
+              they are, the strings of req point into the head.
+Input Value.: * head...: the request head as returned by read_request()
+              * length.: length of the head
+              * req....: the request to fill
+Return Value: 0 if the request line looks valid, -1 otherwise
+******************************************************************************/
+int parse_request(char *head, int length, request *req)
+{
+    char *line = head, *end = head + length, *eol, *value, *version;
+
+    while(line < end && (eol = memchr(line, '\n', end - line)) != NULL) {
+        *eol = '\0';
+        if(eol > line && eol[-1] == '\r')
+            eol[-1] = '\0';
+
+        if(req->method == NULL) {
+            /* request line: method, target and version */
+            req->method = line;
+            if((req->target = strchr(line, ' ')) == NULL)
+                return -1;
+            *req->target++ = '\0';
+            if((version = strchr(req->target, ' ')) != NULL)
+                *version++ = '\0';
+
+            /* HTTP/1.1 connections are persistent unless the client says otherwise */
+            req->keep_alive = (version != NULL && strcmp(version, "HTTP/1.1") == 0);
+        } else if(*line == '\0') {
+            /* the empty line ends the head */
+            break;
+        } else if((value = strchr(line, ':')) != NULL) {
+            *value++ = '\0';
+            value += strspn(value, " \t");
+
+            if(strcasecmp(line, "User-Agent") == 0) {
+                req->client = value;
+            } else if(strcasecmp(line, "Connection") == 0) {
+                if(strcasestr(value, "close") != NULL)
+                    req->keep_alive = 0;
+                else if(strcasestr(value, "keep-alive") != NULL)
+                    req->keep_alive = 1;
+            } else if(strcasecmp(line, "Accept-Encoding") == 0) {
+                req->accept_gzip = (strcasestr(value, "gzip") != NULL);
+            } else if(strcasecmp(line, "If-None-Match") == 0) {
+                if(req->if_none_match == NULL)
+                    req->if_none_match = value;
+            } else if(strcasecmp(line, "Authorization") == 0 &&
+                      strncasecmp(value, "Basic ", strlen("Basic ")) == 0) {
+                req->credentials = value + strlen("Basic ");
+                decodeBase64(req->credentials);
+                DBG("username:password: %s\n", req->credentials);
+            }
+        }
+
+        line = eol + 1;
+    }
+
+    return (req->method != NULL && req->target[0] == '/') ? 0 : -1;
+}
+
 
 /******************************************************************************
-Description.: Adds a new client information struct to the ino list.
-Input Value.: Client IP address as a string
-Return Value: Returns with the newly added info or with a pointer to the existing item
+Description.: Prepare the HTTP response header of a snapshot
+Input Value.: buffer and its size, f is the frame to send
+              keep_alive selects the Connection header
+Return Value: length of the header
 ******************************************************************************/
-client_info *add_client(char *address)
+int snapshot_header(char *buffer, int size, frame *f, int keep_alive)
 {
-    unsigned int i = 0;
-    int name_length = strlen(address) + 1;
+    return snprintf(buffer, size, "HTTP/1.1 200 OK\r\n" \
+                    "Access-Control-Allow-Origin: *\r\n" \
+                    "%s" \
+                    STD_HEADER \
+                    "Content-type: image/jpeg\r\n" \
+                    "Content-Length: %d\r\n" \
+                    "X-Timestamp: %d.%06d\r\n" \
+                    "\r\n", CONNECTION_HEADER(keep_alive), f->size,
+                    (int) f->timestamp.tv_sec, (int) f->timestamp.tv_usec);
+}
 
-    pthread_mutex_lock(&client_infos.mutex);
+/******************************************************************************
+Description.: Prepare the header preceding a frame inside of a M-JPEG stream
+Input Value.: buffer and its size, f is the frame to send
+Return Value: length of the header
+******************************************************************************/
+int stream_part_header(char *buffer, int size, frame *f)
+{
+    /*
+     * print the individual mimetype and the length
+     * sending the content-length fixes random stream disruption observed
+     * with firefox
+     */
+    return snprintf(buffer, size, "Content-Type: image/jpeg\r\n" \
+                    "Content-Length: %d\r\n" \
+                    "X-Timestamp: %d.%06d\r\n" \
+                    "\r\n", f->size, (int)f->timestamp.tv_sec, (int)f->timestamp.tv_usec);
+}
 
-    for (; i<client_infos.client_count; i++) {
-        if (strcmp(client_infos.infos[i]->address, address) == 0) {
-            pthread_mutex_unlock(&client_infos.mutex);
-            return client_infos.infos[i];
-        }
+/******************************************************************************
+Description.: Return the multipart chunk of a frame. The chunk of the newest
+              frame of every input is cached, so the part header is only
+              printed once per frame no matter how many clients stream it.
+Input Value.: pc is the server context, input_number the input f belongs to
+              f is the frame to send
+Return Value: a reference the caller must release with stream_part_unref(),
+              NULL if memory is exhausted
+******************************************************************************/
+stream_part *stream_part_get(context *pc, int input_number, frame *f)
+{
+    stream_part *part, **cached = &pc->parts[input_number];
+
+    pthread_mutex_lock(&pc->parts_mutex);
+
+    if(*cached != NULL && (*cached)->f == f) {
+        part = *cached;
+        __sync_fetch_and_add(&part->refcount, 1);
+        pthread_mutex_unlock(&pc->parts_mutex);
+        return part;
     }
 
-    client_info *current_client_info = malloc(sizeof(client_info));
-    if (current_client_info == NULL) {
-        fprintf(stderr, "could not allocate memory\n");
-        pthread_mutex_unlock(&client_infos.mutex);
+    part = malloc(sizeof(stream_part));
+    if(part == NULL) {
+        pthread_mutex_unlock(&pc->parts_mutex);
         return NULL;
     }
 
-    current_client_info->address = malloc(name_length * sizeof(char));
-    if (current_client_info->address == NULL) {
-        fprintf(stderr, "could not allocate memory\n");
-        pthread_mutex_unlock(&client_infos.mutex);
-        return NULL;
+    part->f = frame_ref(f);
+    part->refcount = 1;
+    part->head_len = stream_part_header(part->head, sizeof(part->head), f);
+
+    /* only a newer frame replaces the cached one, stragglers get their own */
+    if(*cached == NULL || (*cached)->f->sequence < f->sequence) {
+        stream_part_unref(*cached);
+        __sync_fetch_and_add(&part->refcount, 1);
+        *cached = part;
     }
 
-    strcpy(current_client_info->address, address);
-    memset(&(current_client_info->last_take_time), 0, sizeof(struct timeval)); // set last time to zero
+    pthread_mutex_unlock(&pc->parts_mutex);
+    return part;
+}
 
-    client_infos.infos = realloc(client_infos.infos, (client_infos.client_count + 1) * sizeof(client_info*));
-    client_infos.infos[client_infos.client_count] = current_client_info;
-    client_infos.client_count += 1;
+/******************************************************************************
+Description.: Release a reference to a stream part
+Input Value.: part may be NULL
+Return Value: -
+******************************************************************************/
+void stream_part_unref(stream_part *part)
+{
+    if(part == NULL)
+        return;
 
-    pthread_mutex_unlock(&client_infos.mutex);
-    return current_client_info;
+    if(__sync_sub_and_fetch(&part->refcount, 1) == 0) {
+        frame_unref(part->f);
+        free(part);
+    }
 }
 
 /******************************************************************************
-Description.: Looks in the client_infos for the current ip address.
-Input Value.: Client IP address as a string
-Return Value: If a frame was served to it within the specified interval it returns 1
-              If not it returns with 0
+Description.: Describe a stream part for writev() or sendmsg()
+Input Value.: part to send, iov must have room for STREAM_PART_IOV entries
+Return Value: number of entries used
 ******************************************************************************/
-int check_client_status(client_info *client)
+int stream_part_iov(stream_part *part, struct iovec *iov)
 {
-    unsigned int i = 0;
-    pthread_mutex_lock(&client_infos.mutex);
-    for (; i<client_infos.client_count; i++) {
-        if (client_infos.infos[i] == client) {
-            long msec;
-            struct timeval tim;
-            gettimeofday(&tim, NULL);
-            msec  =(tim.tv_sec - client_infos.infos[i]->last_take_time.tv_sec)*1000;
-            msec +=(tim.tv_usec - client_infos.infos[i]->last_take_time.tv_usec)/1000;
-            DBG("diff: %ld\n", msec);
-            if ((msec < 1000) && (msec > 0)) { // FIXME make it parameter
-                DBG("CHEATER\n");
-                pthread_mutex_unlock(&client_infos.mutex);
-                return 1;
-            } else {
-                pthread_mutex_unlock(&client_infos.mutex);
-                return 0;
-            }
+    int n;
+
+    iov[0].iov_base = part->head;
+    iov[0].iov_len = part->head_len;
+    n = 1 + frame_iov(part->f, &iov[1]);
+    iov[n].iov_base = STREAM_BOUNDARY;
+    iov[n].iov_len = strlen(STREAM_BOUNDARY);
+
+    return n + 1;
+}
+
+/******************************************************************************
+Description.: Skip the bytes a partial writev() or sendmsg() transmitted
+Input Value.: iov is the vector, first and count describe the unsent entries
+              n is the number of bytes that were sent
+Return Value: -
+******************************************************************************/
+void iov_advance(struct iovec *iov, int *first, int *count, size_t n)
+{
+    while(n > 0 && *count > 0) {
+        struct iovec *v = &iov[*first];
+
+        if(n >= v->iov_len) {
+            n -= v->iov_len;
+            (*first)++;
+            (*count)--;
+        } else {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+            n = 0;
         }
     }
-    DBG("Client not found in the client list! How did it happend?? This is a BUG\n");
-    pthread_mutex_unlock(&client_infos.mutex);
-    return 0;
+
+    /* skip empty entries so that count reaching 0 means everything was sent */
+    while(*count > 0 && iov[*first].iov_len == 0) {
+        (*first)++;
+        (*count)--;
+    }
 }
 
-void update_client_timestamp(client_info *client)
+/******************************************************************************
+Description.: counts a frame that could not be sent, sends that ran into the
+              send timeout are counted apart from failed connections
+Input Value.: pc is the server, errno is that of the failed send
+              sc is the stream client, NULL for a snapshot
+Return Value: -
+******************************************************************************/
+static void count_send_failure(context *pc, stream_client *sc)
 {
-    struct timeval tim;
-    pthread_mutex_lock(&client_infos.mutex);
-    gettimeofday(&tim, NULL);
-    memcpy(&client->last_take_time, &tim, sizeof(struct timeval));
-    pthread_mutex_unlock(&client_infos.mutex);
+    if(sc != NULL)
+        sc->errors++;
+
+    if(errno == EAGAIN || errno == EWOULDBLOCK)
+        metric_add(pc->send_timeouts, 1);
+    else
+        metric_add(pc->send_errors, 1);
 }
-#endif
 
 /******************************************************************************
 Description.: Send a complete HTTP response and a single JPG-frame.
+              The cached frame is sent right away if it is recent enough,
+              otherwise or if fresh is set the next frame is awaited.
 Input Value.: fildescriptor fd to send the answer to
-Return Value: -
+              input_number selects the input
+              fresh forces to wait for the next frame
+              keep_alive announces that the connection stays open
+Return Value: 0 if the snapshot was sent, -1 otherwise
 ******************************************************************************/
-void send_snapshot(cfd *context_fd, int input_number)
+int send_snapshot(cfd *context_fd, int input_number, int fresh, int keep_alive)
 {
-    unsigned char *frame = NULL;
-    int frame_size = 0;
+    input *in = &pglobal->in[input_number];
+    frame *f = NULL;
     char buffer[BUFFER_SIZE] = {0};
-    struct timeval timestamp;
-
-    /* wait for a fresh frame */
-    pthread_mutex_lock(&pglobal->in[input_number].db);
-    pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+    struct iovec iov[1 + FRAME_IOV_MAX];
+    struct timespec first;
+    int rc, count;
 
-    /* read buffer */
-    frame_size = pglobal->in[input_number].size;
+    /* answer from the cached frame if allowed */
+    if(!fresh && context_fd->pc->conf.max_age >= 0)
+        f = input_latest(in, context_fd->pc->conf.max_age);
 
-    /* allocate a buffer for this single frame */
-    if((frame = malloc(frame_size + 1)) == NULL) {
-        free(frame);
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
-        send_error(context_fd->fd, 500, "not enough memory");
-        return;
+    /* wait for a fresh frame and take a reference to it */
+    if(f == NULL) {
+        input_attach(in);
+        f = input_wait_newer(in, input_sequence(in), -1, NULL);
+        input_detach(in);
     }
-    /* copy v4l2_buffer timeval to user space */
-    timestamp = pglobal->in[input_number].timestamp;
 
-    memcpy(frame, pglobal->in[input_number].buf, frame_size);
-    DBG("got frame (size: %d kB)\n", frame_size / 1024);
-
-    pthread_mutex_unlock(&pglobal->in[input_number].db);
+    if(f == NULL) {
+        send_error(context_fd->fd, 500, "no frame available");
+        return -1;
+    }
+    DBG("got frame (size: %d kB)\n", f->size / 1024);
 
     #ifdef MANAGMENT
-    update_client_timestamp(context_fd->client);
+    update_client_timestamp(&context_fd->addr);
     #endif
 
-    /* write the response */
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Access-Control-Allow-Origin: *\r\n" \
-            STD_HEADER \
-            "Content-type: image/jpeg\r\n" \
-            "X-Timestamp: %d.%06d\r\n" \
-            "\r\n", (int) timestamp.tv_sec, (int) timestamp.tv_usec);
-
-    /* send header and image now */
-    if (write(context_fd->fd, buffer, strlen(buffer)) < 0 ||
-        write(context_fd->fd, frame, frame_size) < 0) {
-        free(frame);
-        return;
+    /* send header and image at once */
+    iov[0].iov_base = buffer;
+    iov[0].iov_len = snapshot_header(buffer, sizeof(buffer), f, keep_alive);
+    count = 1 + frame_iov(f, &iov[1]);
+    first.tv_sec = first.tv_nsec = 0;
+    stream_first_byte(&first, input_number, f, context_fd->fd);
+    rc = writev_all(context_fd->fd, iov, count);
+
+    if(rc == 0)
+        stream_frame_sent(context_fd->pc, NULL, input_number, f, iov[0].iov_len + f->size,
+                          context_fd->fd, &first);
+    else
+        count_send_failure(context_fd->pc, NULL);
+
+    frame_unref(f);
+    return rc;
+}
+
+/******************************************************************************
+Description.: Find the sequence a stream starts after. A recent enough cached
+              frame is sent first, unless the client asked for fresh frames.
+Input Value.: context_fd of the client, in is the input, fresh as requested
+Return Value: sequence number to pass to input_wait_newer()
+******************************************************************************/
+unsigned long stream_start_sequence(cfd *context_fd, input *in, int fresh)
+{
+    unsigned long seq = input_sequence(in);
+    frame *f;
+
+    if(!fresh && context_fd->pc->conf.max_age >= 0 &&
+       (f = input_latest(in, context_fd->pc->conf.max_age)) != NULL) {
+        seq = f->sequence - 1;
+        frame_unref(f);
     }
 
-    free(frame);
+    return seq;
 }
 
 /******************************************************************************
-Description.: Send a complete HTTP response and a stream of JPG-frames.
-Input Value.: fildescriptor fd to send the answer to
-Return Value: -
+Description.: Admit a new stream client if the configured limits allow it and
+              register it so its statistics can be listed
+Input Value.: context_fd of the client, input_number is the streamed input
+Return Value: 0 if the client was admitted, context_fd->stream is the new
+              entry then
+              -1 if a limit was reached
+              -2 if memory is exhausted, the client must not be served
+              since nothing attached it to the input
 ******************************************************************************/
-void send_stream(cfd *context_fd, int input_number)
+int stream_client_add(cfd *context_fd, int input_number)
 {
-    unsigned char *frame = NULL, *tmp = NULL;
-    int frame_size = 0, max_frame_size = 0;
-    char buffer[BUFFER_SIZE] = {0};
-    struct timeval timestamp;
+    context *pc = context_fd->pc;
+    stream_client *sc = calloc(1, sizeof(stream_client)), *it;
+    int same = 0;
+
+    context_fd->stream = NULL;
+    if(sc == NULL)
+        return -2;
+
+    cfd_address(context_fd, sc->address, sizeof(sc->address));
+    if(getnameinfo((struct sockaddr *)&context_fd->addr, context_fd->addr_len,
+                   NULL, 0, sc->port, sizeof(sc->port), NI_NUMERICSERV) != 0)
+        snprintf(sc->port, sizeof(sc->port), "0");
+    sc->fd = context_fd->fd;
+    sc->input = input_number;
+    gettimeofday(&sc->started, NULL);
+
+    pthread_mutex_lock(&pc->streams_mutex);
+    if(pc->conf.max_per_address > 0) {
+        for(it = pc->streams; it != NULL; it = it->next) {
+            if(strcmp(it->address, sc->address) == 0)
+                same++;
+        }
+    }
 
-    DBG("preparing header\n");
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Access-Control-Allow-Origin: *\r\n" \
-            STD_HEADER \
-            "Content-Type: multipart/x-mixed-replace;boundary=" BOUNDARY "\r\n" \
-            "\r\n" \
-            "--" BOUNDARY "\r\n");
+    if((pc->conf.max_streams > 0 && pc->stream_count >= pc->conf.max_streams) ||
+       (pc->conf.max_per_address > 0 && same >= pc->conf.max_per_address)) {
+        pc->streams_rejected++;
+        pthread_mutex_unlock(&pc->streams_mutex);
+        DBG("stream of %s rejected, %d streams running\n", sc->address, pc->stream_count);
+        free(sc);
+        return -1;
+    }
 
-    if(write(context_fd->fd, buffer, strlen(buffer)) < 0) {
-        free(frame);
+    sc->next = pc->streams;
+    if(pc->streams != NULL)
+        pc->streams->prev = sc;
+    pc->streams = sc;
+    pc->stream_count++;
+    pthread_mutex_unlock(&pc->streams_mutex);
+
+    /* the input keeps publishing frames as long as someone watches */
+    input_attach(&pglobal->in[input_number]);
+
+    context_fd->stream = sc;
+    return 0;
+}
+
+/******************************************************************************
+Description.: Remove a stream client that disconnected
+Input Value.: pc is the server context, sc the entry, may be NULL
+Return Value: -
+******************************************************************************/
+void stream_client_remove(context *pc, stream_client *sc)
+{
+    if(sc == NULL)
         return;
+
+    pthread_mutex_lock(&pc->streams_mutex);
+    if(sc->prev != NULL)
+        sc->prev->next = sc->next;
+    else
+        pc->streams = sc->next;
+    if(sc->next != NULL)
+        sc->next->prev = sc->prev;
+    pc->stream_count--;
+    pthread_mutex_unlock(&pc->streams_mutex);
+
+    input_detach(&pglobal->in[sc->input]);
+    free(sc);
+}
+
+/******************************************************************************
+Description.: Account a frame that was sent completely to a client
+Input Value.: pc is the server context, sc the stream client or NULL for
+              snapshots, input_number the input the frame is from
+              f is the frame and bytes the length of the sent data
+              fd is the connection, first the time its first byte was sent
+Return Value: -
+******************************************************************************/
+void stream_frame_sent(context *pc, stream_client *sc, int input_number, frame *f, size_t bytes,
+                       int fd, struct timespec *first)
+{
+    if(sc != NULL) {
+        sc->sent++;
+        sc->bytes += bytes;
     }
 
-    DBG("Headers send, sending stream now\n");
+    metric_add(pc->frames_sent[input_number], 1);
+    metric_add(pc->bytes_sent[input_number], bytes);
+    output_delivered(&pglobal->out[pc->id], 1);
+    metric_observe(pc->latency[input_number], metric_elapsed_us(&f->published));
 
-    while(!pglobal->stop) {
+    TRACE_PROBE3(frame_send_last, input_number, f->sequence, fd);
+    if(tracing)
+        trace_send(input_number, f, fd, bytes, first);
+}
+
+/******************************************************************************
+Description.: Take the time the first byte of a frame was sent
+Input Value.: first is reset for each frame and taken once
+              input_number and f identify the frame, fd the connection
+Return Value: -
+******************************************************************************/
+void stream_first_byte(struct timespec *first, int input_number, frame *f, int fd)
+{
+    if(first->tv_sec != 0 || first->tv_nsec != 0)
+        return;
 
-        /* wait for fresh frames */
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+    clock_gettime(CLOCK_MONOTONIC, first);
+    TRACE_PROBE3(frame_send_first, input_number, f->sequence, fd);
+}
 
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
+/******************************************************************************
+Description.: Account frames a stream client missed because it was still busy
+Input Value.: pc is the server context, sc the stream client, may be NULL
+              input_number the streamed input, skipped the number of frames
+Return Value: -
+******************************************************************************/
+void stream_frames_dropped(context *pc, stream_client *sc, int input_number, unsigned long skipped)
+{
+    if(sc != NULL)
+        sc->dropped += skipped;
 
-        /* check if framebuffer is large enough, increase it if necessary */
-        if(frame_size > max_frame_size) {
-            DBG("increasing buffer size to %d\n", frame_size);
+    metric_add(pc->frames_dropped[input_number], skipped);
+    output_dropped(&pglobal->out[pc->id], skipped);
+}
 
-            max_frame_size = frame_size + TEN_K;
-            if((tmp = realloc(frame, max_frame_size)) == NULL) {
-                free(frame);
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                send_error(context_fd->fd, 500, "not enough memory");
-                return;
-            }
+/******************************************************************************
+Description.: Send a complete HTTP response and a stream of JPG-frames.
+Input Value.: fildescriptor fd to send the answer to
+              input_number selects the input
+              fresh forces to start with the next frame
+Return Value: -
+******************************************************************************/
+void send_stream(cfd *context_fd, int input_number, int fresh)
+{
+    input *in = &pglobal->in[input_number];
+    frame *f = NULL;
+    stream_part *part = NULL;
+    stream_client *sc;
+    zerocopy zc;
+    struct iovec iov[STREAM_PART_IOV];
+    struct timespec first_byte;
+    unsigned long last_seq, skipped = 0;
+    int i, first, count, threshold = context_fd->pc->conf.zerocopy;
+    ssize_t n = 0;
+    size_t length;
 
-            frame = tmp;
-        }
+    DBG("preparing header\n");
+    sc = context_fd->stream;
+    if(write(context_fd->fd, STREAM_HEADER, strlen(STREAM_HEADER)) < 0) {
+        stream_client_remove(context_fd->pc, sc);
+        return;
+    }
 
-        /* copy v4l2_buffer timeval to user space */
-        timestamp = pglobal->in[input_number].timestamp;
+    DBG("Headers send, sending stream now\n");
 
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
-        DBG("got frame (size: %d kB)\n", frame_size / 1024);
+    zerocopy_init(&zc, context_fd->fd, threshold > 0);
+    last_seq = stream_start_sequence(context_fd, in, fresh);
+    while(!pglobal->stop) {
 
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
+        /*
+         * continue with the newest frame, frames published while the last
+         * one was written are dropped so a slow client does not fall behind
+         */
+        f = input_wait_latest(in, last_seq, -1, &skipped);
+        if(f == NULL)
+            continue;
+        if(skipped > 0) {
+            DBG("dropped %lu frames\n", skipped);
+            stream_frames_dropped(context_fd->pc, sc, input_number, skipped);
+        }
+        last_seq = f->sequence;
+        DBG("got frame (size: %d kB)\n", f->size / 1024);
 
         #ifdef MANAGMENT
-        update_client_timestamp(context_fd->client);
+        update_client_timestamp(&context_fd->addr);
         #endif
 
-        /*
-         * print the individual mimetype and the length
-         * sending the content-length fixes random stream disruption observed
-         * with firefox
-         */
-        sprintf(buffer, "Content-Type: image/jpeg\r\n" \
-                "Content-Length: %d\r\n" \
-                "X-Timestamp: %d.%06d\r\n" \
-                "\r\n", frame_size, (int)timestamp.tv_sec, (int)timestamp.tv_usec);
-        DBG("sending intemdiate header\n");
-        if(write(context_fd->fd, buffer, strlen(buffer)) < 0) break;
+        /* part header, frame and boundary are prepared once and sent at once */
+        part = stream_part_get(context_fd->pc, input_number, f);
+        frame_unref(f);
+        f = NULL;
+        if(part == NULL)
+            break;
 
         DBG("sending frame\n");
-        if(write(context_fd->fd, frame, frame_size) < 0) break;
+        first = 0;
+        count = stream_part_iov(part, iov);
+        for(i = 0, length = 0; i < count; i++)
+            length += iov[i].iov_len;
+        first_byte.tv_sec = first_byte.tv_nsec = 0;
+        while(count > 0) {
+            n = zerocopy_send(&zc, context_fd->fd, &iov[first], count,
+                              (threshold > 0 && part->f->size >= threshold) ? part : NULL);
+            if(n < 0) {
+                if(errno == EINTR)
+                    continue;
+                break;
+            }
+            if(n > 0)
+                stream_first_byte(&first_byte, input_number, part->f, context_fd->fd);
+            iov_advance(iov, &first, &count, n);
+        }
+        if(n < 0) {
+            count_send_failure(context_fd->pc, sc);
+            break;
+        }
+
+        stream_frame_sent(context_fd->pc, sc, input_number, part->f, length, context_fd->fd, &first_byte);
 
-        DBG("sending boundary\n");
-        sprintf(buffer, "\r\n--" BOUNDARY "\r\n");
-        if(write(context_fd->fd, buffer, strlen(buffer)) < 0) break;
+        stream_part_unref(part);
+        part = NULL;
+
+        if(zc.count > 0 && zerocopy_reap(&zc, context_fd->fd) < 0) break;
     }
 
-    free(frame);
+    stream_part_unref(part);
+    zerocopy_cleanup(&zc);
+    stream_client_remove(context_fd->pc, sc);
 }
 
 #ifdef WXP_COMPAT
 /******************************************************************************
 Description.: Sends a mjpg stream in the same format as the WebcamXP does
 Input Value.: fildescriptor fd to send the answer to
+              input_number selects the input
+              fresh forces to start with the next frame
 Return Value: -
 ******************************************************************************/
-void send_stream_wxp(cfd *context_fd, int input_number)
+void send_stream_wxp(cfd *context_fd, int input_number, int fresh)
 {
-    unsigned char *frame = NULL, *tmp = NULL;
-    int frame_size = 0, max_frame_size = 0;
+    input *in = &pglobal->in[input_number];
+    frame *f = NULL;
+    stream_client *sc;
+    struct timespec first_byte;
+    struct iovec iov[1 + FRAME_IOV_MAX];
+    unsigned long last_seq, skipped = 0;
     char buffer[BUFFER_SIZE] = {0};
-    struct timeval timestamp;
 
     DBG("preparing header\n");
 
@@ -573,62 +877,105 @@ void send_stream_wxp(cfd *context_fd, int input_number)
                     curDateBuffer,
                     expDateBuffer);
 
+    sc = context_fd->stream;
     if(write(context_fd->fd, buffer, strlen(buffer)) < 0) {
-        free(frame);
+        stream_client_remove(context_fd->pc, sc);
         return;
     }
 
     DBG("Headers send, sending stream now\n");
 
+    last_seq = stream_start_sequence(context_fd, in, fresh);
     while(!pglobal->stop) {
 
-        /* wait for fresh frames */
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
-
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
-
-        /* check if framebuffer is large enough, increase it if necessary */
-        if(frame_size > max_frame_size) {
-            DBG("increasing buffer size to %d\n", frame_size);
-
-            max_frame_size = frame_size + TEN_K;
-            if((tmp = realloc(frame, max_frame_size)) == NULL) {
-                free(frame);
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                send_error(context_fd->fd, 500, "not enough memory");
-                return;
-            }
-
-            frame = tmp;
+        /* continue with the newest frame, see send_stream() */
+        f = input_wait_latest(in, last_seq, -1, &skipped);
+        if(f == NULL)
+            continue;
+        if(skipped > 0) {
+            DBG("dropped %lu frames\n", skipped);
+            stream_frames_dropped(context_fd->pc, sc, input_number, skipped);
         }
-
-        /* copy v4l2_buffer timeval to user space */
-        timestamp = pglobal->in[input_number].timestamp;
+        last_seq = f->sequence;
 
         #ifdef MANAGMENT
-        update_client_timestamp(context_fd->client);
+        update_client_timestamp(&context_fd->addr);
         #endif
 
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
-        DBG("got frame (size: %d kB)\n", frame_size / 1024);
-
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
+        DBG("got frame (size: %d kB)\n", f->size / 1024);
 
         memset(buffer, 0, 50*sizeof(char));
-        sprintf(buffer, "mjpeg %07d12345", frame_size);
+        sprintf(buffer, "mjpeg %07d12345", f->size);
         DBG("sending intemdiate header\n");
-        if(write(context_fd->fd, buffer, 50) < 0) break;
+        first_byte.tv_sec = first_byte.tv_nsec = 0;
+        stream_first_byte(&first_byte, input_number, f, context_fd->fd);
+        iov[0].iov_base = buffer;
+        iov[0].iov_len = 50;
+        if(writev_all(context_fd->fd, iov, 1 + frame_iov(f, &iov[1])) < 0) {
+            count_send_failure(context_fd->pc, sc);
+            break;
+        }
 
-        DBG("sending frame\n");
-        if(write(context_fd->fd, frame, frame_size) < 0) break;
+        stream_frame_sent(context_fd->pc, sc, input_number, f, 50 + f->size, context_fd->fd, &first_byte);
+
+        frame_unref(f);
+        f = NULL;
     }
 
-    free(frame);
+    frame_unref(f);
+    stream_client_remove(context_fd->pc, sc);
 }
 #endif
 
+/******************************************************************************
+Description.: Write all data described by iov, continuing after partial writes
+Input Value.: fd to write to, iov and count describe the data
+Return Value: 0 if everything was written, -1 otherwise
+******************************************************************************/
+int writev_all(int fd, struct iovec *iov, int count)
+{
+    int first = 0;
+    ssize_t n;
+
+    while(count > 0) {
+        if((n = writev(fd, &iov[first], count)) < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        iov_advance(iov, &first, &count, n);
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: Send a complete answer of known length, afterwards the client may
+              send further requests on the same connection if keep_alive is set
+Input Value.: * fd........: filedescriptor to send the answer to
+              * keep_alive: announce that the connection stays open
+              * mimetype..: content type of the body
+              * body......: the content and its length
+Return Value: 0 if everything was sent, -1 otherwise
+******************************************************************************/
+int send_reply(int fd, int keep_alive, const char *mimetype, const char *body, int length)
+{
+    char header[BUFFER_SIZE];
+    struct iovec iov[2];
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\n" \
+                              "Content-type: %s\r\n" \
+                              "Content-Length: %d\r\n" \
+                              "%s" \
+                              STD_HEADER \
+                              "\r\n", mimetype, length, CONNECTION_HEADER(keep_alive));
+    iov[1].iov_base = (void *)body;
+    iov[1].iov_len = length;
+
+    return writev_all(fd, iov, 2);
+}
+
 /******************************************************************************
 Description.: Send error messages and headers.
 Input Value.: * fd.....: is the filedescriptor to send the message to
@@ -643,6 +990,7 @@ void send_error(int fd, int which, char *message)
     if(which == 401) {
         sprintf(buffer, "HTTP/1.0 401 Unauthorized\r\n" \
                 "Content-type: text/plain\r\n" \
+                CONNECTION_CLOSE \
                 STD_HEADER \
                 "WWW-Authenticate: Basic realm=\"MJPG-Streamer\"\r\n" \
                 "\r\n" \
@@ -651,6 +999,7 @@ void send_error(int fd, int which, char *message)
     } else if(which == 404) {
         sprintf(buffer, "HTTP/1.0 404 Not Found\r\n" \
                 "Content-type: text/plain\r\n" \
+                CONNECTION_CLOSE \
                 STD_HEADER \
                 "\r\n" \
                 "404: Not Found!\r\n" \
@@ -658,6 +1007,7 @@ void send_error(int fd, int which, char *message)
     } else if(which == 500) {
         sprintf(buffer, "HTTP/1.0 500 Internal Server Error\r\n" \
                 "Content-type: text/plain\r\n" \
+                CONNECTION_CLOSE \
                 STD_HEADER \
                 "\r\n" \
                 "500: Internal Server Error!\r\n" \
@@ -665,13 +1015,24 @@ void send_error(int fd, int which, char *message)
     } else if(which == 400) {
         sprintf(buffer, "HTTP/1.0 400 Bad Request\r\n" \
                 "Content-type: text/plain\r\n" \
+                CONNECTION_CLOSE \
                 STD_HEADER \
                 "\r\n" \
                 "400: Not Found!\r\n" \
                 "%s", message);
+    } else if(which == 503) {
+        sprintf(buffer, "HTTP/1.0 503 Service Unavailable\r\n" \
+                "Content-type: text/plain\r\n" \
+                "Retry-After: " RETRY_AFTER "\r\n" \
+                CONNECTION_CLOSE \
+                STD_HEADER \
+                "\r\n" \
+                "503: Service Unavailable!\r\n" \
+                "%s", message);
     } else if (which == 403) {
         sprintf(buffer, "HTTP/1.0 403 Forbidden\r\n" \
                 "Content-type: text/plain\r\n" \
+                CONNECTION_CLOSE \
                 STD_HEADER \
                 "\r\n" \
                 "403: Forbidden!\r\n" \
@@ -679,6 +1040,7 @@ void send_error(int fd, int which, char *message)
     } else {
         sprintf(buffer, "HTTP/1.0 501 Not Implemented\r\n" \
                 "Content-type: text/plain\r\n" \
+                CONNECTION_CLOSE \
                 STD_HEADER \
                 "\r\n" \
                 "501: Not Implemented!\r\n" \
@@ -695,16 +1057,28 @@ Description.: Send HTTP header and copy the content of a file. To keep things
               simple, just a single folder gets searched for the file. Just
               files with known extension and supported mimetype get served.
               If no parameter was given, the file "index.html" will be copied.
+              A precompressed "<file>.gz" is preferred if the client accepts
+              gzip. Small files are served from memory, larger ones with
+              sendfile(). If the client already has the current version, as
+              told by If-None-Match, just "304 Not Modified" is answered.
 Input Value.: * fd.......: filedescriptor to send data to
               * id.......: specifies which server-context is the right one
-              * parameter: string that consists of the filename
-Return Value: -
+              * req......: the request, the parameter names the file
+Return Value: 0 if the file was sent completely, -1 otherwise
 ******************************************************************************/
-void send_file(int id, int fd, char *parameter)
+int send_file(int id, int fd, request *req)
 {
     char buffer[BUFFER_SIZE] = {0};
-    char *extension, *mimetype = NULL;
-    int i, lfd;
+    char path[BUFFER_SIZE] = {0};
+    char etag[64], modified[64];
+    char *extension, *mimetype = NULL, *parameter = req->parameter;
+    int i, lfd, gzipped = 0, vary = 0, rc = 0;
+    struct stat st;
+    struct tm tm;
+    struct iovec iov[2];
+    file_entry *cached;
+    off_t offset = 0;
+    ssize_t n;
     config conf = servers[id].conf;
 
     /* in case no parameter was given */
@@ -722,7 +1096,7 @@ void send_file(int id, int fd, char *parameter)
 
     if(lastDot == 0) {
         send_error(fd, 400, "No file extension found");
-        return;
+        return -1;
     } else {
         extension = parameter + lastDot;
         DBG("%s EXTENSION: %s\n", parameter, extension);
@@ -739,41 +1113,112 @@ void send_file(int id, int fd, char *parameter)
     /* in case of unknown mimetype or extension leave */
     if(mimetype == NULL) {
         send_error(fd, 404, "MIME-TYPE not known");
-        return;
+        return -1;
     }
 
     /* now filename, mimetype and extension are known */
     DBG("trying to serve file \"%s\", extension: \"%s\" mime: \"%s\"\n", parameter, extension, mimetype);
 
-    /* build the absolute path to the file */
-    strncat(buffer, conf.www_folder, sizeof(buffer) - 1);
-    strncat(buffer, parameter, sizeof(buffer) - strlen(buffer) - 1);
+    /* build the absolute path to the file, prefer a precompressed copy */
+    strncat(path, conf.www_folder, sizeof(path) - 1);
+    strncat(path, parameter, sizeof(path) - strlen(path) - 1);
+
+    /* once a sibling exists the answer depends on Accept-Encoding, caches
+       must know that even if this client got the plain file */
+    if(strlen(path) + 3 < sizeof(path)) {
+        strcat(path, ".gz");
+        if(stat(path, &st) == 0 && S_ISREG(st.st_mode))
+            vary = 1;
+        if(vary && req->accept_gzip)
+            gzipped = 1;
+        else
+            path[strlen(path) - 3] = '\0';
+    }
 
-    /* try to open that file */
-    if((lfd = open(buffer, O_RDONLY)) < 0) {
-        DBG("file %s not accessible\n", buffer);
+    if(!gzipped && (stat(path, &st) < 0 || !S_ISREG(st.st_mode))) {
+        DBG("file %s not accessible\n", path);
         send_error(fd, 404, "Could not open file");
-        return;
+        return -1;
     }
-    DBG("opened file: %s\n", buffer);
 
-    /* prepare HTTP header */
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", mimetype);
-    i = strlen(buffer);
+    /* the validators change whenever the file is replaced or modified */
+    snprintf(etag, sizeof(etag), "\"%lx-%llx-%lx.%lx%s\"", (unsigned long)st.st_ino,
+             (unsigned long long)st.st_size, (unsigned long)st.st_mtim.tv_sec,
+             (unsigned long)st.st_mtim.tv_nsec, gzipped ? "-gz" : "");
+    gmtime_r(&st.st_mtime, &tm);
+    strftime(modified, sizeof(modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+    if(req->if_none_match != NULL && strstr(req->if_none_match, etag) != NULL) {
+        DBG("client has the current version of %s\n", path);
+        i = snprintf(buffer, sizeof(buffer), "HTTP/1.1 304 Not Modified\r\n" \
+                     "ETag: %s\r\n" \
+                     "Last-Modified: %s\r\n" \
+                     "%s" \
+                     "%s" \
+                     FILE_HEADER \
+                     "\r\n", etag, modified, vary ? VARY_HEADER : "",
+                     CONNECTION_HEADER(req->keep_alive));
+        return (write(fd, buffer, i) == i) ? 0 : -1;
+    }
 
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    do {
-        if(write(fd, buffer, i) < 0) {
-            close(lfd);
-            return;
+    /* small files are answered from memory */
+    if((cached = filecache_get(path, &st)) == NULL) {
+        if((lfd = open(path, O_RDONLY)) < 0 || fstat(lfd, &st) < 0) {
+            DBG("file %s not accessible\n", path);
+            if(lfd >= 0)
+                close(lfd);
+            send_error(fd, 404, "Could not open file");
+            return -1;
+        }
+        DBG("opened file: %s\n", path);
+        cached = filecache_add(path, lfd, &st);
+    } else {
+        lfd = -1;
+    }
+
+    /* prepare HTTP header */
+    i = snprintf(buffer, sizeof(buffer), "HTTP/1.1 200 OK\r\n" \
+                 "Content-type: %s\r\n" \
+                 "Content-Length: %lld\r\n" \
+                 "%s" \
+                 "ETag: %s\r\n" \
+                 "Last-Modified: %s\r\n" \
+                 "%s" \
+                 "%s" \
+                 FILE_HEADER \
+                 "\r\n", mimetype, (long long)st.st_size,
+                 gzipped ? "Content-Encoding: gzip\r\n" : "", etag, modified,
+                 vary ? VARY_HEADER : "", CONNECTION_HEADER(req->keep_alive));
+
+    if(cached != NULL) {
+        /* header and content at once */
+        iov[0].iov_base = buffer;
+        iov[0].iov_len = i;
+        iov[1].iov_base = cached->data;
+        iov[1].iov_len = cached->size;
+        rc = writev_all(fd, iov, 2);
+        filecache_put(cached);
+    } else if(write(fd, buffer, i) != i) {
+        rc = -1;
+    } else {
+        /* let the kernel copy the file to the socket */
+        while(offset < st.st_size) {
+            n = sendfile(fd, lfd, &offset, st.st_size - offset);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0) {
+                /* the file shrank or the client left, the length is wrong now */
+                rc = -1;
+                break;
+            }
         }
-    } while((i = read(lfd, buffer, sizeof(buffer))) > 0);
+    }
 
     /* close file, job done */
-    close(lfd);
+    if(lfd >= 0)
+        close(lfd);
+
+    return rc;
 }
 
 /******************************************************************************
@@ -852,9 +1297,10 @@ Description.: Perform a command specified by parameter. Send response to fd.
 Input Value.: * fd.......: filedescriptor to send HTTP response to.
               * parameter: contains the command and value as string.
               * id.......: specifies which server-context to choose.
-Return Value: -
+              * keep_alive: announce that the connection stays open
+Return Value: 0 if the answer was sent, -1 otherwise
 ******************************************************************************/
-void command(int id, int fd, char *parameter)
+int command(int id, int fd, char *parameter, int keep_alive)
 {
     char buffer[BUFFER_SIZE] = {0};
     char *command = NULL, *svalue = NULL, *value, *command_id_string;
@@ -866,7 +1312,7 @@ void command(int id, int fd, char *parameter)
     if(parameter == NULL || strlen(parameter) >= 255 || strlen(parameter) == 0) {
         DBG("parameter string looks bad\n");
         send_error(fd, 400, "Parameter-string of command does not look valid.");
-        return;
+        return -1;
     }
 
     /* command format:
@@ -883,7 +1329,7 @@ void command(int id, int fd, char *parameter)
     if((command = strstr(parameter, "id=")) == NULL) {
         DBG("no command id specified\n");
         send_error(fd, 400, "no GET variable \"id=...\" found, it is required to specify which command id to execute");
-        return;
+        return -1;
     }
 
     /* allocate and copy command string */
@@ -892,7 +1338,7 @@ void command(int id, int fd, char *parameter)
     if((command = strndup(command, len)) == NULL) {
         send_error(fd, 500, "could not allocate memory");
         LOG("could not allocate memory\n");
-        return;
+        return -1;
     }
 
     /* convert the command to id */
@@ -902,7 +1348,7 @@ void command(int id, int fd, char *parameter)
         if(command != NULL) free(command);
         send_error(fd, 500, "could not allocate memory");
         LOG("could not allocate memory\n");
-        return;
+        return -1;
     }
 
     command_id = MAX(MIN(strtol(svalue, NULL, 10), INT_MAX), INT_MIN);
@@ -916,7 +1362,7 @@ void command(int id, int fd, char *parameter)
             if(command != NULL) free(command);
             send_error(fd, 500, "could not allocate memory");
             LOG("could not allocate memory\n");
-            return;
+            return -1;
         }
         ivalue = MAX(MIN(strtol(svalue, NULL, 10), INT_MAX), INT_MIN);
         DBG("The command value converted value form string %s to integer %d\n", svalue, ivalue);
@@ -930,7 +1376,7 @@ void command(int id, int fd, char *parameter)
             if(command != NULL) free(command);
             send_error(fd, 500, "could not allocate memory");
             LOG("could not allocate memory\n");
-            return;
+            return -1;
         }
         group = MAX(MIN(strtol(svalue, NULL, 10), INT_MAX), INT_MIN);
         DBG("The command type value converted value form string %s to integer %d\n", svalue, group);
@@ -944,7 +1390,7 @@ void command(int id, int fd, char *parameter)
             if(command != NULL) free(command);
             send_error(fd, 500, "could not allocate memory");
             LOG("could not allocate memory\n");
-            return;
+            return -1;
         }
         dest = MAX(MIN(strtol(svalue, NULL, 10), INT_MAX), INT_MIN);
         #ifdef DEBUG
@@ -970,7 +1416,7 @@ void command(int id, int fd, char *parameter)
             if(command != NULL) free(command);
             send_error(fd, 500, "could not allocate memory");
             LOG("could not allocate memory\n");
-            return;
+            return -1;
         }
         plugin_no = MAX(MIN(strtol(svalue, NULL, 10), INT_MAX), INT_MIN);
         DBG("The plugin number value converted value form string %s to integer %d\n", svalue, plugin_no);
@@ -1000,237 +1446,108 @@ void command(int id, int fd, char *parameter)
     }
 
     /* Send HTTP-response */
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: text/plain\r\n" \
-            STD_HEADER \
-            "\r\n" \
-            "%s: %d", command, res);
+    snprintf(buffer, sizeof(buffer), "%s: %d", command, res);
 
-    if(write(fd, buffer, strlen(buffer)) < 0) {
+    if((res = send_reply(fd, keep_alive, "text/plain", buffer, strlen(buffer))) < 0) {
         DBG("write failed, done anyway\n");
     }
 
     if(command != NULL) free(command);
     if(svalue != NULL) free(svalue);
+
+    return res;
 }
 
 /******************************************************************************
-Description.: Serve a connected TCP-client. This thread function is called
-              for each connect of a HTTP client like a webbrowser. It determines
-              if it is a valid HTTP request and dispatches between the different
-              response options.
-Input Value.: arg is the filedescriptor and server-context of the connected TCP
-              socket. It must have been allocated so it is freeable by this
-              thread function.
-Return Value: always NULL
+Description.: checks if the query string of a request target contains a
+              parameter with exactly this name and value
+Input Value.: target is the request target, key and value are compared
+Return Value: 1 if the parameter is present, 0 otherwise
 ******************************************************************************/
-/* thread for clients that connected to this server */
-void *client_thread(void *arg)
+static int query_has(const char *target, const char *key, const char *value)
 {
-    int cnt;
+    const char *p = strchr(target, '?');
+    size_t klen = strlen(key), vlen = strlen(value), len;
+
+    while(p != NULL) {
+        p++;
+        len = strcspn(p, "&");
+        if(len == klen + 1 + vlen && strncmp(p, key, klen) == 0 &&
+           p[klen] == '=' && strncmp(p + klen + 1, value, vlen) == 0)
+            return 1;
+        p = (p[len] == '&') ? p + len : NULL;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: Read and answer a single request of a connected client. It
+              determines if it is a valid HTTP request and dispatches between
+              the different response options.
+Input Value.: pcfd is the connected client
+              iobuf keeps data the client sent ahead across requests
+              timeout is the number of seconds to wait for the request
+Return Value: 1 if the connection stays open for the next request
+              0 if the caller has to close the connection
+              -1 if the connection was handed over to an event worker
+              or a stream thread
+******************************************************************************/
+int handle_request(cfd *pcfd, iobuffer *iobuf, int timeout)
+{
+    cfd lcfd = *pcfd; /* local-connected-file-descriptor */
+    int i, len, admitted, rc = -1;
     char query_suffixed = 0;
     int input_number = 0;
-    char buffer[BUFFER_SIZE] = {0}, *pb = buffer;
-    iobuffer iobuf;
+    char *pb, *query;
     request req;
-    cfd lcfd; /* local-connected-file-descriptor */
 
-    /* we really need the fildescriptor and it must be freeable by us */
-    if(arg != NULL) {
-        memcpy(&lcfd, arg, sizeof(cfd));
-        free(arg);
-    } else
-        return NULL;
-
-    /* initializes the structures */
-    init_iobuffer(&iobuf);
     init_request(&req);
 
     /* What does the client want to receive? Read the request. */
-    memset(buffer, 0, sizeof(buffer));
-    if((cnt = _readline(lcfd.fd, &iobuf, buffer, sizeof(buffer) - 1, 5)) == -1) {
-        close(lcfd.fd);
-        return NULL;
+    if((len = read_request(lcfd.fd, iobuf, timeout, lcfd.pc->conf.header_timeout)) <= 0) {
+        if(len == 0)
+            send_error(lcfd.fd, 400, "Request header too large");
+        if(len == -2) {
+            DBG("client took too long to send the request\n");
+            __sync_fetch_and_add(&lcfd.pc->header_timeouts, 1);
+        }
+        return 0;
     }
 
-    req.query_string = NULL;
+    if(parse_request(iobuf->buffer, len, &req) < 0) {
+        DBG("HTTP request seems to be malformed\n");
+        send_error(lcfd.fd, 400, "Malformed HTTP request");
+        return 0;
+    }
 
     /* determine what to deliver */
-    if(strstr(buffer, "GET /?action=snapshot") != NULL) {
-        req.type = A_SNAPSHOT;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
-        }
-        #endif
-    #ifdef WXP_COMPAT
-    } else if((strstr(buffer, "GET /cam") != NULL) && (strstr(buffer, ".jpg") != NULL)) {
-        req.type = A_SNAPSHOT_WXP;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
-        }
-        #endif
-    #endif
-    } else if(strstr(buffer, "POST /stream") != NULL) {
-        req.type = A_STREAM;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
-        }
-        #endif
-    } else if(strstr(buffer, "GET /?action=stream") != NULL) {
-        req.type = A_STREAM;
-        query_suffixed = 255;
-        #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
-            req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
-            send_error(lcfd.fd, 403, "frame already sent");
-            query_suffixed = 0;
-        }
-        #endif
-    #ifdef WXP_COMPAT
-    } else if((strstr(buffer, "GET /cam") != NULL) && (strstr(buffer, ".mjpg") != NULL)) {
-        req.type = A_STREAM_WXP;
-        query_suffixed = 255;
+    for(i = 0; i < LENGTH_OF(routes); i++) {
+        if(strcmp(req.method, routes[i].method) == 0 &&
+           strncmp(req.target, routes[i].prefix, routes[i].prefix_len) == 0 &&
+           (routes[i].extension == NULL || strstr(req.target, routes[i].extension) != NULL))
+            break;
+    }
+
+    if(i < LENGTH_OF(routes)) {
+        req.type = routes[i].type;
+        query_suffixed = (routes[i].flags & ROUTE_INPUT) ? 255 : 0;
+
         #ifdef MANAGMENT
-        if (check_client_status(lcfd.client)) {
+        if((routes[i].flags & ROUTE_MANAGED) && check_client_status(&lcfd.addr)) {
             req.type = A_UNKNOWN;
-            lcfd.client->last_take_time.tv_sec += piggy_fine;
+            client_penalty(&lcfd.addr, piggy_fine);
             send_error(lcfd.fd, 403, "frame already sent");
             query_suffixed = 0;
         }
         #endif
-    #endif
-    } else if(strstr(buffer, "GET /?action=take") != NULL) {
-        int len;
-        req.type = A_TAKE;
-        query_suffixed = 255;
-
-        /* advance by the length of known string */
-        if((pb = strstr(buffer, "GET /?action=take")) == NULL) {
-            DBG("HTTP request seems to be malformed\n");
-            send_error(lcfd.fd, 400, "Malformed HTTP request");
-            close(lcfd.fd);
-            query_suffixed = 0;
-            return NULL;
-        }
-        pb += strlen("GET /?action=take"); // a pb points to thestring after the first & after command
-
-        /* only accept certain characters */
-        len = MIN(MAX(strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-=&1234567890%./"), 0), 100);
-        req.parameter = malloc(len + 1);
-        if(req.parameter == NULL) {
-            exit(EXIT_FAILURE);
-        }
-        memset(req.parameter, 0, len + 1);
-        strncpy(req.parameter, pb, len);
-
-        if(unescape(req.parameter) == -1) {
-            free(req.parameter);
-            send_error(lcfd.fd, 500, "could not properly unescape command parameter string");
-            LOG("could not properly unescape command parameter string\n");
-            close(lcfd.fd);
-            return NULL;
-        }
-    } else if((strstr(buffer, "GET /input") != NULL) && (strstr(buffer, ".json") != NULL)) {
-        req.type = A_INPUT_JSON;
-        query_suffixed = 255;
-    } else if((strstr(buffer, "GET /output") != NULL) && (strstr(buffer, ".json") != NULL)) {
-        req.type = A_OUTPUT_JSON;
-        query_suffixed = 255;
-    } else if(strstr(buffer, "GET /program.json") != NULL) {
-        req.type = A_PROGRAM_JSON;
-    #ifdef MANAGMENT
-    } else if(strstr(buffer, "GET /clients.json") != NULL) {
-        req.type = A_CLIENTS_JSON;
-    #endif
-    } else if(strstr(buffer, "GET /?action=command") != NULL) {
-        int len;
-        req.type = A_COMMAND;
-
-        /* advance by the length of known string */
-        if((pb = strstr(buffer, "GET /?action=command")) == NULL) {
-            DBG("HTTP request seems to be malformed\n");
-            send_error(lcfd.fd, 400, "Malformed HTTP request");
-            close(lcfd.fd);
-            return NULL;
-        }
-        pb += strlen("GET /?action=command"); // a pb points to thestring after the first & after command
-
-        /* only accept certain characters */
-        len = MIN(MAX(strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-=&1234567890%./"), 0), 100);
-
-        req.parameter = malloc(len + 1);
-        if(req.parameter == NULL) {
-            exit(EXIT_FAILURE);
-        }
-        memset(req.parameter, 0, len + 1);
-        strncpy(req.parameter, pb, len);
-
-        if(unescape(req.parameter) == -1) {
-            free(req.parameter);
-            send_error(lcfd.fd, 500, "could not properly unescape command parameter string");
-            LOG("could not properly unescape command parameter string\n");
-            close(lcfd.fd);
-            return NULL;
-        }
-
-        DBG("command parameter (len: %d): \"%s\"\n", len, req.parameter);
-    } else {
-        int len;
-
+    } else if(strcmp(req.method, "GET") == 0) {
         DBG("try to serve a file\n");
         req.type = A_FILE;
-
-        if((pb = strstr(buffer, "GET /")) == NULL) {
-            DBG("HTTP request seems to be malformed\n");
-            send_error(lcfd.fd, 400, "Malformed HTTP request");
-            close(lcfd.fd);
-            return NULL;
-        }
-
-        pb += strlen("GET /");
-        len = MIN(MAX(strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ._-1234567890"), 0), 100);
-        req.parameter = malloc(len + 1);
-        if(req.parameter == NULL) {
-            exit(EXIT_FAILURE);
-        }
-
-        memset(req.parameter, 0, len + 1);
-        strncpy(req.parameter, pb, len);
-
-        if (strstr(pb, ".cgi") != NULL) {
-            req.type = A_CGI;
-            pb = strchr(pb, '?');
-            if (pb != NULL) {
-                pb++; // skip the ?
-                len = strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ._-1234567890=&");
-                req.query_string = malloc(len + 1);
-                if (req.query_string == NULL)
-                    exit(EXIT_FAILURE);
-                strncpy(req.query_string, pb, len);
-            } else {
-                req.query_string = malloc(2);
-                if (req.query_string == NULL)
-                    exit(EXIT_FAILURE);
-                sprintf(req.query_string, " ");
-            }
-        }
-        DBG("parameter (len: %d): \"%s\"\n", len, req.parameter);
+    } else {
+        DBG("HTTP request seems to be malformed\n");
+        send_error(lcfd.fd, 400, "Malformed HTTP request");
+        return 0;
     }
 
     /*
@@ -1240,52 +1557,74 @@ void *client_thread(void *arg)
      * generated from the 0. input plugin
      */
     if(query_suffixed) {
-        char *sch = strchr(buffer, '_');
-        if(sch != NULL) {  // there is an _ in the url so the input number should be present
+        char *sch = strchr(req.target, '_');
+        if(sch != NULL && isdigit((unsigned char)sch[1])) {  // there is an _ in the url so the input number should be present
             DBG("Suffix character: %s\n", sch + 1); // FIXME if more than 10 input plugin is added
-            char numStr[3];
-            memset(numStr, 0, 3);
-            strncpy(numStr, sch + 1, 1);
-            input_number = atoi(numStr);
+            input_number = sch[1] - '0';
 
             if ((req.type == A_SNAPSHOT_WXP) || (req.type == A_STREAM_WXP)) { // webcamxp adds offset to the camera number
                 input_number--;
             }
         }
         DBG("plugin_no: %d\n", input_number);
+
+        /* clients may insist on a new frame instead of a cached one */
+        if(query_has(req.target, "fresh", "1"))
+            req.fresh = 1;
     }
 
-    /*
-     * parse the rest of the HTTP-request
-     * the end of the request-header is marked by a single, empty line with "\r\n"
-     */
-    do {
-        memset(buffer, 0, sizeof(buffer));
+    if(i < LENGTH_OF(routes) && (routes[i].flags & ROUTE_PARAMETER) && req.type != A_UNKNOWN) {
+        /* the parameter follows the known string, only accept certain characters */
+        pb = req.target + routes[i].prefix_len;
+        len = MIN(strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-=&1234567890%./"), 100);
+        pb[len] = '\0';
+        req.parameter = pb;
 
-        if((cnt = _readline(lcfd.fd, &iobuf, buffer, sizeof(buffer) - 1, 5)) == -1) {
-            free_request(&req);
-            close(lcfd.fd);
-            return NULL;
+        if(unescape(req.parameter) == -1) {
+            send_error(lcfd.fd, 500, "could not properly unescape command parameter string");
+            LOG("could not properly unescape command parameter string\n");
+            return 0;
         }
 
-        if(strcasestr(buffer, "User-Agent: ") != NULL) {
-            req.client = strdup(buffer + strlen("User-Agent: "));
-        } else if(strcasestr(buffer, "Authorization: Basic ") != NULL) {
-            req.credentials = strdup(buffer + strlen("Authorization: Basic "));
-            decodeBase64(req.credentials);
-            DBG("username:password: %s\n", req.credentials);
+        DBG("command parameter (len: %d): \"%s\"\n", len, req.parameter);
+    } else if(req.type == A_FILE) {
+        pb = req.target + 1;
+        query = strchr(pb, '?');
+
+        if (strstr(pb, ".cgi") != NULL) {
+            req.type = A_CGI;
+            if (query != NULL) {
+                query++; // skip the ?
+                query[strspn(query, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ._-1234567890=&")] = '\0';
+                req.query_string = query;
+            } else {
+                req.query_string = " ";
+            }
         }
 
-    } while(cnt > 2 && !(buffer[0] == '\r' && buffer[1] == '\n'));
+        len = MIN(strspn(pb, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ._-1234567890"), 100);
+        pb[len] = '\0';
+        req.parameter = pb;
+        DBG("parameter (len: %d): \"%s\"\n", len, req.parameter);
+    }
+
+    if(lcfd.pc->conf.keepalive <= 0)
+        req.keep_alive = 0;
+
+    /* a request worker waiting for the next request serves nobody else */
+    if(req.keep_alive && lcfd.pool != NULL && !pcfd->keepalive) {
+        if(pool_keepalive_begin(&lcfd) == 0)
+            pcfd->keepalive = 1;
+        else
+            req.keep_alive = 0;
+    }
 
     /* check for username and password if parameter -c was given */
     if(lcfd.pc->conf.credentials != NULL) {
         if(req.credentials == NULL || strcmp(lcfd.pc->conf.credentials, req.credentials) != 0) {
             DBG("access denied\n");
             send_error(lcfd.fd, 401, "username and password do not match to configuration");
-            close(lcfd.fd);
-            free_request(&req);
-            return NULL;
+            return 0;
         }
         DBG("access granted\n");
     }
@@ -1311,16 +1650,48 @@ void *client_thread(void *arg)
     case A_SNAPSHOT_WXP:
     case A_SNAPSHOT:
         DBG("Request for snapshot from input: %d\n", input_number);
-        send_snapshot(&lcfd, input_number);
+        /* persistent connections stay with this thread for the next request */
+        if(lcfd.pc->worker_count > 0 && !req.keep_alive &&
+           events_add_client(&lcfd, A_SNAPSHOT, input_number, req.fresh) == 0) {
+            /* the connection belongs to an event worker now */
+            return -1;
+        }
+        rc = send_snapshot(&lcfd, input_number, req.fresh, req.keep_alive);
         break;
     case A_STREAM:
         DBG("Request for stream from input: %d\n", input_number);
-        send_stream(&lcfd, input_number);
+        if((admitted = stream_client_add(&lcfd, input_number)) < 0) {
+            if(admitted == -1)
+                send_error(lcfd.fd, 503, "Too many streams, try again later");
+            else
+                send_error(lcfd.fd, 500, "could not allocate memory");
+            break;
+        }
+        if(lcfd.pc->worker_count > 0 &&
+           events_add_client(&lcfd, A_STREAM, input_number, req.fresh) == 0) {
+            /* the connection belongs to an event worker now */
+            return -1;
+        }
+        /* keep the request workers free for short requests */
+        if(lcfd.pool != NULL &&
+           pool_add_stream(&lcfd, A_STREAM, input_number, req.fresh) == 0)
+            return -1;
+        send_stream(&lcfd, input_number, req.fresh);
         break;
     #ifdef WXP_COMPAT
     case A_STREAM_WXP:
         DBG("Request for WXP compat stream from input: %d\n", input_number);
-        send_stream_wxp(&lcfd, input_number);
+        if((admitted = stream_client_add(&lcfd, input_number)) < 0) {
+            if(admitted == -1)
+                send_error(lcfd.fd, 503, "Too many streams, try again later");
+            else
+                send_error(lcfd.fd, 500, "could not allocate memory");
+            break;
+        }
+        if(lcfd.pool != NULL &&
+           pool_add_stream(&lcfd, A_STREAM_WXP, input_number, req.fresh) == 0)
+            return -1;
+        send_stream_wxp(&lcfd, input_number, req.fresh);
         break;
     #endif
     case A_COMMAND:
@@ -1328,31 +1699,45 @@ void *client_thread(void *arg)
             send_error(lcfd.fd, 501, "this server is configured to not accept commands");
             break;
         }
-        command(lcfd.pc->id, lcfd.fd, req.parameter);
+        rc = command(lcfd.pc->id, lcfd.fd, req.parameter, req.keep_alive);
         break;
     case A_INPUT_JSON:
         DBG("Request for the Input plugin descriptor JSON file\n");
-        send_input_JSON(lcfd.fd, input_number);
+        rc = send_input_JSON(lcfd.fd, input_number, req.keep_alive);
         break;
     case A_OUTPUT_JSON:
         DBG("Request for the Output plugin descriptor JSON file\n");
-        send_output_JSON(lcfd.fd, input_number);
+        rc = send_output_JSON(lcfd.fd, input_number, req.keep_alive);
         break;
     case A_PROGRAM_JSON:
         DBG("Request for the program descriptor JSON file\n");
-        send_program_JSON(lcfd.fd);
+        rc = send_program_JSON(lcfd.fd, req.keep_alive);
+        break;
+    case A_STREAMS_JSON:
+        DBG("Request for the streams JSON file\n");
+        rc = send_streams_JSON(lcfd.pc, lcfd.fd, req.keep_alive);
+        break;
+    case A_METRICS:
+        DBG("Request for the metrics\n");
+        rc = send_metrics(lcfd.pc, lcfd.fd, req.keep_alive);
         break;
+    #ifdef LOCK_STATS
+    case A_LOCKS_JSON:
+        DBG("Request for the lock statistics JSON file\n");
+        rc = send_locks_JSON(lcfd.fd, req.keep_alive);
+        break;
+    #endif
     #ifdef MANAGMENT
     case A_CLIENTS_JSON:
         DBG("Request for the clients JSON file\n");
-        send_clients_JSON(lcfd.fd);
+        rc = send_clients_JSON(lcfd.fd, req.keep_alive);
         break;
     #endif
     case A_FILE:
         if(lcfd.pc->conf.www_folder == NULL)
             send_error(lcfd.fd, 501, "no www-folder configured");
         else
-            send_file(lcfd.pc->id, lcfd.fd, req.parameter);
+            rc = send_file(lcfd.pc->id, lcfd.fd, &req);
         break;
     /*
         With the take argument we try to save the current image to file before we transmit it to the user.
@@ -1396,7 +1781,7 @@ void *client_thread(void *arg)
             send_error(lcfd.fd, 404, "FILE output plugin not loaded, taking snapshot not possible");
         } else {
             if (ret == 0) {
-                send_snapshot(&lcfd, input_number);
+                rc = send_snapshot(&lcfd, input_number, req.fresh, req.keep_alive);
             } else {
                 send_error(lcfd.fd, 404, "Taking snapshot failed!");
             }
@@ -1410,8 +1795,58 @@ void *client_thread(void *arg)
         DBG("unknown request\n");
     }
 
-    close(lcfd.fd);
-    free_request(&req);
+    /* only complete answers of known length allow further requests */
+    return (rc == 0 && req.keep_alive) ? 1 : 0;
+}
+
+/******************************************************************************
+Description.: Serve a connected TCP-client. Requests are answered one after
+              the other as long as the client keeps the connection alive and
+              sends the next one within the idle timeout.
+Input Value.: context_fd is the connected client
+Return Value: -
+******************************************************************************/
+void serve_client(cfd *context_fd)
+{
+    int rc, timeout = 5;
+    iobuffer iobuf;
+
+    /* data the client sent ahead is kept for the following request */
+    init_iobuffer(&iobuf);
+
+    while((rc = handle_request(context_fd, &iobuf, timeout)) > 0) {
+        /* wait at most the idle timeout for the next request */
+        timeout = context_fd->pc->conf.keepalive;
+    }
+
+    if(rc == 0)
+        close(context_fd->fd);
+
+    if(context_fd->keepalive)
+        pool_keepalive_end(context_fd);
+}
+
+/******************************************************************************
+Description.: This thread function is called for each connect of a HTTP
+              client like a webbrowser if no request workers are used.
+Input Value.: arg is the filedescriptor and server-context of the connected TCP
+              socket. It must have been allocated so it is freeable by this
+              thread function.
+Return Value: always NULL
+******************************************************************************/
+/* thread for clients that connected to this server */
+void *client_thread(void *arg)
+{
+    cfd lcfd; /* local-connected-file-descriptor */
+
+    /* we really need the fildescriptor and it must be freeable by us */
+    if(arg != NULL) {
+        memcpy(&lcfd, arg, sizeof(cfd));
+        free(arg);
+    } else
+        return NULL;
+
+    serve_client(&lcfd);
 
     DBG("leaving HTTP client thread\n");
     return NULL;
@@ -1429,132 +1864,158 @@ void server_cleanup(void *arg)
 
     OPRINT("cleaning up resources allocated by server thread #%02d\n", pcontext->id);
 
+    /* the other accept loops must not run into closed sockets */
+    for(i = 0; i < pcontext->acceptor_count; i++) {
+        pool_stop(&pcontext->acceptors[i]);
+        if(pcontext->acceptors[i].running) {
+            pthread_cancel(pcontext->acceptors[i].thread);
+            pthread_join(pcontext->acceptors[i].thread, NULL);
+        }
+    }
+
     for(i = 0; i < MAX_SD_LEN; i++)
         close(pcontext->sd[i]);
 }
 
 /******************************************************************************
-Description.: Open a TCP socket and wait for clients to connect. If clients
-              connect, start a new thread for each accepted connection.
-Input Value.: arg is a pointer to the globals struct
-Return Value: always NULL, will only return on exit
+Description.: format the address of a client, this is only done when needed
+              and not for every accepted connection
+Input Value.: context_fd is the client, buffer and size receive the address
+Return Value: buffer
 ******************************************************************************/
-void *server_thread(void *arg)
+char *cfd_address(cfd *context_fd, char *buffer, int size)
 {
-    int on;
-    pthread_t client;
-    struct addrinfo *aip, *aip2;
-    struct addrinfo hints;
-    struct sockaddr_storage client_addr;
-    socklen_t addr_len = sizeof(struct sockaddr_storage);
-    fd_set selectfds;
-    int max_fds = 0;
-    char name[NI_MAXHOST];
-    int err;
-    int i;
-
-    context *pcontext = arg;
-    pglobal = pcontext->pglobal;
-
-    /* set cleanup handler to cleanup resources */
-    pthread_cleanup_push(server_cleanup, pcontext);
-
-    bzero(&hints, sizeof(hints));
-    hints.ai_family = PF_UNSPEC;
-    hints.ai_flags = AI_PASSIVE;
-    hints.ai_socktype = SOCK_STREAM;
-
-    snprintf(name, sizeof(name), "%d", ntohs(pcontext->conf.port));
-    if((err = getaddrinfo(pcontext->conf.hostname, name, &hints, &aip)) != 0) {
-        perror(gai_strerror(err));
-        exit(EXIT_FAILURE);
-    }
-
-    for(i = 0; i < MAX_SD_LEN; i++)
-        pcontext->sd[i] = -1;
+    if(getnameinfo((struct sockaddr *)&context_fd->addr, context_fd->addr_len,
+                   buffer, size, NULL, 0, NI_NUMERICHOST) != 0)
+        snprintf(buffer, size, "unknown");
 
-    #ifdef MANAGMENT
-    if (pthread_mutex_init(&client_infos.mutex, NULL)) {
-        perror("Mutex initialization failed");
-        exit(EXIT_FAILURE);
-    }
+    return buffer;
+}
 
-    client_infos.client_count = 0;
-    client_infos.infos = NULL;
-    #endif
+/******************************************************************************
+Description.: Open the listening sockets of an accept loop, one per address
+              family. They are appended to pc->sd[].
+Input Value.: pc is the server context
+              aip lists the addresses to listen on
+              reuseport lets the sockets of several accept loops share the port
+Return Value: number of sockets opened
+******************************************************************************/
+static int open_listeners(context *pc, struct addrinfo *aip, int reuseport)
+{
+    struct addrinfo *aip2;
+    int on, sd, opened = 0;
 
-    /* open sockets for server (1 socket / address family) */
-    i = 0;
     for(aip2 = aip; aip2 != NULL; aip2 = aip2->ai_next) {
-        if((pcontext->sd[i] = socket(aip2->ai_family, aip2->ai_socktype, 0)) < 0) {
+        if(pc->sd_len >= MAX_SD_LEN) {
+            OPRINT("%s(): maximum number of server sockets exceeded\n", __FUNCTION__);
+            break;
+        }
+
+        if((sd = socket(aip2->ai_family, aip2->ai_socktype, 0)) < 0) {
             continue;
         }
 
         /* ignore "socket already in use" errors */
         on = 1;
-        if(setsockopt(pcontext->sd[i], SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+        if(setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
             perror("setsockopt(SO_REUSEADDR) failed\n");
         }
 
+        /* the kernel spreads the connections over all sockets of the port */
+        on = 1;
+        if(reuseport && setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            perror("setsockopt(SO_REUSEPORT) failed\n");
+        }
+
         /* IPv6 socket should listen to IPv6 only, otherwise we will get "socket already in use" */
         on = 1;
-        if(aip2->ai_family == AF_INET6 && setsockopt(pcontext->sd[i], IPPROTO_IPV6, IPV6_V6ONLY,
+        if(aip2->ai_family == AF_INET6 && setsockopt(sd, IPPROTO_IPV6, IPV6_V6ONLY,
                 (const void *)&on , sizeof(on)) < 0) {
             perror("setsockopt(IPV6_V6ONLY) failed\n");
         }
 
-        /* perhaps we will use this keep-alive feature oneday */
-        /* setsockopt(sd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)); */
-
-        if(bind(pcontext->sd[i], aip2->ai_addr, aip2->ai_addrlen) < 0) {
+        if(bind(sd, aip2->ai_addr, aip2->ai_addrlen) < 0) {
             perror("bind");
-            pcontext->sd[i] = -1;
+            close(sd);
             continue;
         }
 
-        if(listen(pcontext->sd[i], 10) < 0) {
+        if(listen(sd, pc->conf.backlog) < 0) {
             perror("listen");
-            pcontext->sd[i] = -1;
-        } else {
-            i++;
-            if(i >= MAX_SD_LEN) {
-                OPRINT("%s(): maximum number of server sockets exceeded", __FUNCTION__);
-                i--;
-                break;
-            }
+            close(sd);
+            continue;
         }
+
+        pc->sd[pc->sd_len++] = sd;
+        opened++;
     }
 
-    pcontext->sd_len = i;
+    return opened;
+}
 
-    if(pcontext->sd_len < 1) {
-        OPRINT("%s(): bind(%d) failed\n", __FUNCTION__, htons(pcontext->conf.port));
-        closelog();
-        exit(EXIT_FAILURE);
+/******************************************************************************
+Description.: Refuse a connection right after accept() with a static 503 if
+              all request workers are busy, no thread gets involved. The
+              stream limits are checked by stream_client_add() once the
+              request is known, only streams are refused for them.
+Input Value.: context_fd is the accepted connection, it gets closed
+Return Value: -
+******************************************************************************/
+static void accept_reject(cfd *context_fd)
+{
+    char buffer[256];
+
+    metric_add(context_fd->pc->rejected_queue, 1);
+    DBG("connection refused right after accept\n");
+
+    /* the socket buffer of a new connection is empty, this does not block */
+    if(send(context_fd->fd, BUSY_ANSWER, strlen(BUSY_ANSWER), MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+        DBG("could not send the busy answer\n");
+
+    /* an unread request would turn close() into a reset that loses the answer */
+    shutdown(context_fd->fd, SHUT_WR);
+    while(recv(context_fd->fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0);
+    close(context_fd->fd);
+}
+
+/******************************************************************************
+Description.: Wait for clients to connect to the sockets of an accept loop
+              and pass each connection on to a request worker or a new thread.
+Input Value.: acc is the accept loop
+Return Value: -
+******************************************************************************/
+static void accept_loop(acceptor *acc)
+{
+    context *pcontext = acc->pc;
+    pthread_t client;
+    fd_set selectfds;
+    int max_fds = 0;
+    int err;
+    int i;
+
+    if(acc->cpu >= 0) {
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(acc->cpu, &cpus);
+        if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+            DBG("could not pin the accept loop to core %d\n", acc->cpu);
     }
 
     /* create a child for every client that connects */
     while(!pglobal->stop) {
-        //int *pfd = (int *)malloc(sizeof(int));
-        cfd *pcfd = malloc(sizeof(cfd));
-
-        if(pcfd == NULL) {
-            fprintf(stderr, "failed to allocate (a very small amount of) memory\n");
-            exit(EXIT_FAILURE);
-        }
+        cfd lcfd, *pcfd;
 
         DBG("waiting for clients to connect\n");
 
         do {
             FD_ZERO(&selectfds);
 
-            for(i = 0; i < MAX_SD_LEN; i++) {
-                if(pcontext->sd[i] != -1) {
-                    FD_SET(pcontext->sd[i], &selectfds);
+            for(i = acc->first; i < acc->first + acc->count; i++) {
+                FD_SET(pcontext->sd[i], &selectfds);
 
-                    if(pcontext->sd[i] > max_fds)
-                        max_fds = pcontext->sd[i];
-                }
+                if(pcontext->sd[i] > max_fds)
+                    max_fds = pcontext->sd[i];
             }
 
             err = select(max_fds + 1, &selectfds, NULL, NULL, NULL);
@@ -1565,32 +2026,183 @@ void *server_thread(void *arg)
             }
         } while(err <= 0);
 
-        for(i = 0; i < max_fds + 1; i++) {
-            if(pcontext->sd[i] != -1 && FD_ISSET(pcontext->sd[i], &selectfds)) {
-                pcfd->fd = accept(pcontext->sd[i], (struct sockaddr *)&client_addr, &addr_len);
-                pcfd->pc = pcontext;
+        for(i = acc->first; i < acc->first + acc->count; i++) {
+            if(FD_ISSET(pcontext->sd[i], &selectfds)) {
+                lcfd.addr_len = sizeof(lcfd.addr);
+                if((lcfd.fd = accept(pcontext->sd[i], (struct sockaddr *)&lcfd.addr, &lcfd.addr_len)) < 0)
+                    continue;
+                lcfd.pc = pcontext;
+                lcfd.stream = NULL;
+                lcfd.pool = acc->pool;
+                lcfd.keepalive = 0;
+
+                /* a stalled client must not keep its frame forever, see events.c for event mode */
+                if(pcontext->conf.send_timeout > 0) {
+                    struct timeval tv = {pcontext->conf.send_timeout, 0};
+                    setsockopt(lcfd.fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+                }
 
                 /* start new thread that will handle this TCP connected client */
                 DBG("create thread to handle client that just established a connection\n");
 
-                if(getnameinfo((struct sockaddr *)&client_addr, addr_len, name, sizeof(name), NULL, 0, NI_NUMERICHOST) == 0) {
-                    DBG("serving client: %s\n", name);
+                if(acc->pool != NULL) {
+                    if(pool_add_client(&lcfd) != 0) {
+                        DBG("all request workers are busy\n");
+                        accept_reject(&lcfd);
+                    }
+                    continue;
                 }
 
-                #if defined(MANAGMENT)
-                pcfd->client = add_client(name);
-                #endif
+                /* the thread frees its copy */
+                if((pcfd = malloc(sizeof(cfd))) == NULL) {
+                    fprintf(stderr, "failed to allocate (a very small amount of) memory\n");
+                    exit(EXIT_FAILURE);
+                }
+                *pcfd = lcfd;
 
-                if(pthread_create(&client, NULL, &client_thread, pcfd) != 0) {
+                if(pthread_create(&client, &pcontext->thread_attr, &client_thread, pcfd) != 0) {
                     DBG("could not launch another client thread\n");
                     close(pcfd->fd);
                     free(pcfd);
                     continue;
                 }
-                pthread_detach(client);
             }
         }
     }
+}
+
+/******************************************************************************
+Description.: thread of an additional accept loop
+Input Value.: arg is the accept loop
+Return Value: always NULL
+******************************************************************************/
+static void *acceptor_thread(void *arg)
+{
+    accept_loop(arg);
+    return NULL;
+}
+
+/******************************************************************************
+Description.: Open a TCP socket and wait for clients to connect. If clients
+              connect, start a new thread for each accepted connection or
+              queue it for the request workers. Further accept loops run in
+              threads of their own if configured.
+Input Value.: arg is a pointer to the globals struct
+Return Value: always NULL, will only return on exit
+******************************************************************************/
+void *server_thread(void *arg)
+{
+    struct addrinfo *aip;
+    struct addrinfo hints;
+    acceptor *acc;
+    char name[NI_MAXHOST];
+    int err;
+    int i, cpus, workers;
+
+    context *pcontext = arg;
+    pglobal = pcontext->pglobal;
+
+    /* set cleanup handler to cleanup resources */
+    pthread_cleanup_push(server_cleanup, pcontext);
+
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = PF_UNSPEC;
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_socktype = SOCK_STREAM;
+
+    snprintf(name, sizeof(name), "%d", ntohs(pcontext->conf.port));
+    if((err = getaddrinfo(pcontext->conf.hostname, name, &hints, &aip)) != 0) {
+        perror(gai_strerror(err));
+        exit(EXIT_FAILURE);
+    }
+
+    for(i = 0; i < MAX_SD_LEN; i++)
+        pcontext->sd[i] = -1;
+
+    pcontext->streams = NULL;
+    pcontext->stream_count = 0;
+    pcontext->streams_rejected = 0;
+    pcontext->header_timeouts = 0;
+    for(i = 0; i < pglobal->incnt; i++) {
+        pcontext->frames_sent[i] = metric_counter("mjpg_http_frames_sent_total",
+            "Frames sent completely to HTTP clients", "port=\"%d\",input=\"%d\"", ntohs(pcontext->conf.port), i);
+        pcontext->frames_dropped[i] = metric_counter("mjpg_http_frames_dropped_total",
+            "Frames skipped for stream clients that were still busy", "port=\"%d\",input=\"%d\"", ntohs(pcontext->conf.port), i);
+        pcontext->bytes_sent[i] = metric_counter("mjpg_http_bytes_sent_total",
+            "Bytes of frames sent to HTTP clients", "port=\"%d\",input=\"%d\"", ntohs(pcontext->conf.port), i);
+        pcontext->latency[i] = metric_histogram("mjpg_http_frame_latency_seconds",
+            "Time from publishing a frame until it was sent to a client", "port=\"%d\",input=\"%d\"", ntohs(pcontext->conf.port), i);
+    }
+    pcontext->send_errors = metric_counter("mjpg_http_send_errors_total",
+        "Frames that could not be sent because the connection failed", "port=\"%d\"", ntohs(pcontext->conf.port));
+    pcontext->send_timeouts = metric_counter("mjpg_http_send_timeouts_total",
+        "Clients closed because they accepted no data", "port=\"%d\"", ntohs(pcontext->conf.port));
+    pcontext->rejected_queue = metric_counter("mjpg_http_connections_rejected_total",
+        "Connections answered with 503 because all request workers were busy", "port=\"%d\"", ntohs(pcontext->conf.port));
+    if(pthread_mutex_init(&pcontext->streams_mutex, NULL) ||
+       pthread_mutex_init(&pcontext->parts_mutex, NULL)) {
+        perror("Mutex initialization failed");
+        exit(EXIT_FAILURE);
+    }
+
+    /* client threads need little stack, keep floods of them cheap */
+    pthread_attr_init(&pcontext->thread_attr);
+    pthread_attr_setdetachstate(&pcontext->thread_attr, PTHREAD_CREATE_DETACHED);
+    if(pcontext->conf.stack_size > 0 &&
+       pthread_attr_setstacksize(&pcontext->thread_attr,
+                                 MAX(pcontext->conf.stack_size * 1024, PTHREAD_STACK_MIN)) != 0) {
+        OPRINT("%s(): invalid stack size, using the default\n", __FUNCTION__);
+    }
+
+    /* open sockets for server (1 socket / address family and accept loop) */
+    pcontext->sd_len = 0;
+    pcontext->acceptor_count = 0;
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for(i = 0; i < MIN(MAX(pcontext->conf.acceptors, 1), MAX_ACCEPTORS); i++) {
+        acc = &pcontext->acceptors[i];
+        acc->pc = pcontext;
+        acc->running = 0;
+        acc->first = pcontext->sd_len;
+        acc->count = open_listeners(pcontext, aip, pcontext->conf.acceptors > 1);
+        acc->cpu = (pcontext->conf.acceptors > 1 && cpus > 0) ? i % cpus : -1;
+        acc->pool = NULL;
+
+        if(acc->count < 1)
+            break;
+        pcontext->acceptor_count++;
+    }
+    freeaddrinfo(aip);
+
+    if(pcontext->acceptor_count < 1) {
+        OPRINT("%s(): bind(%d) failed\n", __FUNCTION__, htons(pcontext->conf.port));
+        closelog();
+        exit(EXIT_FAILURE);
+    }
+
+    /* streams and snapshots are served by epoll workers if configured */
+    if(pcontext->conf.event_workers > 0 && events_start(pcontext) != 0) {
+        OPRINT("%s(): could not start event workers, using one thread per client\n", __FUNCTION__);
+    }
+
+    /* other requests are served by a fixed number of workers if configured,
+       they are shared out among the accept loops and run on the same core */
+    for(i = 0; pcontext->conf.threads > 0 && i < pcontext->acceptor_count; i++) {
+        workers = pcontext->conf.threads / pcontext->acceptor_count +
+                  (i < pcontext->conf.threads % pcontext->acceptor_count);
+        if(pool_start(&pcontext->acceptors[i], MAX(workers, 1)) != 0)
+            OPRINT("%s(): could not start request workers of accept loop %d, using one thread per client\n", __FUNCTION__, i);
+    }
+
+    /* every accept loop but the first gets a thread of its own */
+    for(i = 1; i < pcontext->acceptor_count; i++) {
+        acc = &pcontext->acceptors[i];
+        if(pthread_create(&acc->thread, NULL, acceptor_thread, acc) == 0)
+            acc->running = 1;
+        else
+            OPRINT("%s(): could not start accept loop %d\n", __FUNCTION__, i);
+    }
+
+    accept_loop(&pcontext->acceptors[0]);
 
     DBG("leaving server thread, calling cleanup function now\n");
     pthread_cleanup_pop(1);
@@ -1602,16 +2214,13 @@ void *server_thread(void *arg)
 Description.: Send a JSON file which is contains information about the input plugin's
               acceptable parameters
 Input Value.: fildescriptor fd to send the answer to
-Return Value: -
+              keep_alive announces that the connection stays open
+Return Value: 0 if the answer was sent, -1 otherwise
 ******************************************************************************/
-void send_input_JSON(int fd, int input_number)
+int send_input_JSON(int fd, int input_number, int keep_alive)
 {
     char buffer[BUFFER_SIZE*16] = {0}; // FIXME do reallocation if the buffer size is small
     int i;
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", "application/x-javascript");
 
     DBG("Serving the input plugin %d descriptor JSON file\n", input_number);
 
@@ -1634,7 +2243,7 @@ void send_input_JSON(int fd, int input_number)
                         tempName = (char*)calloc(itemLength + 1, sizeof(char));  // allocate space for the sanity checking
                         if (tempName == NULL) {
                             DBG("Realloc/calloc failed: %s\n", strerror(errno));
-                            return;
+                            return -1;
                         }
 
                         check_JSON_string((char*)&pglobal->in[input_number].in_parameters[i].menuitems[j].name, tempName); // sanity check the string after non printable characters
@@ -1649,7 +2258,7 @@ void send_input_JSON(int fd, int input_number)
 
                         if (menuString == NULL) {
                             DBG("Realloc/calloc failed: %s\n", strerror(errno));
-                            return;
+                            return -1;
                         }
                         prevSize = strlen(menuString);
 
@@ -1715,6 +2324,16 @@ void send_input_JSON(int fd, int input_number)
             "\n],\n"
             /*"},\n"*/);
 
+    /* inputs may stop publishing while nobody waits for frames */
+    sprintf(buffer + strlen(buffer),
+            "\"capture\": {\n"
+            "\"state\": \"%s\",\n"
+            "\"consumers\": %d\n"
+            "},\n",
+            (pglobal->in[input_number].capture == CAPTURE_SUSPENDED) ? "suspended" :
+            (pglobal->in[input_number].capture == CAPTURE_IDLE) ? "idle" : "active",
+            input_consumers(&pglobal->in[input_number]));
+
     sprintf(buffer + strlen(buffer),
             //"{\n"
             "\"formats\": [\n");
@@ -1742,7 +2361,7 @@ void send_input_JSON(int fd, int input_number)
                         resolutionsString = realloc(resolutionsString, resolutionsStringLength * sizeof(char*));
                     if (resolutionsString == NULL) {
                         DBG("Realloc/calloc failed\n");
-                        return;
+                        return -1;
                     }
 
                     sprintf(resolutionsString + strlen(resolutionsString),
@@ -1758,7 +2377,7 @@ void send_input_JSON(int fd, int input_number)
                         resolutionsString = realloc(resolutionsString, resolutionsStringLength * sizeof(char*));
                     if (resolutionsString == NULL) {
                         DBG("Realloc/calloc failed\n");
-                        return;
+                        return -1;
                     }
                     sprintf(resolutionsString + strlen(resolutionsString),
                             "\"%d\": \"%dx%d\"",
@@ -1814,21 +2433,19 @@ void send_input_JSON(int fd, int input_number)
             "}\n");
     i = strlen(buffer);
 
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    if(write(fd, buffer, i) < 0) {
+    if(send_reply(fd, keep_alive, "application/x-javascript", buffer, i) < 0) {
         DBG("unable to serve the control JSON file\n");
+        return -1;
     }
+
+    return 0;
 }
 
 
-void send_program_JSON(int fd)
+int send_program_JSON(int fd, int keep_alive)
 {
     char buffer[BUFFER_SIZE*16] = {0}; // FIXME do reallocation if the buffer size is small
     int i, k;
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", "application/x-javascript");
 
     DBG("Serving the program descriptor JSON file\n");
 
@@ -1886,12 +2503,205 @@ void send_program_JSON(int fd)
             "]}\n");
     i = strlen(buffer);
 
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    if(write(fd, buffer, i) < 0) {
+    if(send_reply(fd, keep_alive, "application/x-javascript", buffer, i) < 0) {
         DBG("unable to serve the program JSON file\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: Send a JSON file listing the connected stream clients with the
+              number of frames they received and the number of frames that
+              were dropped because the client was still busy with an older one
+Input Value.: pc is the server context, fildescriptor fd to send the answer to
+              keep_alive announces that the connection stays open
+Return Value: 0 if the answer was sent, -1 otherwise
+******************************************************************************/
+int send_streams_JSON(context *pc, int fd, int keep_alive)
+{
+    char *buffer;
+    stream_client *sc;
+    struct timeval now;
+    int count = 0, len;
+
+    gettimeofday(&now, NULL);
+
+    pthread_mutex_lock(&pc->streams_mutex);
+    for(sc = pc->streams; sc != NULL; sc = sc->next)
+        count++;
+
+    /* every entry is far shorter than BUFFER_SIZE */
+    buffer = malloc((count + 1) * BUFFER_SIZE);
+    if(buffer == NULL) {
+        pthread_mutex_unlock(&pc->streams_mutex);
+        send_error(fd, 500, "not enough memory");
+        return -1;
     }
+
+    DBG("Serving the streams JSON file\n");
+
+    len = sprintf(buffer,
+                   "{\n"
+                   "\"current\": %d,\n"
+                   "\"max_streams\": %d,\n"
+                   "\"max_per_address\": %d,\n"
+                   "\"rejected\": %lu,\n"
+                   "\"header_timeouts\": %lu,\n"
+                   "\"streams\": [\n",
+                   pc->stream_count,
+                   pc->conf.max_streams,
+                   pc->conf.max_per_address,
+                   pc->streams_rejected,
+                   pc->header_timeouts);
+
+    for(sc = pc->streams; sc != NULL; sc = sc->next) {
+        len += sprintf(buffer + len,
+                       "{\n"
+                       "\"address\": \"%s\",\n"
+                       "\"input\": %d,\n"
+                       "\"duration\": %ld,\n"
+                       "\"sent\": %lu,\n"
+                       "\"dropped\": %lu,\n"
+                       "\"errors\": %lu\n"
+                       "}%s\n",
+                       sc->address,
+                       sc->input,
+                       (long)(now.tv_sec - sc->started.tv_sec),
+                       sc->sent,
+                       sc->dropped,
+                       sc->errors,
+                       (sc->next != NULL) ? "," : "");
+    }
+    pthread_mutex_unlock(&pc->streams_mutex);
+
+    len += sprintf(buffer + len, "]\n}\n");
+
+    if((len = send_reply(fd, keep_alive, "application/x-javascript", buffer, len)) < 0) {
+        DBG("unable to serve the streams JSON file\n");
+    }
+
+    free(buffer);
+    return len;
+}
+
+/******************************************************************************
+Description.: Send the metrics of the registry and of the connected stream
+              clients in the Prometheus text format
+Input Value.: pc is the server context, fildescriptor fd to send the answer to
+              keep_alive announces that the connection stays open
+Return Value: 0 if the answer was sent, -1 otherwise
+******************************************************************************/
+int send_metrics(context *pc, int fd, int keep_alive)
+{
+    static const char *families[][3] = {
+        { "mjpg_http_client_frames_sent_total", "counter", "Frames sent to the stream client" },
+        { "mjpg_http_client_frames_dropped_total", "counter", "Frames skipped for the stream client" },
+        { "mjpg_http_client_bytes_sent_total", "counter", "Bytes sent to the stream client" },
+        { "mjpg_http_client_send_errors_total", "counter", "Frames that could not be sent to the stream client" },
+        { "mjpg_http_client_queue_bytes", "gauge", "Bytes waiting in the send queue of the stream client" }
+    };
+    char *buffer = NULL;
+    size_t size = 0;
+    stream_client *sc;
+    FILE *out;
+    int i, queued, rc;
+
+    DBG("Serving the metrics\n");
+
+    if((out = open_memstream(&buffer, &size)) == NULL) {
+        send_error(fd, 500, "not enough memory");
+        return -1;
+    }
+
+    metrics_print(out);
+
+    fprintf(out, "# HELP mjpg_http_streams Stream clients connected\n"
+                 "# TYPE mjpg_http_streams gauge\n"
+                 "mjpg_http_streams{port=\"%d\"} %d\n"
+                 "# HELP mjpg_http_streams_rejected_total Streams refused for the limits\n"
+                 "# TYPE mjpg_http_streams_rejected_total counter\n"
+                 "mjpg_http_streams_rejected_total{port=\"%d\"} %lu\n"
+                 "# HELP mjpg_http_header_timeouts_total Requests dropped for taking too long\n"
+                 "# TYPE mjpg_http_header_timeouts_total counter\n"
+                 "mjpg_http_header_timeouts_total{port=\"%d\"} %lu\n",
+                 ntohs(pc->conf.port), pc->stream_count,
+                 ntohs(pc->conf.port), pc->streams_rejected,
+                 ntohs(pc->conf.port), pc->header_timeouts);
+
+    /* the clients come and go, so they are listed here instead of the registry */
+    pthread_mutex_lock(&pc->streams_mutex);
+    for(i = 0; i < LENGTH_OF(families); i++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n",
+                families[i][0], families[i][2], families[i][0], families[i][1]);
+        for(sc = pc->streams; sc != NULL; sc = sc->next) {
+            fprintf(out, "%s{port=\"%d\",input=\"%d\",client=\"%s\",client_port=\"%s\"} ",
+                    families[i][0], ntohs(pc->conf.port), sc->input, sc->address, sc->port);
+            switch(i) {
+            case 0: fprintf(out, "%lu\n", sc->sent); break;
+            case 1: fprintf(out, "%lu\n", sc->dropped); break;
+            case 2: fprintf(out, "%llu\n", sc->bytes); break;
+            case 3: fprintf(out, "%lu\n", sc->errors); break;
+            default:
+                if(ioctl(sc->fd, SIOCOUTQ, &queued) < 0)
+                    queued = 0;
+                fprintf(out, "%d\n", queued);
+            }
+        }
+    }
+    pthread_mutex_unlock(&pc->streams_mutex);
+
+    if(fclose(out) != 0) {
+        free(buffer);
+        send_error(fd, 500, "not enough memory");
+        return -1;
+    }
+
+    if((rc = send_reply(fd, keep_alive, "text/plain; version=0.0.4", buffer, size)) < 0) {
+        DBG("unable to serve the metrics\n");
+    }
+
+    free(buffer);
+    return rc;
 }
 
+#ifdef LOCK_STATS
+/******************************************************************************
+Description.: Send the statistics of the frame locks of all inputs
+Input Value.: fildescriptor fd to send the answer to
+              keep_alive announces that the connection stays open
+Return Value: 0 if the answer was sent, -1 otherwise
+******************************************************************************/
+int send_locks_JSON(int fd, int keep_alive)
+{
+    char *buffer = NULL;
+    size_t size = 0;
+    FILE *out;
+    int rc;
+
+    if((out = open_memstream(&buffer, &size)) == NULL) {
+        send_error(fd, 500, "not enough memory");
+        return -1;
+    }
+
+    lockstats_print(out, pglobal);
+
+    if(fclose(out) != 0) {
+        free(buffer);
+        send_error(fd, 500, "not enough memory");
+        return -1;
+    }
+
+    if((rc = send_reply(fd, keep_alive, "application/x-javascript", buffer, size)) < 0) {
+        DBG("unable to serve the lock statistics JSON file\n");
+    }
+
+    free(buffer);
+    return rc;
+}
+#endif
+
 /******************************************************************************
 Description.:   checks the source string for non printable characters and replaces them with space
                 the two arguments should be the same size allocated memory areas
@@ -1915,16 +2725,15 @@ void check_JSON_string(char *source, char *destination)
 Description.: Send a JSON file which is contains information about the output plugin's
               acceptable parameters
 Input Value.: fildescriptor fd to send the answer to
-Return Value: -
+              keep_alive announces that the connection stays open
+Return Value: 0 if the answer was sent, -1 otherwise
 ******************************************************************************/
-void send_output_JSON(int fd, int input_number)
+int send_output_JSON(int fd, int input_number, int keep_alive)
 {
     char buffer[BUFFER_SIZE*16] = {0}; // FIXME do reallocation if the buffer size is small
+    unsigned long dropped_lossless = 0, dropped_latest = 0;
+    output *out;
     int i;
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", "application/x-javascript");
 
     DBG("Serving the output plugin %d descriptor JSON file\n", input_number);
 
@@ -1948,7 +2757,7 @@ void send_output_JSON(int fd, int input_number)
 
                         if (menuString == NULL) {
                             DBG("Realloc/calloc failed: %s\n", strerror(errno));
-                            return;
+                            return -1;
                         }
 
                         if(j != pglobal->out[input_number].out_parameters[i].ctrl.maximum) {
@@ -2008,60 +2817,52 @@ void send_output_JSON(int fd, int input_number)
         DBG("The output plugin %d has no paramters\n", input_number);
     }
     sprintf(buffer + strlen(buffer),
-            "\n]\n"
+            "\n],\n"
             /*"},\n"*/);
 
+    /* how frames reach this output and what it lost, see dispatch.h */
+    out = &pglobal->out[input_number];
     sprintf(buffer + strlen(buffer),
-            "}\n");
-    i = strlen(buffer);
-
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    if(write(fd, buffer, i) < 0) {
-        DBG("unable to serve the control JSON file\n");
+            "\"delivery\": {\n"
+            "\"class\": \"%s\",\n"
+            "\"queue_size\": %d,\n"
+            "\"delivered\": %lu,\n"
+            "\"dropped\": %lu,\n"
+            "\"backpressure\": %lu\n"
+            "},\n",
+            delivery_name(out->delivery),
+            (out->delivery == DELIVERY_LOSSLESS) ? out->queue_size : 1,
+            (out->delivered != NULL) ? (unsigned long)out->delivered->value : 0,
+            (out->dropped != NULL) ? (unsigned long)out->dropped->value : 0,
+            (out->backpressure != NULL) ? (unsigned long)out->backpressure->value : 0);
+
+    /* frames dropped by all outputs, per delivery class */
+    for(i = 0; i < pglobal->outcnt; i++) {
+        if(pglobal->out[i].dropped == NULL)
+            continue;
+        if(pglobal->out[i].delivery == DELIVERY_LOSSLESS)
+            dropped_lossless += pglobal->out[i].dropped->value;
+        else
+            dropped_latest += pglobal->out[i].dropped->value;
     }
-}
-
-#ifdef MANAGMENT
-void send_clients_JSON(int fd)
-{
-    char buffer[BUFFER_SIZE*16] = {0}; // FIXME do reallocation if the buffer size is small
-    unsigned long i = 0 ;
-    sprintf(buffer, "HTTP/1.0 200 OK\r\n" \
-            "Content-type: %s\r\n" \
-            STD_HEADER \
-            "\r\n", "application/x-javascript");
-
-    DBG("Serving the clients JSON file\n");
-
     sprintf(buffer + strlen(buffer),
-            "{\n"
-            "\"clients\": [\n");
-
-    for (; i<client_infos.client_count; i++) {
-        sprintf(buffer + strlen(buffer),
-            "{\n"
-            "\"address\": \"%s\",\n"
-            "\"timestamp\": %ld\n"
+            "\"dropped\": {\n"
+            "\"lossless\": %lu,\n"
+            "\"latest\": %lu\n"
             "}\n",
-            client_infos.infos[i]->address,
-            (unsigned long)client_infos.infos[i]->last_take_time.tv_sec);
-
-        if(i != (client_infos.client_count - 1)) {
-            sprintf(buffer + strlen(buffer), ",\n");
-        }
-    }
+            dropped_lossless, dropped_latest);
 
     sprintf(buffer + strlen(buffer),
-            "]");
-
-    sprintf(buffer + strlen(buffer),
-            "\n}\n");
+            "}\n");
     i = strlen(buffer);
 
-    /* first transmit HTTP-header, afterwards transmit content of file */
-    if(write(fd, buffer, i) < 0) {
+    if(send_reply(fd, keep_alive, "application/x-javascript", buffer, i) < 0) {
         DBG("unable to serve the control JSON file\n");
+        return -1;
     }
+
+    return 0;
 }
-#endif
+
+
 
@@ -23,6 +23,12 @@
 #define IO_BUFFER 256
 #define BUFFER_SIZE 1024
 
+/* seconds after which clients rejected for overload may try again */
+#define RETRY_AFTER "10"
+
+/* the request line and all headers of a request must fit into this */
+#define REQUEST_BUFFER 4096
+
 /* the boundary is used for the M-JPEG stream, it separates the multipart stream of pictures */
 #define BOUNDARY "boundarydonotcross"
 
@@ -43,16 +49,66 @@
  * Many browser seem to ignore, or at least not always obey those headers
  * since i observed caching of files from time to time.
  */
-#define STD_HEADER "Connection: close\r\n" \
-    "Server: MJPG-Streamer/0.2\r\n" \
+#define STD_HEADER "Server: MJPG-Streamer/0.2\r\n" \
     "Cache-Control: no-store, no-cache, must-revalidate, pre-check=0, post-check=0, max-age=0\r\n" \
     "Pragma: no-cache\r\n" \
     "Expires: Mon, 3 Jan 2000 12:34:56 GMT\r\n"
 
+/*
+ * Static files may be cached by the browser but have to be revalidated, an
+ * unchanged file then only costs a "304 Not Modified" answer. Files with a
+ * precompressed ".gz" sibling are answered depending on Accept-Encoding,
+ * their 200 and 304 answers carry VARY_HEADER in addition.
+ */
+#define FILE_HEADER "Server: MJPG-Streamer/0.2\r\n" \
+    "Cache-Control: no-cache\r\n"
+#define VARY_HEADER "Vary: Accept-Encoding\r\n"
+
+/* files up to this size are kept in memory, see filecache.c */
+#define FILE_CACHE_MAX_FILE (64*1024)
+
+/*
+ * Answers of known length keep the connection open if the client asked for
+ * it, everything else (streams, errors, CGI output) closes it afterwards.
+ */
+#define CONNECTION_CLOSE "Connection: close\r\n"
+#define CONNECTION_KEEP_ALIVE "Connection: keep-alive\r\n"
+#define CONNECTION_HEADER(keep_alive) ((keep_alive) ? CONNECTION_KEEP_ALIVE : CONNECTION_CLOSE)
+
+/*
+ * Response header of a M-JPEG stream, sent once before the first frame,
+ * and the boundary that follows each frame of the stream.
+ */
+#define STREAM_HEADER "HTTP/1.0 200 OK\r\n" \
+    "Access-Control-Allow-Origin: *\r\n" \
+    CONNECTION_CLOSE \
+    STD_HEADER \
+    "Content-Type: multipart/x-mixed-replace;boundary=" BOUNDARY "\r\n" \
+    "\r\n" \
+    "--" BOUNDARY "\r\n"
+#define STREAM_BOUNDARY "\r\n--" BOUNDARY "\r\n"
+
+/*
+ * Answer of the accept loop if all request workers are busy. It is sent
+ * before the request was read, so it cannot depend on it.
+ */
+#define BUSY_ANSWER "HTTP/1.0 503 Service Unavailable\r\n" \
+    "Content-type: text/plain\r\n" \
+    "Retry-After: " RETRY_AFTER "\r\n" \
+    CONNECTION_CLOSE \
+    STD_HEADER \
+    "\r\n" \
+    "503: Service Unavailable!\r\n" \
+    "Too many clients, try again later"
+
+/* entries of the vector of a stream part: header, the frame, boundary */
+#define STREAM_PART_IOV (FRAME_IOV_MAX + 2)
+
 /*
  * Maximum number of server sockets (i.e. protocol families) to listen.
  */
 #define MAX_SD_LEN 50
+#define MAX_ACCEPTORS 16
 
 /*
  * Only the following fileypes are supported.
@@ -94,27 +150,85 @@ typedef enum {
     A_INPUT_JSON,
     A_OUTPUT_JSON,
     A_PROGRAM_JSON,
+    A_STREAMS_JSON,
+    A_METRICS,
+    #ifdef LOCK_STATS
+    A_LOCKS_JSON,
+    #endif
     #ifdef MANAGMENT
     A_CLIENTS_JSON
     #endif
 } answer_t;
 
+/* properties of the routes */
+#define ROUTE_INPUT     1   /* the path may select the input with "_<number>" */
+#define ROUTE_MANAGED   2   /* subject to the client management */
+#define ROUTE_PARAMETER 4   /* the rest of the path is the parameter */
+
+#define ROUTE(method, prefix, extension, type, flags) \
+    { method, prefix, sizeof(prefix) - 1, extension, type, flags }
+
+/*
+ * requests are dispatched by method and the beginning of the path,
+ * everything else that is requested with GET is served from the www folder
+ */
+static const struct {
+    const char *method;
+    const char *prefix;
+    int prefix_len;
+    const char *extension;  /* must be part of the path too, NULL for any */
+    answer_t type;
+    int flags;
+} routes[] = {
+    ROUTE("GET",  "/?action=snapshot", NULL,    A_SNAPSHOT,     ROUTE_INPUT | ROUTE_MANAGED),
+    #ifdef WXP_COMPAT
+    ROUTE("GET",  "/cam",              ".jpg",  A_SNAPSHOT_WXP, ROUTE_INPUT | ROUTE_MANAGED),
+    #endif
+    ROUTE("POST", "/stream",           NULL,    A_STREAM,       ROUTE_INPUT | ROUTE_MANAGED),
+    ROUTE("GET",  "/?action=stream",   NULL,    A_STREAM,       ROUTE_INPUT | ROUTE_MANAGED),
+    #ifdef WXP_COMPAT
+    ROUTE("GET",  "/cam",              ".mjpg", A_STREAM_WXP,   ROUTE_INPUT | ROUTE_MANAGED),
+    #endif
+    ROUTE("GET",  "/?action=take",     NULL,    A_TAKE,         ROUTE_INPUT | ROUTE_PARAMETER),
+    ROUTE("GET",  "/input",            ".json", A_INPUT_JSON,   ROUTE_INPUT),
+    ROUTE("GET",  "/output",           ".json", A_OUTPUT_JSON,  ROUTE_INPUT),
+    ROUTE("GET",  "/program.json",     NULL,    A_PROGRAM_JSON, 0),
+    ROUTE("GET",  "/streams.json",     NULL,    A_STREAMS_JSON, 0),
+    ROUTE("GET",  "/metrics",          NULL,    A_METRICS,      0),
+    ROUTE("GET",  "/?action=metrics",  NULL,    A_METRICS,      0),
+    #ifdef LOCK_STATS
+    ROUTE("GET",  "/locks.json",       NULL,    A_LOCKS_JSON,   0),
+    #endif
+    #ifdef MANAGMENT
+    ROUTE("GET",  "/clients.json",     NULL,    A_CLIENTS_JSON, 0),
+    #endif
+    ROUTE("GET",  "/?action=command",  NULL,    A_COMMAND,      ROUTE_PARAMETER)
+};
+
 /*
  * the client sends information with each request
- * this structure is used to store the important parts
+ * this structure is used to store the important parts,
+ * the strings point into the iobuffer the request was read to
  */
 typedef struct {
     answer_t type;
+    char *method;
+    char *target;
     char *parameter;
     char *client;
     char *credentials;
     char *query_string;
+    char fresh;             /* client asked to wait for the next frame */
+    char keep_alive;        /* client wants to send further requests */
+    char accept_gzip;       /* client accepts gzip content encoding */
+    char *if_none_match;    /* ETags of the copies cached by the client */
 } request;
 
 /* the iobuffer structure is used to read from the HTTP-client */
 typedef struct {
-    int level;              /* how full is the buffer */
-    char buffer[IO_BUFFER]; /* the data */
+    int level;                   /* how full is the buffer */
+    int head;                    /* length of the request head in use */
+    char buffer[REQUEST_BUFFER]; /* the data */
 } iobuffer;
 
 /* store configuration for each server instance */
@@ -124,36 +238,142 @@ typedef struct {
     char *credentials;
     char *www_folder;
     char nocommands;
+    int max_age;            /* serve cached frames up to this age in ms, -1 waits for the next */
+    int event_workers;      /* number of epoll workers, 0 uses a thread per client */
+    int zerocopy;           /* send frames of at least this size with MSG_ZEROCOPY, 0 disables */
+    int keepalive;          /* seconds to wait for the next request, 0 closes after each one */
+    int threads;            /* number of request workers, 0 uses a thread per client */
+    int stack_size;         /* stack size of the client threads in KiB, 0 for the default */
+    int acceptors;          /* number of accept loops sharing the port with SO_REUSEPORT */
+    int backlog;            /* length of the listen queue */
+    int max_streams;        /* streams served at the same time, 0 for no limit */
+    int max_per_address;    /* streams per client address, 0 for no limit */
+    int header_timeout;     /* seconds a client may take to send the request head */
+    int send_timeout;       /* seconds a client may accept no data before it is closed, 0 never */
 } config;
 
-/* context of each server thread */
+/*
+ * statistics of a connected stream client, listed by /streams.json
+ * only the thread serving the client updates the counters
+ */
+typedef struct _stream_client stream_client;
+struct _stream_client {
+    char address[64];
+    char port[8];           /* of the client, tells connections of one address apart */
+    int fd;                 /* valid as long as the client is listed */
+    int input;
+    struct timeval started;
+    unsigned long sent;     /* frames sent completely */
+    unsigned long dropped;  /* frames replaced by newer ones before they were sent */
+    unsigned long long bytes;
+    unsigned long errors;   /* frames that could not be sent, the client is closed then */
+    stream_client *prev, *next;
+};
+
+/*
+ * The multipart chunk of a frame as it is sent to every stream client:
+ * part header, JPEG data and boundary. It is built once per frame and
+ * shared by all clients, each holds a reference while sending it.
+ */
+typedef struct _stream_part stream_part;
+struct _stream_part {
+    frame *f;
+    int refcount;
+    int head_len;
+    char head[128];
+};
+
+/*
+ * MSG_ZEROCOPY state of a stream connection, see zerocopy.c
+ * the kernel reads the data after sendmsg() returned, so every zero copy
+ * send keeps a reference to its part until the completion was received
+ */
+#define ZEROCOPY_PENDING 16
+typedef struct {
+    char enabled;
+    unsigned int next_id;   /* id the kernel assigns to the next zero copy send */
+    int first, count;
+    struct {
+        unsigned int id;
+        stream_part *part;
+    } pending[ZEROCOPY_PENDING];
+} zerocopy;
+
+/* a file of the www folder kept in memory, see filecache.c */
+typedef struct _file_entry file_entry;
+struct _file_entry {
+    char *path;
+    char *data;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    int refcount;
+    unsigned long used;     /* for evicting the least recently used entry */
+    file_entry *next;
+};
+
+/* an accept loop and the slice of the listening sockets it serves */
 typedef struct {
+    struct _context *pc;
+    pthread_t thread;
+    char running;           /* started as thread of its own */
+    int first, count;       /* sockets pc->sd[first] to pc->sd[first + count - 1] */
+    int cpu;                /* core the loop is pinned to, -1 for any */
+    struct _pool *pool;     /* request workers on the same core, see pool.c */
+} acceptor;
+
+/* context of each server thread */
+typedef struct _context {
     int sd[MAX_SD_LEN];
     int sd_len;
+    acceptor acceptors[MAX_ACCEPTORS];
+    int acceptor_count;
     int id;
     globals *pglobal;
     pthread_t threadID;
 
     config conf;
+
+    /* event mode, see events.c */
+    struct _event_worker *workers;
+    int worker_count;
+
+    pthread_attr_t thread_attr;     /* attributes of all client threads */
+
+    /* connected stream clients */
+    stream_client *streams;
+    int stream_count;
+    unsigned long streams_rejected;     /* streams refused for the limits */
+    unsigned long header_timeouts;      /* requests dropped for taking too long */
+    pthread_mutex_t streams_mutex;
+
+    /* exported with the registry of the core, see metrics.h */
+    metric *frames_sent[MAX_INPUT_PLUGINS];
+    metric *frames_dropped[MAX_INPUT_PLUGINS];
+    metric *bytes_sent[MAX_INPUT_PLUGINS];
+    metric *latency[MAX_INPUT_PLUGINS];     /* from publishing a frame until it was sent */
+    metric *send_errors;
+    metric *send_timeouts;                  /* clients closed for accepting no data */
+    metric *rejected_queue;                 /* connections refused because all request workers were busy */
+
+    /* multipart chunk of the newest frame of each input */
+    stream_part *parts[MAX_INPUT_PLUGINS];
+    pthread_mutex_t parts_mutex;
 } context;
 
 
 #if defined(MANAGMENT)
 /*
- * this struct is used to hold information from the clients address, and last picture take time
+ * this struct is used to hold information from the clients address, and last picture take time,
+ * see clients.c
  */
-typedef struct _client_info {
-    struct _client_info *next;
-    char *address;
+typedef struct _client_info client_info;
+struct _client_info {
+    client_info *next;
+    int family;
+    unsigned char ip[16];
     struct timeval last_take_time;
-} client_info;
-
-struct {
-    client_info **infos;
-    unsigned int client_count;
-    pthread_mutex_t mutex;
-} client_infos;
-
+};
 #endif
 
 /*
@@ -163,9 +383,11 @@ struct {
 typedef struct {
     context *pc;
     int fd;
-    #ifdef MANAGMENT
-    client_info *client;
-    #endif
+    struct sockaddr_storage addr;   /* formatted only when needed */
+    socklen_t addr_len;
+    stream_client *stream;          /* set once a stream was admitted */
+    struct _pool *pool;             /* request workers of the accept loop, NULL for a thread per client */
+    char keepalive;                 /* holds one of the keep-alive waits of the request workers */
 } cfd;
 
 
@@ -173,16 +395,66 @@ typedef struct {
 /* prototypes */
 void *server_thread(void *arg);
 void send_error(int fd, int which, char *message);
-void send_output_JSON(int fd, int plugin_number);
-void send_input_JSON(int fd, int plugin_number);
-void send_program_JSON(int fd);
+int send_reply(int fd, int keep_alive, const char *mimetype, const char *body, int length);
+int writev_all(int fd, struct iovec *iov, int count);
+int send_output_JSON(int fd, int plugin_number, int keep_alive);
+int send_input_JSON(int fd, int plugin_number, int keep_alive);
+int send_program_JSON(int fd, int keep_alive);
 void check_JSON_string(char *source, char *destination);
+int snapshot_header(char *buffer, int size, frame *f, int keep_alive);
+int stream_part_header(char *buffer, int size, frame *f);
+unsigned long stream_start_sequence(cfd *context_fd, input *in, int fresh);
+int stream_client_add(cfd *context_fd, int input_number);
+void stream_client_remove(context *pc, stream_client *sc);
+int send_streams_JSON(context *pc, int fd, int keep_alive);
+void stream_frame_sent(context *pc, stream_client *sc, int input_number, frame *f, size_t bytes,
+                       int fd, struct timespec *first);
+void stream_first_byte(struct timespec *first, int input_number, frame *f, int fd);
+void stream_frames_dropped(context *pc, stream_client *sc, int input_number, unsigned long skipped);
+int send_metrics(context *pc, int fd, int keep_alive);
+#ifdef LOCK_STATS
+int send_locks_JSON(int fd, int keep_alive);
+#endif
+stream_part *stream_part_get(context *pc, int input_number, frame *f);
+void stream_part_unref(stream_part *part);
+int stream_part_iov(stream_part *part, struct iovec *iov);
+void iov_advance(struct iovec *iov, int *first, int *count, size_t n);
+void serve_client(cfd *context_fd);
+char *cfd_address(cfd *context_fd, char *buffer, int size);
+void send_stream(cfd *context_fd, int input_number, int fresh);
+#ifdef WXP_COMPAT
+void send_stream_wxp(cfd *context_fd, int input_number, int fresh);
+#endif
+
+/* filecache.c */
+file_entry *filecache_get(const char *path, struct stat *st);
+file_entry *filecache_add(const char *path, int fd, struct stat *st);
+void filecache_put(file_entry *e);
+
+/* zerocopy.c */
+void zerocopy_init(zerocopy *zc, int fd, int enable);
+ssize_t zerocopy_send(zerocopy *zc, int fd, struct iovec *iov, int count, stream_part *part);
+int zerocopy_reap(zerocopy *zc, int fd);
+void zerocopy_cleanup(zerocopy *zc);
+
+/* pool.c */
+int pool_start(acceptor *acc, int threads);
+int pool_add_client(cfd *context_fd);
+int pool_add_stream(cfd *context_fd, answer_t type, int input_number, int fresh);
+int pool_keepalive_begin(cfd *context_fd);
+void pool_keepalive_end(cfd *context_fd);
+void pool_stop(acceptor *acc);
+
+/* events.c */
+int events_start(context *pc);
+int events_add_client(cfd *context_fd, answer_t type, int input_number, int fresh);
 
 #ifdef MANAGMENT
-client_info *add_client(char *address);
-int check_client_status(client_info *client);
-void update_client_timestamp(client_info *client);
-void send_clients_JSON(int fd);
+/* clients.c */
+int check_client_status(struct sockaddr_storage *addr);
+void update_client_timestamp(struct sockaddr_storage *addr);
+void client_penalty(struct sockaddr_storage *addr, int seconds);
+int send_clients_JSON(int fd, int keep_alive);
 #endif
 
 
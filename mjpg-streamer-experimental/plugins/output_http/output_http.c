@@ -27,6 +27,7 @@
 #include <errno.h>
 #include <signal.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -64,6 +65,37 @@ void help(void)
 	    " [-l ] --listen ]........: Listen on Hostname / IP\n" \
             " [-c | --credentials ]...: ask for \"username:password\" on connect\n" \
             " [-n | --nocommands ]....: disable execution of commands\n"
+            " [-m | --max_age ].......: answer snapshots and new streams from the\n" \
+            "                           last frame if it is at most this many ms\n" \
+            "                           old, -1 always waits for the next frame\n" \
+            " [-e | --events ]........: serve streams and snapshots from this many\n" \
+            "                           epoll worker threads instead of one thread\n" \
+            "                           per client, default 0\n"
+            " [-z | --zerocopy ]......: send frames of at least this many bytes\n" \
+            "                           with MSG_ZEROCOPY, default 0 (disabled)\n"
+            " [-k | --keepalive ].....: seconds to wait for the next request on a\n" \
+            "                           persistent connection, 0 closes the\n" \
+            "                           connection after each answer, default 5\n"
+            " [-t | --threads ].......: answer requests with this many worker\n" \
+            "                           threads started in advance, streams get a\n" \
+            "                           thread of their own, default 0 (one thread\n" \
+            "                           per client)\n"
+            " [-s | --stack ].........: stack size of the client threads in KiB,\n" \
+            "                           0 for the system default, default 256\n"
+            " [-a | --acceptors ].....: accept connections in this many threads,\n" \
+            "                           each with its own SO_REUSEPORT socket and\n" \
+            "                           pinned to a core together with its share\n" \
+            "                           of the request workers, default 1\n"
+            " [-b | --backlog ].......: length of the listen queue, default 10\n"
+            " [-x | --max_streams ]...: serve at most this many streams at once,\n" \
+            "                           further viewers get \"503 Service\n" \
+            "                           Unavailable\", default 0 (no limit)\n"
+            " [-y | --max_per_address ]: at most this many streams per client\n" \
+            "                           address, default 0 (no limit)\n"
+            " [-r | --header_timeout ]: seconds a client may take to send the\n" \
+            "                           request, default 5\n"
+            " [-d | --send_timeout ]..: close clients that accept no data for this\n" \
+            "                           many seconds, 0 never, default 10\n"
             " ---------------------------------------------------------------\n");
 }
 
@@ -83,6 +115,18 @@ int output_init(output_parameter *param, int id)
     int  port;
     char *credentials, *www_folder, *hostname = NULL;
     char nocommands;
+    int max_age;
+    int event_workers;
+    int zerocopy;
+    int keepalive;
+    int threads;
+    int stack_size;
+    int acceptors;
+    int backlog;
+    int max_streams;
+    int max_per_address;
+    int header_timeout;
+    int send_timeout;
 
     DBG("output #%02d\n", param->id);
 
@@ -90,6 +134,18 @@ int output_init(output_parameter *param, int id)
     credentials = NULL;
     www_folder = NULL;
     nocommands = 0;
+    max_age = -1;
+    event_workers = 0;
+    zerocopy = 0;
+    keepalive = 5;
+    threads = 0;
+    stack_size = 256;
+    acceptors = 1;
+    backlog = 10;
+    max_streams = 0;
+    max_per_address = 0;
+    header_timeout = 5;
+    send_timeout = 10;
 
     param->argv[0] = OUTPUT_PLUGIN_NAME;
 
@@ -115,6 +171,30 @@ int output_init(output_parameter *param, int id)
             {"www", required_argument, 0, 0},
             {"n", no_argument, 0, 0},
             {"nocommands", no_argument, 0, 0},
+            {"m", required_argument, 0, 0},
+            {"max_age", required_argument, 0, 0},
+            {"e", required_argument, 0, 0},
+            {"events", required_argument, 0, 0},
+            {"z", required_argument, 0, 0},
+            {"zerocopy", required_argument, 0, 0},
+            {"k", required_argument, 0, 0},
+            {"keepalive", required_argument, 0, 0},
+            {"t", required_argument, 0, 0},
+            {"threads", required_argument, 0, 0},
+            {"s", required_argument, 0, 0},
+            {"stack", required_argument, 0, 0},
+            {"a", required_argument, 0, 0},
+            {"acceptors", required_argument, 0, 0},
+            {"b", required_argument, 0, 0},
+            {"backlog", required_argument, 0, 0},
+            {"x", required_argument, 0, 0},
+            {"max_streams", required_argument, 0, 0},
+            {"y", required_argument, 0, 0},
+            {"max_per_address", required_argument, 0, 0},
+            {"r", required_argument, 0, 0},
+            {"header_timeout", required_argument, 0, 0},
+            {"d", required_argument, 0, 0},
+            {"send_timeout", required_argument, 0, 0},
             {0, 0, 0, 0}
         };
 
@@ -175,6 +255,90 @@ int output_init(output_parameter *param, int id)
             DBG("case 10,11\n");
             nocommands = 1;
             break;
+
+            /* m, max_age */
+        case 12:
+        case 13:
+            DBG("case 12,13\n");
+            max_age = atoi(optarg);
+            break;
+
+            /* e, events */
+        case 14:
+        case 15:
+            DBG("case 14,15\n");
+            event_workers = MAX(atoi(optarg), 0);
+            break;
+
+            /* z, zerocopy */
+        case 16:
+        case 17:
+            DBG("case 16,17\n");
+            zerocopy = MAX(atoi(optarg), 0);
+            break;
+
+            /* k, keepalive */
+        case 18:
+        case 19:
+            DBG("case 18,19\n");
+            keepalive = MAX(atoi(optarg), 0);
+            break;
+
+            /* t, threads */
+        case 20:
+        case 21:
+            DBG("case 20,21\n");
+            threads = MAX(atoi(optarg), 0);
+            break;
+
+            /* s, stack */
+        case 22:
+        case 23:
+            DBG("case 22,23\n");
+            stack_size = MAX(atoi(optarg), 0);
+            break;
+
+            /* a, acceptors */
+        case 24:
+        case 25:
+            DBG("case 24,25\n");
+            acceptors = MIN(MAX(atoi(optarg), 1), MAX_ACCEPTORS);
+            break;
+
+            /* b, backlog */
+        case 26:
+        case 27:
+            DBG("case 26,27\n");
+            backlog = MAX(atoi(optarg), 1);
+            break;
+
+            /* x, max_streams */
+        case 28:
+        case 29:
+            DBG("case 28,29\n");
+            max_streams = MAX(atoi(optarg), 0);
+            break;
+
+            /* y, max_per_address */
+        case 30:
+        case 31:
+            DBG("case 30,31\n");
+            max_per_address = MAX(atoi(optarg), 0);
+            break;
+
+            /* r, header_timeout */
+        case 32:
+        case 33:
+            DBG("case 32,33\n");
+            header_timeout = MAX(atoi(optarg), 1);
+            break;
+
+            /* d, send_timeout */
+        case 34:
+        case 35:
+            DBG("case 34,35\n");
+            send_timeout = MAX(atoi(optarg), 0);
+            break;
         }
     }
 
@@ -185,16 +349,43 @@ int output_init(output_parameter *param, int id)
     servers[param->id].conf.credentials = credentials;
     servers[param->id].conf.www_folder = www_folder;
     servers[param->id].conf.nocommands = nocommands;
+    servers[param->id].conf.max_age = max_age;
+    servers[param->id].conf.event_workers = event_workers;
+    servers[param->id].conf.zerocopy = zerocopy;
+    servers[param->id].conf.keepalive = keepalive;
+    servers[param->id].conf.threads = threads;
+    servers[param->id].conf.stack_size = stack_size;
+    servers[param->id].conf.acceptors = acceptors;
+    servers[param->id].conf.backlog = backlog;
+    servers[param->id].conf.max_streams = max_streams;
+    servers[param->id].conf.max_per_address = max_per_address;
+    servers[param->id].conf.header_timeout = header_timeout;
+    servers[param->id].conf.send_timeout = send_timeout;
 
     OPRINT("www-folder-path......: %s\n", (www_folder == NULL) ? "disabled" : www_folder);
     OPRINT("HTTP TCP port........: %d\n", ntohs(port));
     OPRINT("HTTP Listen Address..: %s\n", hostname);
     OPRINT("username:password....: %s\n", (credentials == NULL) ? "disabled" : credentials);
     OPRINT("commands.............: %s\n", (nocommands) ? "disabled" : "enabled");
+    OPRINT("cached frame max age.: %d ms%s\n", max_age, (max_age < 0) ? " (disabled)" : "");
+    OPRINT("event workers........: %d%s\n", event_workers, (event_workers == 0) ? " (thread per client)" : "");
+    OPRINT("zero copy from.......: %d bytes%s\n", zerocopy, (zerocopy == 0) ? " (disabled)" : "");
+    OPRINT("keep-alive timeout...: %d s%s\n", keepalive, (keepalive == 0) ? " (disabled)" : "");
+    OPRINT("request workers......: %d%s\n", threads, (threads == 0) ? " (thread per client)" : "");
+    OPRINT("client thread stack..: %d KiB%s\n", stack_size, (stack_size == 0) ? " (default)" : "");
+    OPRINT("accept loops.........: %d\n", acceptors);
+    OPRINT("listen backlog.......: %d\n", backlog);
+    OPRINT("max. streams.........: %d%s\n", max_streams, (max_streams == 0) ? " (no limit)" : "");
+    OPRINT("max. streams/address.: %d%s\n", max_per_address, (max_per_address == 0) ? " (no limit)" : "");
+    OPRINT("request head timeout.: %d s\n", header_timeout);
+    OPRINT("send timeout.........: %d s%s\n", send_timeout, (send_timeout == 0) ? " (disabled)" : "");
 
     param->global->out[id].name = malloc((strlen(OUTPUT_PLUGIN_NAME) + 1) * sizeof(char));
     sprintf(param->global->out[id].name, OUTPUT_PLUGIN_NAME);
 
+    /* streams and snapshots attach to their input while they wait */
+    param->global->out[id].attaches = 1;
+
     return 0;
 }
 
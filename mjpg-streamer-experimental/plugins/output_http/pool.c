@@ -0,0 +1,289 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+ * Pool of request workers
+ *
+ * Instead of creating a thread for every connection, the accept loop queues
+ * the connections for a fixed number of workers started in advance. The
+ * workers answer files, JSON, commands and snapshots. Streams last as long
+ * as the viewer watches, so a worker hands them over to a thread of their
+ * own and is free for the next request again. Without that a few viewers
+ * would occupy every worker and nobody else would get an answer.
+ *
+ * Each accept loop has workers of its own. With several accept loops they
+ * run on the core of their loop, so a connection stays on one core from
+ * accept() to the answer.
+ *
+ * A worker waiting for the next request of a persistent connection is just
+ * as unavailable, so at most half of the workers may do that. Beyond that
+ * answers announce "Connection: close" and the worker moves on.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "../../mjpg_streamer.h"
+#include "../../utils.h"
+#include "httpd.h"
+
+/* number of accepted connections that may wait for a worker */
+#define POOL_QUEUE 128
+
+struct _pool {
+    context *pc;
+    int cpu;                        /* core of the accept loop, -1 for any */
+    pthread_mutex_t mutex;
+    pthread_cond_t queued;
+    int first, count;
+    int keepalive, keepalive_max;   /* workers waiting on persistent connections */
+    cfd queue[POOL_QUEUE];
+};
+
+/* a stream handed over by a worker */
+typedef struct {
+    cfd context_fd;
+    answer_t type;
+    int input;
+    int fresh;
+} pool_stream;
+
+/******************************************************************************
+Description.: worker thread, serves the queued connections one after the other
+Input Value.: arg is the pool of the worker
+Return Value: always NULL
+******************************************************************************/
+static void *pool_worker(void *arg)
+{
+    struct _pool *pool = arg;
+    context *pc = pool->pc;
+    cfd lcfd;
+
+    if(pool->cpu >= 0) {
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(pool->cpu, &cpus);
+        if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+            DBG("could not pin the request worker to core %d\n", pool->cpu);
+    }
+
+    while(!pc->pglobal->stop) {
+        pthread_mutex_lock(&pool->mutex);
+        while(pool->count == 0 && !pc->pglobal->stop)
+            pthread_cond_wait(&pool->queued, &pool->mutex);
+
+        if(pc->pglobal->stop) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+
+        lcfd = pool->queue[pool->first];
+        pool->first = (pool->first + 1) % POOL_QUEUE;
+        pool->count--;
+        pthread_mutex_unlock(&pool->mutex);
+
+        serve_client(&lcfd);
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+Description.: thread that serves a single stream and closes the connection
+Input Value.: arg is the pool_stream, freed by this function
+Return Value: always NULL
+******************************************************************************/
+static void *pool_stream_thread(void *arg)
+{
+    pool_stream *ps = arg;
+
+    #ifdef WXP_COMPAT
+    if(ps->type == A_STREAM_WXP)
+        send_stream_wxp(&ps->context_fd, ps->input, ps->fresh);
+    else
+    #endif
+        send_stream(&ps->context_fd, ps->input, ps->fresh);
+
+    close(ps->context_fd.fd);
+    free(ps);
+
+    DBG("leaving HTTP stream thread\n");
+    return NULL;
+}
+
+/******************************************************************************
+Description.: start the workers of an accept loop
+Input Value.: acc is the accept loop, its core is used for the workers too
+              threads gives the number of workers
+Return Value: 0 if at least one worker runs, -1 otherwise
+******************************************************************************/
+int pool_start(acceptor *acc, int threads)
+{
+    context *pc = acc->pc;
+    struct _pool *pool;
+    pthread_t worker;
+    int i, started = 0;
+
+    if((pool = calloc(1, sizeof(struct _pool))) == NULL)
+        return -1;
+
+    if(pthread_mutex_init(&pool->mutex, NULL) || pthread_cond_init(&pool->queued, NULL)) {
+        free(pool);
+        return -1;
+    }
+
+    pool->pc = pc;
+    pool->cpu = acc->cpu;
+    pool->keepalive_max = threads / 2;
+    acc->pool = pool;
+
+    for(i = 0; i < threads; i++) {
+        if(pthread_create(&worker, &pc->thread_attr, pool_worker, pool) != 0) {
+            DBG("could not start request worker %d\n", i);
+            continue;
+        }
+        started++;
+    }
+
+    if(started == 0) {
+        acc->pool = NULL;
+        pthread_cond_destroy(&pool->queued);
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool);
+        return -1;
+    }
+
+    DBG("started %d request workers on core %d\n", started, acc->cpu);
+    return 0;
+}
+
+/******************************************************************************
+Description.: queue an accepted connection for the workers
+Input Value.: context_fd is the connection, it is copied
+Return Value: 0 if it was queued, -1 if the queue is full
+******************************************************************************/
+int pool_add_client(cfd *context_fd)
+{
+    struct _pool *pool = context_fd->pool;
+    int rc = -1;
+
+    pthread_mutex_lock(&pool->mutex);
+    if(pool->count < POOL_QUEUE) {
+        pool->queue[(pool->first + pool->count) % POOL_QUEUE] = *context_fd;
+        pool->count++;
+        pthread_cond_signal(&pool->queued);
+        rc = 0;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return rc;
+}
+
+/******************************************************************************
+Description.: hand a stream over to a thread of its own, so the worker can
+              take the next connection
+Input Value.: context_fd is the connection, it is copied
+              type is A_STREAM or A_STREAM_WXP
+              input_number and fresh are passed on to send_stream()
+Return Value: 0 if the stream thread took over the connection, -1 otherwise
+******************************************************************************/
+int pool_add_stream(cfd *context_fd, answer_t type, int input_number, int fresh)
+{
+    pool_stream *ps;
+    pthread_t thread;
+
+    if((ps = malloc(sizeof(pool_stream))) == NULL)
+        return -1;
+
+    ps->context_fd = *context_fd;
+    ps->type = type;
+    ps->input = input_number;
+    ps->fresh = fresh;
+
+    if(pthread_create(&thread, &context_fd->pc->thread_attr, pool_stream_thread, ps) != 0) {
+        DBG("could not launch a stream thread\n");
+        free(ps);
+        return -1;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+Description.: reserve a keep-alive wait, the worker may then wait for further
+              requests on its connection
+Input Value.: context_fd is the connection of the worker
+Return Value: 0 if the connection may stay open, -1 if it has to be closed
+******************************************************************************/
+int pool_keepalive_begin(cfd *context_fd)
+{
+    struct _pool *pool = context_fd->pool;
+    int rc = -1;
+
+    pthread_mutex_lock(&pool->mutex);
+    if(pool->keepalive < pool->keepalive_max) {
+        pool->keepalive++;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return rc;
+}
+
+/******************************************************************************
+Description.: give back a keep-alive wait reserved by pool_keepalive_begin()
+Input Value.: context_fd is the connection of the worker
+Return Value: -
+******************************************************************************/
+void pool_keepalive_end(cfd *context_fd)
+{
+    struct _pool *pool = context_fd->pool;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->keepalive--;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/******************************************************************************
+Description.: wake up the idle workers, so they notice the stop flag
+Input Value.: acc is the accept loop
+Return Value: -
+******************************************************************************/
+void pool_stop(acceptor *acc)
+{
+    struct _pool *pool = acc->pool;
+
+    if(pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->mutex);
+    pthread_cond_broadcast(&pool->queued);
+    pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,199 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+/*
+ * Zero copy transmission of large frames
+ *
+ * With MSG_ZEROCOPY the kernel pins the pages of the frame instead of
+ * copying them into the socket buffer and reports through the error queue
+ * of the socket once it does not need them anymore. Every zero copy send
+ * therefore keeps a reference to the stream part it sent until that
+ * completion was read. Pinning pages is only cheaper than copying for large
+ * frames, so this is opt-in and limited to frames above a threshold.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+#include "../../mjpg_streamer.h"
+#include "../../utils.h"
+#include "httpd.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+/******************************************************************************
+Description.: prepare a connection for zero copy sends
+Input Value.: zc is the state to initialize, fd the socket
+              enable selects whether zero copy should be tried at all
+Return Value: -
+******************************************************************************/
+void zerocopy_init(zerocopy *zc, int fd, int enable)
+{
+    int on = 1;
+
+    memset(zc, 0, sizeof(zerocopy));
+
+    if(enable && setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0)
+        zc->enabled = 1;
+}
+
+/******************************************************************************
+Description.: send data with sendmsg(), using MSG_ZEROCOPY if a part is given
+              and the connection supports it. Without a free pending slot or
+              when the kernel runs out of memory for pinned pages, the data
+              is copied as usual.
+Input Value.: zc is the state of the connection, fd the socket
+              iov and count describe the data
+              part is the stream part the data belongs to, NULL to copy
+Return Value: number of bytes sent, -1 on errors as for sendmsg()
+******************************************************************************/
+ssize_t zerocopy_send(zerocopy *zc, int fd, struct iovec *iov, int count, stream_part *part)
+{
+    struct msghdr msg;
+    ssize_t n;
+    int slot;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+
+    if(part != NULL && zc->enabled && zc->count < ZEROCOPY_PENDING) {
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_ZEROCOPY);
+        if(n >= 0) {
+            slot = (zc->first + zc->count) % ZEROCOPY_PENDING;
+            zc->pending[slot].id = zc->next_id++;
+            zc->pending[slot].part = part;
+            __sync_fetch_and_add(&part->refcount, 1);
+            zc->count++;
+            return n;
+        }
+
+        if(errno != ENOBUFS)
+            return -1;
+    }
+
+    return sendmsg(fd, &msg, MSG_NOSIGNAL);
+}
+
+/******************************************************************************
+Description.: read the completions from the error queue of the socket and
+              release the parts the kernel is done with
+Input Value.: zc is the state of the connection, fd the socket
+Return Value: number of completion notifications read, -1 on errors
+******************************************************************************/
+int zerocopy_reap(zerocopy *zc, int fd)
+{
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+    unsigned int lo, hi;
+    int i, slot, found = 0;
+
+    while(zc->count > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if(recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break;
+            return -1;
+        }
+
+        for(cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if(!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                 (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if(serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            /* the kernel had to copy anyway, pinning is pure overhead then */
+            if(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                zc->enabled = 0;
+
+            /* the notification covers the sends lo to hi */
+            lo = serr->ee_info;
+            hi = serr->ee_data;
+            for(i = 0; i < zc->count; i++) {
+                slot = (zc->first + i) % ZEROCOPY_PENDING;
+                if(zc->pending[slot].part != NULL &&
+                   zc->pending[slot].id - lo <= hi - lo) {
+                    stream_part_unref(zc->pending[slot].part);
+                    zc->pending[slot].part = NULL;
+                }
+            }
+            found++;
+        }
+
+        /* completions usually arrive in order, drop the finished head */
+        while(zc->count > 0 && zc->pending[zc->first].part == NULL) {
+            zc->first = (zc->first + 1) % ZEROCOPY_PENDING;
+            zc->count--;
+        }
+    }
+
+    return found;
+}
+
+/******************************************************************************
+Description.: release all parts of a connection that is about to be closed,
+              data the kernel did not send yet may be overwritten once the
+              frame is freed, which only affects the client that leaves
+Input Value.: zc is the state of the connection
+Return Value: -
+******************************************************************************/
+void zerocopy_cleanup(zerocopy *zc)
+{
+    int i, slot;
+
+    for(i = 0; i < zc->count; i++) {
+        slot = (zc->first + i) % ZEROCOPY_PENDING;
+        stream_part_unref(zc->pending[slot].part);
+    }
+    zc->count = 0;
+}
@@ -42,6 +42,7 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <getopt.h>
 #include <pthread.h>
 #include <fcntl.h>
@@ -57,9 +58,9 @@
 
 static pthread_t worker;
 static globals *pglobal;
-static int fd, delay, max_frame_size;
+static int fd, delay;
 static char *folder = "/tmp";
-static unsigned char *frame = NULL;
+static frame *current = NULL;
 static char *command = NULL;
 static int input_number = 0;
 
@@ -102,9 +103,8 @@ void worker_cleanup(void *arg)
     first_run = 0;
     OPRINT("cleaning up resources allocated by worker thread\n");
 
-    if(frame != NULL) {
-        free(frame);
-    }
+    frame_unref(current);
+    current = NULL;
     close(fd);
 }
 
@@ -116,9 +116,9 @@ Return Value:
 ******************************************************************************/
 void *worker_thread(void *arg)
 {
-    int ok = 1, frame_size = 0, rc = 0;
+    int ok = 1, rc = 0;
     char buffer1[1024] = {0};
-    unsigned char *tmp_framebuffer = NULL;
+    struct iovec iov[FRAME_IOV_MAX];
 
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
@@ -153,31 +153,15 @@ void *worker_thread(void *arg)
 
 
         DBG("waiting for fresh frame\n");
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
-
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
-
-        /* check if buffer for frame is large enough, increase it if necessary */
-        if(frame_size > max_frame_size) {
-            DBG("increasing buffer size to %d\n", frame_size);
-
-            max_frame_size = frame_size + (1 << 16);
-            if((tmp_framebuffer = realloc(frame, max_frame_size)) == NULL) {
-                pthread_mutex_unlock(&pglobal->in[input_number].db);
-                LOG("not enough memory\n");
-                return NULL;
-            }
-
-            frame = tmp_framebuffer;
-        }
+        /* drop the previous frame and take a reference to the fresh one */
+        frame_unref(current);
+        current = NULL;
 
-        /* copy frame to our local buffer now */
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
+        /* take a reference to the first frame published after the request */
+        current = input_wait_newer(&pglobal->in[input_number], input_sequence(&pglobal->in[input_number]), -1, NULL);
 
-        /* allow others to access the global buffer again */
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
+        if(current == NULL)
+            continue;
 
         /* only save a file if a name came in with the UDP message */
         if(strlen(udpbuffer) > 0) {
@@ -190,7 +174,7 @@ void *worker_thread(void *arg)
             }
 
             /* save picture to file */
-            if(write(fd, frame, frame_size) < 0) {
+            if(writev(fd, iov, frame_iov(current, iov)) < 0) {
                 OPRINT("could not write to file %s\n", udpbuffer);
                 perror("write()");
                 close(fd);
@@ -38,7 +38,7 @@
 
 static pthread_t worker;
 static globals *pglobal;
-static unsigned char *frame = NULL;
+static frame *current = NULL;
 static int input_number = 0;
 
 /******************************************************************************
@@ -70,7 +70,8 @@ void worker_cleanup(void *arg)
     first_run = 0;
     OPRINT("cleaning up resources allocated by worker thread\n");
 
-    free(frame);
+    frame_unref(current);
+    current = NULL;
     SDL_Quit();
 }
 
@@ -252,6 +253,7 @@ Return Value:
 ******************************************************************************/
 void *worker_thread(void *arg)
 {
+    unsigned long last_seq;
     int frame_size = 0, firstrun = 1;
 
     SDL_Surface *screen = NULL, *image = NULL;
@@ -267,28 +269,26 @@ void *worker_thread(void *arg)
         exit(EXIT_FAILURE);
     }
 
-    /* just allocate a large buffer for the JPEGs */
-    if((frame = malloc(4096 * 1024)) == NULL) {
-        OPRINT("not enough memory for worker thread\n");
-        exit(EXIT_FAILURE);
-    }
-
     /* set cleanup handler to cleanup allocated resources */
     pthread_cleanup_push(worker_cleanup, NULL);
 
+    last_seq = input_sequence(&pglobal->in[input_number]);
     while(!pglobal->stop) {
         DBG("waiting for fresh frame\n");
-        pthread_mutex_lock(&pglobal->in[input_number].db);
-        pthread_cond_wait(&pglobal->in[input_number].db_update, &pglobal->in[input_number].db);
+        frame_unref(current);
+        current = NULL;
 
-        /* read buffer */
-        frame_size = pglobal->in[input_number].size;
-        memcpy(frame, pglobal->in[input_number].buf, frame_size);
+        /* take a reference to the frame following the last one we got */
+        current = input_wait_newer(&pglobal->in[input_number], last_seq, -1, NULL);
 
-        pthread_mutex_unlock(&pglobal->in[input_number].db);
+        /* the decoder needs the picture in one piece, see frame_data() */
+        if(current == NULL || frame_data(current) == NULL)
+            continue;
+        last_seq = current->sequence;
+        frame_size = current->size;
 
         /* decompress the JPEG and store results in memory */
-        if(decompress_jpeg(frame, frame_size, &rgbimage)) {
+        if(decompress_jpeg(current->data, frame_size, &rgbimage)) {
             DBG("could not properly decompress JPEG data\n");
             continue;
         }
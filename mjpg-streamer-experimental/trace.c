@@ -0,0 +1,196 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "mjpg_streamer.h"
+
+int tracing = 0;
+
+static FILE *trace_file = NULL;
+static int chrome = 0;          /* write Chrome trace events instead of records */
+static int events = 0;          /* Chrome trace events written so far */
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/******************************************************************************
+Description.: converts a timestamp to nanoseconds
+Input Value.: ts is a CLOCK_MONOTONIC timestamp
+Return Value: nanoseconds, 0 if the timestamp was never taken
+******************************************************************************/
+static int64_t ts_ns(struct timespec *ts)
+{
+    return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+/******************************************************************************
+Description.: opens the trace file and starts tracing
+Input Value.: path of the file, a name ending with ".json" selects the Chrome
+              trace format, any other name binary records
+Return Value: 0 if tracing, -1 if the file could not be created
+******************************************************************************/
+int trace_open(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+
+    if((trace_file = fopen(path, "w")) == NULL)
+        return -1;
+
+    chrome = (dot != NULL && strcmp(dot, ".json") == 0);
+    if(chrome)
+        fprintf(trace_file, "[\n");
+    else
+        fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), trace_file);
+    fflush(trace_file);
+
+    tracing = 1;
+    return 0;
+}
+
+/******************************************************************************
+Description.: stops tracing and completes the trace file
+Input Value.: -
+Return Value: -
+******************************************************************************/
+void trace_close(void)
+{
+    pthread_mutex_lock(&trace_mutex);
+    if(trace_file != NULL) {
+        tracing = 0;
+        if(chrome)
+            fprintf(trace_file, "\n]\n");
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+/******************************************************************************
+Description.: writes a Chrome trace event spanning from start to end, the
+              caller holds trace_mutex
+Input Value.: name of the event, pid and tid group the events in the viewer
+              start and end in nanoseconds, the event is skipped if start is 0
+              seq is the sequence number of the frame
+Return Value: -
+******************************************************************************/
+static void chrome_event(const char *name, int pid, int tid, int64_t start, int64_t end, uint64_t seq)
+{
+    if(start == 0 || end < start)
+        return;
+
+    fprintf(trace_file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+            "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"sequence\":%llu}}",
+            (events++ > 0) ? ",\n" : "", name, pid, tid,
+            start / 1000.0, (end - start) / 1000.0, (unsigned long long)seq);
+}
+
+/******************************************************************************
+Description.: writes a record to the trace file
+Input Value.: r is the record
+Return Value: -
+******************************************************************************/
+static void trace_write(trace_record *r)
+{
+    int64_t published;
+
+    pthread_mutex_lock(&trace_mutex);
+    if(trace_file == NULL)
+        goto out;
+
+    if(!chrome) {
+        fwrite(r, sizeof(trace_record), 1, trace_file);
+        goto out;
+    }
+
+    /* the stages of each input and the sends to each client get a row of their own */
+    if(r->type == TRACE_FRAME) {
+        published = r->t[3];
+        chrome_event("capture", r->input, 0, r->t[0], r->t[1] ? r->t[1] : published, r->sequence);
+        chrome_event("encode", r->input, 0, r->t[1], r->t[2], r->sequence);
+        chrome_event("publish", r->input, 0, r->t[2] ? r->t[2] : (r->t[0] ? r->t[0] : published),
+                     published, r->sequence);
+    } else {
+        chrome_event("queued", r->input, (int)r->client, r->t[0], r->t[1], r->sequence);
+        chrome_event("send", r->input, (int)r->client, r->t[1], r->t[2], r->sequence);
+    }
+
+out:
+    /* once per frame, so the trace of a process that gets killed stays usable */
+    if(trace_file != NULL && r->type == TRACE_FRAME)
+        fflush(trace_file);
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+/******************************************************************************
+Description.: traces the capture of a published frame
+Input Value.: input is the number of the input, f the frame
+Return Value: -
+******************************************************************************/
+void trace_frame(int input, frame *f)
+{
+    trace_record r;
+
+    memset(&r, 0, sizeof(r));
+    r.type = TRACE_FRAME;
+    r.input = input;
+    r.sequence = f->sequence;
+    r.client = -1;
+    r.size = f->size;
+    r.t[0] = ts_ns(&f->dequeued);
+    r.t[1] = ts_ns(&f->encode_start);
+    r.t[2] = ts_ns(&f->encode_end);
+    r.t[3] = ts_ns(&f->published);
+
+    trace_write(&r);
+}
+
+/******************************************************************************
+Description.: traces a frame that was sent completely to a client, the last
+              byte is assumed to be sent now
+Input Value.: input is the number of the input, f the frame
+              client is the descriptor of the connection
+              size is the number of bytes sent
+              first is the time the first byte was sent
+Return Value: -
+******************************************************************************/
+void trace_send(int input, frame *f, int client, long size, struct timespec *first)
+{
+    struct timespec now;
+    trace_record r;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    memset(&r, 0, sizeof(r));
+    r.type = TRACE_SEND;
+    r.input = input;
+    r.sequence = f->sequence;
+    r.client = client;
+    r.size = size;
+    r.t[0] = ts_ns(&f->published);
+    r.t[1] = ts_ns(first);
+    r.t[2] = ts_ns(&now);
+
+    trace_write(&r);
+}
@@ -0,0 +1,85 @@
+/*******************************************************************************
+#                                                                              #
+#      MJPG-streamer allows to stream JPG frames from an input-plugin          #
+#      to several output plugins                                               #
+#                                                                              #
+#      Copyright (C) 2007 Tom Stöveken                                         #
+#                                                                              #
+# This program is free software; you can redistribute it and/or modify         #
+# it under the terms of the GNU General Public License as published by         #
+# the Free Software Foundation; version 2 of the License.                      #
+#                                                                              #
+# This program is distributed in the hope that it will be useful,              #
+# but WITHOUT ANY WARRANTY; without even the implied warranty of               #
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                #
+# GNU General Public License for more details.                                 #
+#                                                                              #
+# You should have received a copy of the GNU General Public License            #
+# along with this program; if not, write to the Free Software                  #
+# Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA    #
+#                                                                              #
+*******************************************************************************/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Tracing of the way of each frame from the camera to the clients.
+ *
+ * Frames carry the time they were dequeued from the driver and encoded,
+ * input_publish() adds the time of publishing. When mjpg_streamer is started
+ * with --trace, every published frame and every frame sent to a client is
+ * written to the trace file, either as binary trace_record structures or, if
+ * the file name ends with ".json", as Chrome trace events that can be opened
+ * with chrome://tracing or Perfetto.
+ *
+ * Independent of the trace file, the same points carry USDT probes of the
+ * provider "mjpg_streamer" if sys/sdt.h was found at build time, they cost a
+ * single nop while no tracer is attached.
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE_PROBE2(name, a, b)        DTRACE_PROBE2(mjpg_streamer, name, a, b)
+#define TRACE_PROBE3(name, a, b, c)     DTRACE_PROBE3(mjpg_streamer, name, a, b, c)
+#else
+#define TRACE_PROBE2(name, a, b)
+#define TRACE_PROBE3(name, a, b, c)
+#endif
+
+/* first bytes of a binary trace file */
+#define TRACE_MAGIC "MJPGTRC1"
+
+typedef enum {
+    TRACE_FRAME = 1,        /* a frame was published */
+    TRACE_SEND = 2          /* a frame was sent completely to a client */
+} trace_type;
+
+/*
+ * record of a binary trace file, in host byte order
+ * times are nanoseconds of CLOCK_MONOTONIC, 0 if unknown
+ *   TRACE_FRAME: t[0] dequeued, t[1] encoding started, t[2] encoding ended,
+ *                t[3] published
+ *   TRACE_SEND:  t[0] published, t[1] first byte sent, t[2] last byte sent
+ */
+typedef struct {
+    uint32_t type;
+    uint32_t input;
+    uint64_t sequence;
+    int64_t client;         /* descriptor of the connection, -1 for TRACE_FRAME */
+    int64_t size;           /* bytes of the frame or sent to the client */
+    int64_t t[4];
+} trace_record;
+
+/* set while a trace file is written, plugins may check it before taking stamps */
+extern int tracing;
+
+int trace_open(const char *path);
+void trace_close(void);
+void trace_frame(int input, struct _frame *f);
+void trace_send(int input, struct _frame *f, int client, long size, struct timespec *first);
+
+#endif